@@ -0,0 +1,77 @@
+#!/usr/bin/env python3
+"""Arithmetic microbenchmark: run time of straight-line binaries dominated by *, / and %.
+
+Hydrogen has no loops, so each program is a long unrolled chain of updates. It is built with
+--no-fold so that nothing is evaluated at compile time, and every run executes the whole chain.
+
+    bench/arith.py [--hydro PATH]... [--march LEVEL]... [--blocks N] [--repeat N]
+
+Each --hydro is benchmarked in turn (default: build/hydro), which compares builds of two revisions.
+Each is built for every --march level (default: each of x86-64 to x86-64-v4 that this CPU runs,
+found by running `exit(0);` with --jit at that level).
+"""
+
+import argparse
+import os
+
+from common import Workdir, best_of, build_elf, find_hydro, interleaved, ms, run, write_source
+
+# Each kind repeats one block of updates. The dividends of the `unsigned` block are provably
+# non-negative, those of `signed` are not.
+BLOCKS = {
+    "const-signed": "s = s * 31 / 7 + s % 1000 - t / 10;\nt = t * 17 % 65521 - s / 3;\n",
+    "const-unsigned": "s = (s % 1000003 + 1000003) / 7 + (t % 1000 + 1000) % 10;\n"
+    "t = (t % 65521 + 65521) * 17 / 3 + (s % 99 + 99) / 10;\n",
+    "const-pow2": "s = s * 31 / 8 + s % 1024 - t / 16;\nt = t * 17 % 4096 - s / 4;\n",
+    "variable": "s = s * 31 / (t % 7 - 9) + s % (t % 5 + 11);\nt = t * 17 % (s % 9 + 13) - s / (s % 3 - 5);\n",
+    "variable-unsigned": "s = (s % 1000003 + 1000003) / (t % 7 + 9) + (s % 99 + 99) % (t % 5 + 11);\n"
+    "t = (t % 65521 + 65521) * 17 / (s % 9 + 13) + 1;\n",
+}
+
+
+LEVELS = ["x86-64", "x86-64-v2", "x86-64-v3", "x86-64-v4"]
+
+
+def program(block, count):
+    return "let s = 987654321;\nlet t = 12345;\n" + block * count + "exit((s + t) % 256);\n"
+
+
+def host_levels(hydro, workdir, source):
+    """The --march levels whose code runs on this CPU."""
+    levels = []
+    for level in LEVELS:
+        if run([str(hydro), "--jit", f"--march={level}", str(source)], cwd=workdir)[0] == 0:
+            levels.append(level)
+    return levels
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--hydro", action="append", help="hydro binary to benchmark (repeatable)")
+    parser.add_argument("--march", action="append", choices=LEVELS, help="target level (repeatable)")
+    parser.add_argument("--blocks", type=int, default=20000, help="copies of each block (default: 20000)")
+    parser.add_argument("--repeat", type=int, default=50, help="runs of each binary (default: 50)")
+    args = parser.parse_args()
+
+    hydros = [find_hydro(path) for path in args.hydro or [None]]
+    with Workdir() as workdir:
+        source = write_source(workdir, "exit(0);\n", "empty.hy")
+        empty = best_of([str(build_elf(hydros[0], source, workdir))], args.repeat, cwd=workdir)[1]
+        levels = args.march or host_levels(hydros[0], workdir, source)
+        print(f"{'empty program':<20} {ms(empty)}  (process start-up, included below)")
+        print(f"{'':<20} {'march':<10} {'fastest':>12} {'median':>12} {'size':>10}")
+        for kind, block in BLOCKS.items():
+            source = write_source(workdir, program(block, args.blocks))
+            builds = [(hydro, level) for hydro in hydros for level in levels]
+            binaries = []
+            for i, (hydro, level) in enumerate(builds):
+                binary = build_elf(hydro, source, workdir, ["--no-fold", f"--march={level}"])
+                binaries.append(str(binary.rename(workdir / f"out{i}")))
+            results = interleaved([[binary] for binary in binaries], args.repeat, cwd=workdir)
+            for (hydro, level), binary, (status, fastest, median) in zip(builds, binaries, results):
+                size = os.path.getsize(binary)
+                print(f"{kind:<20} {level:<10} {ms(fastest)} {ms(median)} {size:>10}  exit={status:<3} {hydro}")
+
+
+if __name__ == "__main__":
+    main()
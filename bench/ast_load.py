@@ -0,0 +1,48 @@
+#!/usr/bin/env python3
+"""Loading a saved AST against parsing the source again.
+
+    bench/ast_load.py [--hydro PATH] [--statements N]... [--seed N] [--repeat N] [-- BACKEND FLAGS...]
+
+Each program from gen_program.py (--no-exit --no-trap) is saved with --emit-ast, then built from
+prog.hy and from prog.hyast with the same backend flags (default: --elf --no-fold), interleaved.
+The difference is what lexing and parsing cost over reading the binary tree.
+"""
+
+import argparse
+import os
+from pathlib import Path
+
+from common import Workdir, find_hydro, interleaved, ms, run, write_source
+from gen_program import generate
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--hydro", help="hydro binary to benchmark (default: build/hydro)")
+    parser.add_argument("--statements", type=int, action="append", help="top-level statements (repeatable)")
+    parser.add_argument("--seed", type=int, default=1, help="seed of the generated programs (default: 1)")
+    parser.add_argument("--repeat", type=int, default=10, help="runs of each build (default: 10)")
+    parser.add_argument("backend", nargs="*", default=["--elf", "--no-fold"], help="flags of both builds")
+    args = parser.parse_args()
+
+    hydro = find_hydro(args.hydro)
+    print(f"backend flags: {' '.join(args.backend)}")
+    print(f"{'statements':>10} {'.hy bytes':>10} {'.hyast bytes':>12}  {'input':<6} {'fastest':>12} {'median':>12}")
+    with Workdir() as workdir:
+        for statements in args.statements or [1000, 5000, 20000]:
+            source = write_source(workdir, generate(args.seed, statements=statements, exits=False, traps=False))
+            code, _, _ = run([str(hydro), "--emit-ast", "prog.hy"], cwd=workdir)
+            if code != 0:
+                raise SystemExit(f"hydro --emit-ast failed with status {code}")
+            ast = (Path(workdir) / "out.hyast").rename(Path(workdir) / "prog.hyast")
+            sizes = f"{statements:>10} {os.path.getsize(source):>10} {os.path.getsize(ast):>12}"
+            inputs = [("hy", "prog.hy"), ("hyast", "prog.hyast")]
+            results = interleaved([[str(hydro), *args.backend, name] for _, name in inputs], args.repeat, cwd=workdir)
+            for (label, _), (status, fastest, median) in zip(inputs, results):
+                if status != 0:
+                    raise SystemExit(f"hydro {' '.join(args.backend)} {label} failed with status {status}")
+                print(f"{sizes}  {label:<6} {ms(fastest)} {ms(median)}")
+
+
+if __name__ == "__main__":
+    main()
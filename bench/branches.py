@@ -0,0 +1,129 @@
+#!/usr/bin/env python3
+"""Branch-heavy benchmark: run time of binaries made of ifs whose predicates are random at run time.
+
+Each block advances a linear congruential generator and branches on its bits, so no if can be
+predicted from the ones before it. --skew P makes the likely outcome of every block P% likely:
+the first arm of a two-way if is the unlikely one, and one value of a ladder is taken P% of the
+time. Programs are built with --elf --no-fold, with and without --no-if-lowering, and each of
+those again with --profile-use of a profile from an --instrument build. The instrumented binary
+is run from another start value of the generator, so that the profile predicts the timed run only
+as well as the skew does. The binaries are run interleaved.
+
+    bench/branches.py [--hydro PATH] [--blocks N] [--skew P]... [--repeat N] [--seed N]
+
+--skew is from 50 to 99 and can be given more than once (default: 50, 90 and 99).
+
+Kinds of block:
+    select  `if (unlikely) { x = a; } else { x = b; }`, lowered to cmov
+    ladder  an elif ladder over 8 values of a random variable, lowered to a jump table
+    mixed   either of those, or an if whose arms do more than assign, which stays a branch
+"""
+
+import argparse
+import os
+import random
+
+from common import Workdir, build_elf, find_hydro, interleaved, ms, run, write_source
+
+NEXT = "s = (s * 1103515245 + 12345) % 2147483648;\n"
+# Start values of the generator in the timed and the instrumented runs.
+START = 12345
+TRAIN_START = 54321
+
+
+def unlikely(rand, skew):
+    """A predicate that is 1 in 100 - skew percent of runs and 0 otherwise, for a skew of 50 to 99."""
+    return f"(s / {2 ** rand.randint(8, 20)}) % 100 / {skew}"
+
+
+def select(rand, skew):
+    return (
+        NEXT + f"if ({unlikely(rand, skew)}) {{\n    x = x + {rand.randint(1, 9)};\n}} else {{\n"
+        f"    x = x - {rand.randint(1, 9)};\n}}\n"
+    )
+
+
+def ladder(rand, skew):
+    values = list(range(8))
+    rand.shuffle(values)
+    arms = [
+        f"{'if' if i == 0 else '} elif'} (k == {value}) {{\n"
+        f"    y = y + x * {rand.randint(2, 9)};\n    x = x + {value};\n"
+        for i, value in enumerate(values[:7])
+    ]
+    # 0 in skew percent of runs, otherwise 1 to 7.
+    pick = f"k = {unlikely(rand, skew)} * ((s / 65536) % 7 + 1);\n"
+    return NEXT + pick + "".join(arms) + "} else {\n    y = y - 1;\n}\n"
+
+
+def plain(rand, skew):
+    return (
+        NEXT + f"if ({unlikely(rand, skew)}) {{\n    x = x + y;\n    y = y - {rand.randint(1, 9)};\n}} else {{\n"
+        f"    y = y + x;\n    x = x * {rand.randint(2, 3)};\n}}\n"
+    )
+
+
+KINDS = {
+    "select": [select],
+    "ladder": [ladder],
+    "mixed": [select, ladder, plain],
+}
+
+
+def program(kind, blocks, seed, skew, start):
+    rand = random.Random(seed)
+    body = "".join(rand.choice(KINDS[kind])(rand, skew) for _ in range(blocks))
+    return f"let s = {start};\nlet x = 0;\nlet y = 0;\nlet k = 0;\n" + body + "exit((x + y + k) % 256);\n"
+
+
+def record_profile(hydro, workdir, kind, args, skew):
+    """Writes workdir/out.prof from an instrumented run of the program started at TRAIN_START."""
+    source = write_source(workdir, program(kind, args.blocks, args.seed, skew, TRAIN_START))
+    binary = build_elf(hydro, source, workdir, ["--no-fold", "--instrument"])
+    run([str(binary)], cwd=workdir)
+    if not (workdir / "out.prof").is_file():
+        raise SystemExit(f"the instrumented {kind} program wrote no out.prof")
+
+
+def skew_percent(text):
+    skew = int(text)
+    if not 50 <= skew <= 99:
+        raise argparse.ArgumentTypeError(f"{skew} is not from 50 to 99")
+    return skew
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--hydro", help="hydro binary to benchmark (default: build/hydro)")
+    parser.add_argument("--blocks", type=int, default=20000, help="blocks in each program (default: 20000)")
+    parser.add_argument("--skew", type=skew_percent, action="append", help="percent of runs taking the likely arm")
+    parser.add_argument("--repeat", type=int, default=50, help="runs of each binary (default: 50)")
+    parser.add_argument("--seed", type=int, default=1, help="seed of the block shapes (default: 1)")
+    args = parser.parse_args()
+
+    hydro = find_hydro(args.hydro)
+    variants = [
+        ("branches", ["--no-if-lowering"]),
+        ("branches+pgo", ["--no-if-lowering", "--profile-use=out.prof"]),
+        ("lowered", []),
+        ("lowered+pgo", ["--profile-use=out.prof"]),
+    ]
+    print(f"{'':<24} {'fastest':>12} {'median':>12} {'size':>10}")
+    with Workdir() as workdir:
+        for skew in args.skew or [50, 90, 99]:
+            for kind in KINDS:
+                record_profile(hydro, workdir, kind, args, skew)
+                source = write_source(workdir, program(kind, args.blocks, args.seed, skew, START))
+                binaries = []
+                for name, flags in variants:
+                    binary = build_elf(hydro, source, workdir, ["--no-fold", *flags]).rename(workdir / name)
+                    binaries.append(str(binary))
+                results = interleaved([[binary] for binary in binaries], args.repeat, cwd=workdir)
+                for (name, _), binary, (status, fastest, median) in zip(variants, binaries, results):
+                    size = os.path.getsize(binary)
+                    label = f"{skew}% {kind} {name}"
+                    print(f"{label:<24} {ms(fastest)} {ms(median)} {size:>10}  exit={status}")
+
+
+if __name__ == "__main__":
+    main()
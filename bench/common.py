@@ -0,0 +1,92 @@
+"""Helpers shared by the benchmark scripts: building programs with hydro and timing processes."""
+
+import os
+import shutil
+import statistics
+import subprocess
+import tempfile
+import time
+from pathlib import Path
+
+REPO = Path(__file__).resolve().parent.parent
+DEFAULT_HYDRO = REPO / "build" / "hydro"
+
+
+def find_hydro(path=None):
+    """The hydro binary to benchmark: `path`, or build/hydro of this checkout."""
+    hydro = Path(path) if path else DEFAULT_HYDRO
+    if not hydro.is_file():
+        raise SystemExit(f"hydro not found at {hydro}; build it or pass --hydro")
+    return hydro.resolve()
+
+
+def run(cmd, cwd=None, stdin=None):
+    """Runs `cmd` and returns (exit status, wall seconds, peak RSS in KiB).
+
+    A process killed by a signal reports 128 + the signal number, as a shell would.
+    """
+    start = time.perf_counter()
+    proc = subprocess.Popen(cmd, cwd=cwd, stdin=stdin, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    _, status, usage = os.wait4(proc.pid, 0)
+    elapsed = time.perf_counter() - start
+    code = proc.returncode = os.waitstatus_to_exitcode(status)
+    return (code if code >= 0 else 128 - code), elapsed, usage.ru_maxrss
+
+
+def best_of(cmd, repeat, cwd=None):
+    """The fastest of `repeat` runs of `cmd`, as (exit status, wall seconds, peak RSS in KiB)."""
+    return min((run(cmd, cwd=cwd) for _ in range(repeat)), key=lambda result: result[1])
+
+
+def interleaved(cmds, repeat, cwd=None):
+    """Runs each of `cmds` `repeat` times, taking turns so that drift in machine load hits all of them
+    alike. Returns (exit status, fastest, median wall seconds) per command."""
+    return interleaved_steps([[cmd] for cmd in cmds], repeat, cwd=cwd)
+
+
+def interleaved_steps(pipelines, repeat, cwd=None):
+    """Like `interleaved`, for pipelines of commands run one after the other, such as a build and a run
+    of its output. A pipeline's time is the sum of its commands' and its status is the last one's."""
+    times = [[] for _ in pipelines]
+    codes = [None] * len(pipelines)
+    for _ in range(repeat):
+        for i, pipeline in enumerate(pipelines):
+            elapsed = 0.0
+            for cmd in pipeline:
+                codes[i], seconds, _ = run(cmd, cwd=cwd)
+                elapsed += seconds
+            times[i].append(elapsed)
+    return [(code, min(t), statistics.median(t)) for code, t in zip(codes, times)]
+
+
+class Workdir:
+    """A temporary directory to build in, since hydro writes `out`, `out.asm` and `out.o` to its cwd."""
+
+    def __enter__(self):
+        self.path = Path(tempfile.mkdtemp(prefix="hydro-bench-"))
+        return self.path
+
+    def __exit__(self, *exc):
+        shutil.rmtree(self.path, ignore_errors=True)
+
+
+def write_source(workdir, text, name="prog.hy"):
+    path = Path(workdir) / name
+    path.write_text(text)
+    return path
+
+
+def build_elf(hydro, source, workdir, flags=()):
+    """Builds `source` into workdir/out with --elf; returns the path of the executable."""
+    code, _, _ = run([str(hydro), "--elf", *flags, str(source)], cwd=workdir)
+    if code != 0:
+        raise SystemExit(f"{hydro} --elf {' '.join(flags)} {source} failed with status {code}")
+    return Path(workdir) / "out"
+
+
+def have_tools(*tools):
+    return all(shutil.which(tool) for tool in tools)
+
+
+def ms(seconds):
+    return f"{seconds * 1000:9.3f} ms"
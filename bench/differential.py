@@ -0,0 +1,71 @@
+#!/usr/bin/env python3
+"""Differential test: runs random programs in every execution mode and compares their exit statuses.
+
+    bench/differential.py [--hydro PATH] [--count N] [--first SEED] [--cmp] [--repeat] [--keep DIR]
+
+Each program from gen_program.py is run with --interp, --run, --jit and as an --elf binary, and
+also through nasm and ld when both are installed. A program whose modes disagree is reported with
+the status of each mode and copied to --keep (default: the current directory). The exit status is
+the number of disagreeing programs, capped at 100.
+"""
+
+import argparse
+import shutil
+from pathlib import Path
+
+from common import Workdir, find_hydro, have_tools, run, write_source
+from gen_program import generate
+
+
+def modes(hydro, with_nasm):
+    """(name, list of commands) of each mode. The last command's exit status is the result."""
+    result = [
+        ("interp", [[str(hydro), "--interp", "prog.hy"]]),
+        ("run", [[str(hydro), "--run", "prog.hy"]]),
+        ("jit", [[str(hydro), "--jit", "prog.hy"]]),
+        ("elf", [[str(hydro), "--elf", "prog.hy"], ["./out"]]),
+    ]
+    if with_nasm:
+        result.append(("nasm", [[str(hydro), "prog.hy"], ["./out"]]))
+    return result
+
+
+def run_mode(commands, workdir):
+    (workdir / "out").unlink(missing_ok=True)
+    for cmd in commands[:-1]:
+        code, _, _ = run(cmd, cwd=workdir)
+        if code != 0:
+            return f"build failed ({code})"
+    return run(commands[-1], cwd=workdir)[0]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--hydro", help="hydro binary to test (default: build/hydro)")
+    parser.add_argument("--count", type=int, default=200, help="number of programs (default: 200)")
+    parser.add_argument("--first", type=int, default=1, help="seed of the first program (default: 1)")
+    parser.add_argument("--cmp", action="store_true", help="also generate comparisons, cmov and jump table shapes")
+    parser.add_argument("--repeat", action="store_true", help="repeat subexpressions")
+    parser.add_argument("--keep", default=".", help="where to copy disagreeing programs (default: .)")
+    args = parser.parse_args()
+
+    hydro = find_hydro(args.hydro)
+    with_nasm = have_tools("nasm", "ld")
+    if not with_nasm:
+        print("nasm or ld not found: skipping the nasm mode")
+    failures = 0
+    with Workdir() as workdir:
+        for seed in range(args.first, args.first + args.count):
+            source = write_source(workdir, generate(seed, cmp=args.cmp, repeat=args.repeat))
+            results = {name: run_mode(commands, workdir) for name, commands in modes(hydro, with_nasm)}
+            if len(set(results.values())) != 1:
+                failures += 1
+                kept = Path(args.keep) / f"differential-{seed}.hy"
+                shutil.copy(source, kept)
+                print(f"seed {seed}: " + ", ".join(f"{name}={code}" for name, code in results.items()) + f" -> {kept}")
+    print(f"{args.count} programs, {failures} disagreeing")
+    raise SystemExit(min(failures, 100))
+
+
+if __name__ == "__main__":
+    main()
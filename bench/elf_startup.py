@@ -0,0 +1,71 @@
+#!/usr/bin/env python3
+"""Size and exec latency of the binaries --elf writes, against those nasm and ld make from out.asm.
+
+    bench/elf_startup.py [--hydro PATH] [--statements N]... [--seed N] [--execs N] [--batch N]
+
+Each program from gen_program.py (--no-exit --no-trap; 0 statements is `exit(0);`) is built with
+--elf --no-fold and, if nasm and ld are installed, with the default pipeline. The size of each binary
+is reported, then each is run --execs times with posix_spawn, in interleaved batches of --batch
+execs, and the time per exec of the fastest and the median batch is reported.
+"""
+
+import argparse
+import os
+import statistics
+import time
+
+from common import Workdir, build_elf, find_hydro, have_tools, run, write_source
+from gen_program import generate
+
+
+def build_ld(hydro, workdir):
+    """Builds workdir/prog.hy into workdir/out through nasm and ld; returns the path of the executable."""
+    out = workdir / "out"
+    out.unlink(missing_ok=True)
+    code, _, _ = run([str(hydro), "--no-fold", "prog.hy"], cwd=workdir)
+    if code != 0 or not out.is_file():
+        raise SystemExit(f"{hydro} --no-fold prog.hy failed with status {code}")
+    return out
+
+
+def spawn_batch(binary, execs):
+    """Seconds taken to spawn `binary` and wait for it `execs` times."""
+    argv = [str(binary)]
+    start = time.perf_counter()
+    for _ in range(execs):
+        os.waitpid(os.posix_spawn(argv[0], argv, {}), 0)
+    return time.perf_counter() - start
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--hydro", help="hydro binary to benchmark (default: build/hydro)")
+    parser.add_argument("--statements", type=int, action="append", help="top-level statements (repeatable)")
+    parser.add_argument("--seed", type=int, default=1, help="seed of the generated programs (default: 1)")
+    parser.add_argument("--execs", type=int, default=4000, help="execs of each binary (default: 4000)")
+    parser.add_argument("--batch", type=int, default=100, help="execs timed together (default: 100)")
+    args = parser.parse_args()
+
+    hydro = find_hydro(args.hydro)
+    with_ld = have_tools("nasm", "ld")
+    if not with_ld:
+        print("nasm or ld not found: measuring the --elf binaries only")
+    print(f"{'statements':>10}  {'binary':<6} {'bytes':>8} {'fastest':>12} {'median':>12}")
+    with Workdir() as workdir:
+        for statements in args.statements or [0, 100, 1000]:
+            write_source(workdir, generate(args.seed, statements=statements, exits=False, traps=False))
+            binaries = [("elf", build_elf(hydro, "prog.hy", workdir, ["--no-fold"]).rename(workdir / "elf"))]
+            if with_ld:
+                binaries.append(("ld", build_ld(hydro, workdir).rename(workdir / "ld")))
+            batches = [[] for _ in binaries]
+            for _ in range(max(1, args.execs // args.batch)):
+                for times, (_, binary) in zip(batches, binaries):
+                    times.append(spawn_batch(binary, args.batch) / args.batch)
+            for (name, binary), times in zip(binaries, batches):
+                fastest, median = min(times) * 1e6, statistics.median(times) * 1e6
+                size = binary.stat().st_size
+                print(f"{statements:>10}  {name:<6} {size:>8} {fastest:>9.1f} us {median:>9.1f} us")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,208 @@
+#!/usr/bin/env python3
+"""Random Hydrogen programs for differential testing and benchmarks.
+
+    bench/gen_program.py SEED [--cmp] [--repeat] [--statements N] [--no-exit] [--no-trap]
+
+Prints a valid program: every name is declared before use and in scope, and there is no shadowing.
+Some divisors and array indices are computed, so a program may divide by zero or index out of
+bounds, which every mode must report alike; --no-trap keeps those in range so that the program runs
+to its end. The same seed and options always give the same program.
+"""
+
+import argparse
+import random
+
+LITERALS = [0, 1, 2, 3, 5, 7, 10, 100]
+DIVISORS = [1, 2, 3, -3, 4, 7, 8, 10, -1, 16, 1000]
+ARRAY_LENS = [1, 2, 3, 4, 5, 8, 9, 17, 20]
+MAX_EXPR_DEPTH = 3
+MAX_BLOCK_DEPTH = 3
+
+
+class ProgramGenerator:
+    def __init__(self, seed, cmp=False, repeat=False, exits=True, traps=True):
+        self.rand = random.Random(seed)
+        # Also use `==` and `!=`, and the if shapes lowered to cmov and jump tables.
+        self.cmp = cmp
+        # Reuse earlier subexpressions, so that common subexpression elimination has work to do.
+        self.repeat = repeat
+        # Put `exit` statements in the middle of the program, not only at its end.
+        self.exits = exits
+        # Compute divisors and array indices that may be out of range.
+        self.traps = traps
+        self.lines = []
+        # Variables in scope, outermost first, and where each open block's variables start.
+        self.scalar_vars = []
+        self.array_vars = []
+        self.scopes = []
+        self.count = 0
+        # (scope depth, text) of parenthesized expressions that may be repeated.
+        self.pool = []
+
+    def program(self, statements=None):
+        for _ in range(statements if statements is not None else self.rand.randint(3, 25)):
+            self.stmt(0)
+        scalars = self.scalars()[:6]
+        self.lines.append(f"exit({' + '.join(scalars) or '0'});")
+        return "\n".join(self.lines) + "\n"
+
+    def scalars(self):
+        return self.scalar_vars
+
+    def arrays(self):
+        return self.array_vars
+
+    def new_name(self, prefix):
+        self.count += 1
+        return f"{prefix}{self.count}"
+
+    def expr(self, depth=0):
+        if self.repeat and self.pool and self.rand.random() < 0.3:
+            return self.rand.choice(self.pool)[1]
+        text = self.fresh_expr(depth)
+        if self.repeat and text.startswith("("):
+            self.pool.append((len(self.scopes), text))
+        return text
+
+    def fresh_expr(self, depth):
+        rand = self.rand
+        if depth > MAX_EXPR_DEPTH or rand.random() < 0.3:
+            choice = rand.random()
+            if self.scalars() and choice < 0.5:
+                return rand.choice(self.scalars())
+            if self.arrays() and choice < 0.65:
+                name, length = rand.choice(self.arrays())
+                if rand.random() < 0.5:
+                    return f"{name}[{rand.randint(0, length - 1)}]"
+                if self.traps:
+                    return f"{name}[({self.expr(depth + 1)}) % {length}]"
+                return f"{name}[(({self.expr(depth + 1)}) % {length} + {length}) % {length}]"
+            value = rand.choice(LITERALS + [rand.randint(0, 10**6)])
+            return str(value) if rand.random() < 0.8 else f"-{value}"
+        op = rand.choice(["+", "-", "*", "/", "%"] + (["==", "!="] if self.cmp else []))
+        if op in "/%":
+            choice = rand.random()
+            if choice < 0.7:
+                return f"({self.expr(depth + 1)} {op} {rand.choice(DIVISORS)})"
+            if choice < 0.95 or not self.traps:
+                # `x % k + k + 1` is never zero, so most divisions run to completion.
+                k = rand.randint(2, 9)
+                return f"({self.expr(depth + 1)} {op} ({self.expr(depth + 1)} % {k} + {k + 1}))"
+        return f"({self.expr(depth + 1)} {op} {self.expr(depth + 1)})"
+
+    def emit(self, depth, text):
+        self.lines.append("    " * depth + text)
+
+    def declare(self, depth, prefix, text, length=None):
+        name = self.new_name(prefix)
+        self.emit(depth, text.format(name=name))
+        if length is None:
+            self.scalar_vars.append(name)
+        else:
+            self.array_vars.append((name, length))
+        return name
+
+    def stmt(self, depth):
+        rand = self.rand
+        choice = rand.random()
+        if choice < 0.25:
+            self.declare(depth, "v", f"let {{name}} = {self.expr()};")
+        elif choice < 0.32:
+            length = rand.choice(ARRAY_LENS)
+            keyword = "static" if rand.random() < 0.3 else "let"
+            self.declare(depth, "a", f"{keyword} {{name}}[{length}];", length)
+        elif choice < 0.45 and self.scalars():
+            self.emit(depth, f"{rand.choice(self.scalars())} = {self.expr()};")
+        elif choice < 0.52 and self.arrays():
+            name, length = rand.choice(self.arrays())
+            self.emit(depth, f"{name}[{rand.randint(0, length - 1)}] = {self.expr()};")
+        elif choice < 0.57 and self.arrays():
+            self.elementwise(depth)
+        elif self.cmp and choice < 0.62 and self.scalars():
+            self.select(depth)
+        elif self.cmp and choice < 0.68 and depth < MAX_BLOCK_DEPTH:
+            self.ladder(depth)
+        elif choice < 0.75 and depth < MAX_BLOCK_DEPTH:
+            self.emit(depth, f"if ({self.expr()}) {{")
+            self.block(depth)
+            while rand.random() < 0.4:
+                self.emit(depth, f"}} elif ({self.expr()}) {{")
+                self.block(depth)
+            if rand.random() < 0.5:
+                self.emit(depth, "} else {")
+                self.block(depth)
+            self.emit(depth, "}")
+        elif choice < 0.8 and depth < MAX_BLOCK_DEPTH:
+            self.emit(depth, "{")
+            self.block(depth)
+            self.emit(depth, "}")
+        elif choice < 0.83 and self.exits:
+            self.emit(depth, f"exit({self.expr()});")
+        else:
+            self.declare(depth, "v", f"let {{name}} = {self.expr()};")
+
+    # An element-wise assignment over arrays of one length, mixed with scalar operands.
+    def elementwise(self, depth):
+        rand = self.rand
+        name, length = rand.choice(self.arrays())
+        same = [other for other, other_length in self.arrays() if other_length == length]
+        terms = [rand.choice(same) if rand.random() < 0.6 else self.expr(3) for _ in range(rand.randint(1, 3))]
+        text = terms[0]
+        for term in terms[1:]:
+            text = f"({text} {rand.choice(['+', '-', '+', '*'])} {term})"
+        self.emit(depth, f"{name} = {text};")
+
+    # A two-armed if that only assigns one variable, the shape lowered to cmov.
+    def select(self, depth):
+        name = self.rand.choice(self.scalars())
+        self.emit(depth, f"if ({self.expr()}) {{")
+        self.emit(depth + 1, f"{name} = {self.expr(2)};")
+        if self.rand.random() < 0.7:
+            self.emit(depth, "} else {")
+            self.emit(depth + 1, f"{name} = {self.expr(2)};")
+        self.emit(depth, "}")
+
+    # An elif ladder comparing one variable against small constants, the shape lowered to a jump table.
+    def ladder(self, depth):
+        rand = self.rand
+        modulus = rand.randint(3, 9)
+        name = self.declare(depth, "v", f"let {{name}} = ({self.expr()}) % {modulus};")
+        for i in range(rand.randint(3, 8)):
+            value = rand.randint(-modulus, modulus)
+            test = f"{name} == {value}" if rand.random() < 0.7 else f"{value} == {name}"
+            self.emit(depth, f"{'if' if i == 0 else '} elif'} ({test}) {{")
+            self.block(depth)
+        if rand.random() < 0.6:
+            self.emit(depth, "} else {")
+            self.block(depth)
+        self.emit(depth, "}")
+
+    def block(self, depth):
+        self.scopes.append((len(self.scalar_vars), len(self.array_vars)))
+        for _ in range(self.rand.randint(0, 4)):
+            self.stmt(depth + 1)
+        scalars, arrays = self.scopes.pop()
+        del self.scalar_vars[scalars:]
+        del self.array_vars[arrays:]
+        self.pool = [entry for entry in self.pool if entry[0] <= len(self.scopes)]
+
+
+def generate(seed, cmp=False, repeat=False, statements=None, exits=True, traps=True):
+    """The program for `seed`; `statements` top-level statements, or a random few."""
+    return ProgramGenerator(seed, cmp=cmp, repeat=repeat, exits=exits, traps=traps).program(statements)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("seed", type=int)
+    parser.add_argument("--cmp", action="store_true", help="also use comparisons, cmov and jump table shapes")
+    parser.add_argument("--repeat", action="store_true", help="repeat subexpressions")
+    parser.add_argument("--statements", type=int, help="number of top-level statements (default: 3 to 25)")
+    parser.add_argument("--no-exit", action="store_true", help="only exit at the end of the program")
+    parser.add_argument("--no-trap", action="store_true", help="keep divisors and array indices in range")
+    args = parser.parse_args()
+    print(generate(args.seed, args.cmp, args.repeat, args.statements, not args.no_exit, not args.no_trap), end="")
+
+
+if __name__ == "__main__":
+    main()
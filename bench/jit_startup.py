@@ -0,0 +1,58 @@
+#!/usr/bin/env python3
+"""Start-up latency of --jit: time from invoking hydro to the exit status of a small program.
+
+    bench/jit_startup.py [--hydro PATH] [--statements N]... [--seed N] [--fold] [--repeat N]
+
+Each program from gen_program.py (--no-exit --no-trap; 0 statements is `exit(0);`) is run with
+--jit, built with --elf and run, and built through nasm and ld and run. Without nasm or ld, the
+last only compiles and writes out.asm, a lower bound for that pipeline. Programs are built with
+--no-fold unless --fold is given, so that the generated code is encoded and run rather than
+evaluated at compile time.
+"""
+
+import argparse
+
+from common import Workdir, find_hydro, have_tools, interleaved_steps, ms, write_source
+from gen_program import generate
+
+
+def pipelines(hydro, flags, with_nasm):
+    hydro = [str(hydro), *flags]
+    result = [
+        ("jit", [[*hydro, "--jit", "prog.hy"]]),
+        ("elf + run", [[*hydro, "--elf", "prog.hy"], ["./out"]]),
+    ]
+    if with_nasm:
+        result.append(("nasm + ld + run", [[*hydro, "prog.hy"], ["./out"]]))
+    else:
+        result.append(("out.asm only", [[*hydro, "prog.hy"]]))
+    return result
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--hydro", help="hydro binary to benchmark (default: build/hydro)")
+    parser.add_argument("--statements", type=int, action="append", help="top-level statements (repeatable)")
+    parser.add_argument("--seed", type=int, default=1, help="seed of the generated programs (default: 1)")
+    parser.add_argument("--fold", action="store_true", help="let hydro evaluate programs at compile time")
+    parser.add_argument("--repeat", type=int, default=100, help="runs of each pipeline (default: 100)")
+    args = parser.parse_args()
+
+    hydro = find_hydro(args.hydro)
+    with_nasm = have_tools("nasm", "ld")
+    if not with_nasm:
+        print("nasm or ld not found: timing the compilation to out.asm only")
+    flags = [] if args.fold else ["--no-fold"]
+    print(f"{'statements':>10} {'bytes':>8}  {'pipeline':<16} {'fastest':>12} {'median':>12}")
+    with Workdir() as workdir:
+        for statements in args.statements or [0, 10, 100]:
+            text = generate(args.seed, statements=statements, exits=False, traps=False)
+            write_source(workdir, text)
+            named = pipelines(hydro, flags, with_nasm)
+            results = interleaved_steps([pipeline for _, pipeline in named], args.repeat, cwd=workdir)
+            for (name, _), (status, fastest, median) in zip(named, results):
+                print(f"{statements:>10} {len(text):>8}  {name:<16} {ms(fastest)} {ms(median)}  exit={status}")
+
+
+if __name__ == "__main__":
+    main()
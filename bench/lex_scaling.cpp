@@ -0,0 +1,151 @@
+// Scaling of Tokenizer::tokenize_parallel with the number of threads.
+//
+//     hydro_lex_bench [--threads=N] [--repeat=N] [--mib=N] [FILE]
+//
+// Lexes FILE, or a generated source of about --mib MiB (default 64) with line and block comments,
+// some of them spanning many lines, on 1 to N threads (default: one per core). For each thread
+// count it reports the fastest of --repeat runs (default 5), the speedup over one thread, and
+// whether the tokens, with their line numbers, are those of Tokenizer::tokenize.
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "../src/tokenization.hpp"
+
+namespace {
+
+std::string generated_source(const size_t bytes)
+{
+    std::string src;
+    src.reserve(bytes + 256);
+    for (size_t i = 1; src.size() < bytes; i++) {
+        const std::string v = "v" + std::to_string(i);
+        src += "let " + v + " = (" + std::to_string(i * 7919 % 100000) + " * 31 + 7) / 3; // line comment\n";
+        src += "if (" + v + " % 5) {\n    " + v + " = " + v + " - 1;\n} elif (" + v + ") {\n    exit(" + v + ");\n}\n";
+        if (i % 16 == 0) {
+            src += "/* a block comment\n   over three lines, with ; and ( inside\n */\n";
+        }
+        if (i % 4096 == 0) {
+            // Long enough to straddle a chunk boundary.
+            src += "/*\n";
+            for (int line = 0; line < 20000; line++) {
+                src += "   let commented_out = 1;\n";
+            }
+            src += "*/\n";
+        }
+    }
+    return src;
+}
+
+bool same_tokens(const std::vector<Token>& a, const std::vector<Token>& b)
+{
+    return std::ranges::equal(a, b, [](const Token& x, const Token& y) {
+        return x.type == y.type && x.line == y.line && x.value == y.value;
+    });
+}
+
+// Fastest of `repeat` runs of `lex` on a fresh Tokenizer over `src`, leaving the tokens of the last
+// run in `tokens`. Copying the source and freeing earlier tokens are not timed.
+template <typename Lex>
+double fastest_seconds(const std::string& src, const size_t repeat, std::vector<Token>& tokens, const Lex& lex)
+{
+    double best = 0;
+    for (size_t i = 0; i < repeat; i++) {
+        Tokenizer tokenizer(src);
+        tokens = {};
+        const auto start = std::chrono::steady_clock::now();
+        tokens = lex(tokenizer);
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        best = (i == 0 ? seconds : std::min(best, seconds));
+    }
+    return best;
+}
+
+bool parse_count(const std::string_view arg, const std::string_view flag, size_t& count)
+{
+    if (!arg.starts_with(flag)) {
+        return false;
+    }
+    const std::string_view value = arg.substr(flag.size());
+    if (const auto [ptr, ec] = std::from_chars(value.data(), value.data() + value.size(), count);
+        ec != std::errc {} || ptr != value.data() + value.size() || count == 0) {
+        std::cerr << "Invalid " << flag << value << "\n";
+        std::exit(EXIT_FAILURE);
+    }
+    return true;
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    size_t max_threads = worker_count(0);
+    size_t repeat = 5;
+    size_t mib = 64;
+    std::string path;
+    for (int i = 1; i < argc; i++) {
+        const std::string_view arg = argv[i];
+        if (parse_count(arg, "--threads=", max_threads) || parse_count(arg, "--repeat=", repeat)
+            || parse_count(arg, "--mib=", mib)) {
+            continue;
+        }
+        if (arg.starts_with("--") || !path.empty()) {
+            std::cerr << "Usage: hydro_lex_bench [--threads=N] [--repeat=N] [--mib=N] [FILE]\n";
+            return EXIT_FAILURE;
+        }
+        path = arg;
+    }
+
+    std::string src;
+    if (path.empty()) {
+        src = generated_source(mib << 20);
+    }
+    else {
+        std::ifstream input(path);
+        if (!input) {
+            std::cerr << "Cannot read " << path << "\n";
+            return EXIT_FAILURE;
+        }
+        std::stringstream contents;
+        contents << input.rdbuf();
+        src = contents.str();
+    }
+
+    std::vector<Token> serial;
+    const double serial_seconds
+        = fastest_seconds(src, repeat, serial, [](Tokenizer& tokenizer) { return tokenizer.tokenize(); });
+    std::cout << src.size() << " bytes, " << serial.size() << " tokens, " << std::thread::hardware_concurrency()
+              << " cores\n";
+    std::cout << std::fixed << std::setprecision(1);
+    std::cout << "threads        ms   MiB/s  speedup  tokens\n";
+    std::cout << "serial " << std::setw(9) << serial_seconds * 1000 << std::setw(8)
+              << static_cast<double>(src.size()) / (1 << 20) / serial_seconds << "\n";
+    double one_thread = 0;
+    bool all_same = true;
+    for (size_t threads = 1; threads <= max_threads; threads++) {
+        std::vector<Token> tokens;
+        const double seconds = fastest_seconds(src, repeat, tokens, [&](Tokenizer& tokenizer) {
+            return tokenizer.tokenize_parallel(threads);
+        });
+        if (threads == 1) {
+            one_thread = seconds;
+        }
+        const bool same = same_tokens(tokens, serial);
+        all_same = all_same && same;
+        std::cout << std::setw(7) << threads << std::setw(10) << seconds * 1000 << std::setw(8)
+                  << static_cast<double>(src.size()) / (1 << 20) / seconds << std::setw(8) << std::setprecision(2)
+                  << one_thread / seconds << "x  " << (same ? "same" : "DIFFERENT") << "\n"
+                  << std::setprecision(1);
+    }
+    return all_same ? EXIT_SUCCESS : EXIT_FAILURE;
+}
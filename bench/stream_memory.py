@@ -0,0 +1,64 @@
+#!/usr/bin/env python3
+"""Peak memory of compiling growing inputs, with and without --stream.
+
+    bench/stream_memory.py [--hydro PATH] [--statements N] [--copies N]... [--seed N]
+
+Each input repeats one program from gen_program.py (--no-exit --no-trap, --statements top-level
+statements) --copies times, every copy in a scope of its own, and ends with `exit(0);`. The file
+grows with the number of copies while each top-level statement stays the same size, which is what
+--stream needs to run in bounded memory. Both builds write out.asm (and run nasm and ld if they are
+installed); the peak RSS of the hydro process is reported.
+
+Linux counts the RSS a process had before exec in its peak, so every figure includes the peak of
+this script, which forks it. The first row compiles `exit(0);` to show that floor. Inputs are
+written to disk a copy at a time so that the floor does not grow with them.
+"""
+
+import argparse
+from pathlib import Path
+
+from common import Workdir, find_hydro, run, write_source
+from gen_program import generate
+
+
+def write_padded(path, statements, copies, seed):
+    body = generate(seed, statements=statements, exits=False, traps=False).splitlines()[:-1]
+    block = "{\n" + "".join(f"    {line}\n" for line in body) + "}\n"
+    with open(path, "w") as file:
+        for _ in range(copies):
+            file.write(block)
+        file.write("exit(0);\n")
+
+
+def measure(hydro, workdir, label):
+    size = (Path(workdir) / "prog.hy").stat().st_size
+    results = []
+    for flags in ([], ["--stream"]):
+        code, seconds, rss = run([str(hydro), *flags, "prog.hy"], cwd=workdir)
+        if code != 0:
+            raise SystemExit(f"hydro {' '.join(flags)} failed with status {code} on {label}")
+        results += [rss, seconds]
+    whole_rss, whole_seconds, stream_rss, stream_seconds = results
+    print(f"{label:>8} {size:>10} {whole_rss:>10} {stream_rss:>10} {whole_seconds:>8.2f} {stream_seconds:>8.2f}")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--hydro", help="hydro binary to benchmark (default: build/hydro)")
+    parser.add_argument("--statements", type=int, default=200, help="statements in each copy (default: 200)")
+    parser.add_argument("--copies", type=int, action="append", help="copies in an input (repeatable)")
+    parser.add_argument("--seed", type=int, default=1, help="seed of the generated program (default: 1)")
+    args = parser.parse_args()
+
+    hydro = find_hydro(args.hydro)
+    print(f"{'copies':>8} {'bytes':>10} {'whole KiB':>10} {'stream KiB':>10} {'whole s':>8} {'stream s':>8}")
+    with Workdir() as workdir:
+        write_source(workdir, "exit(0);\n")
+        measure(hydro, workdir, "exit(0)")
+        for copies in args.copies or [1, 4, 16, 64, 256]:
+            write_padded(Path(workdir) / "prog.hy", args.statements, copies, args.seed)
+            measure(hydro, workdir, str(copies))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,56 @@
+#!/usr/bin/env python3
+"""Time to result: how long each execution mode takes from a source file to the program's exit status.
+
+    bench/time_to_result.py [--hydro PATH] [--statements N]... [--seed N] [--no-fold] [--repeat N]
+
+Programs come from gen_program.py with --no-exit --no-trap, so that they run to their end; the one
+of 0 statements is `exit(0);`, which measures start-up. Each is run with --interp, --run and --jit,
+built with --elf and run, and built through nasm and ld and run.
+Without nasm or ld, the last mode only compiles and writes out.asm, a lower bound for that pipeline.
+"""
+
+import argparse
+
+from common import Workdir, find_hydro, have_tools, interleaved_steps, ms, write_source
+from gen_program import generate
+
+
+def modes(hydro, flags, with_nasm):
+    """(name, pipeline) of each mode; the pipeline's last command gives the result."""
+    hydro = [str(hydro), *flags]
+    return [
+        ("interp", [[*hydro, "--interp", "prog.hy"]]),
+        ("run", [[*hydro, "--run", "prog.hy"]]),
+        ("jit", [[*hydro, "--jit", "prog.hy"]]),
+        ("elf + run", [[*hydro, "--elf", "prog.hy"], ["./out"]]),
+        ("nasm + ld + run", [[*hydro, "prog.hy"], ["./out"]]) if with_nasm else ("out.asm only", [[*hydro, "prog.hy"]]),
+    ]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--hydro", help="hydro binary to benchmark (default: build/hydro)")
+    parser.add_argument("--statements", type=int, action="append", help="top-level statements (repeatable)")
+    parser.add_argument("--seed", type=int, default=1, help="seed of the generated programs (default: 1)")
+    parser.add_argument("--no-fold", action="store_true", help="pass --no-fold to every mode")
+    parser.add_argument("--repeat", type=int, default=20, help="runs of each mode (default: 20)")
+    args = parser.parse_args()
+
+    hydro = find_hydro(args.hydro)
+    with_nasm = have_tools("nasm", "ld")
+    if not with_nasm:
+        print("nasm or ld not found: timing the compilation to out.asm only")
+    flags = ["--no-fold"] if args.no_fold else []
+    print(f"{'statements':>10} {'bytes':>9}  {'mode':<16} {'fastest':>12} {'median':>12}")
+    with Workdir() as workdir:
+        for statements in args.statements or [0, 100, 1000, 5000]:
+            text = generate(args.seed, statements=statements, exits=False, traps=False)
+            write_source(workdir, text)
+            named = modes(hydro, flags, with_nasm)
+            results = interleaved_steps([pipeline for _, pipeline in named], args.repeat, cwd=workdir)
+            for (name, _), (status, fastest, median) in zip(named, results):
+                print(f"{statements:>10} {len(text):>9}  {name:<16} {ms(fastest)} {ms(median)}  exit={status}")
+
+
+if __name__ == "__main__":
+    main()
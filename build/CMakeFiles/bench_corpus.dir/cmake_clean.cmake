@@ -0,0 +1,8 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/bench_corpus"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang )
+  include(CMakeFiles/bench_corpus.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
@@ -0,0 +1,11 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/hydro.dir/src/main.cpp.o"
+  "CMakeFiles/hydro.dir/src/main.cpp.o.d"
+  "hydro"
+  "hydro.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang CXX)
+  include(CMakeFiles/hydro.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
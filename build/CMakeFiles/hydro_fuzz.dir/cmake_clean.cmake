@@ -0,0 +1,11 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/hydro_fuzz.dir/fuzz/fuzz_pipeline.cpp.o"
+  "CMakeFiles/hydro_fuzz.dir/fuzz/fuzz_pipeline.cpp.o.d"
+  "hydro_fuzz"
+  "hydro_fuzz.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang CXX)
+  include(CMakeFiles/hydro_fuzz.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
@@ -0,0 +1,11 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/hydro_lex_bench.dir/bench/lex_scaling.cpp.o"
+  "CMakeFiles/hydro_lex_bench.dir/bench/lex_scaling.cpp.o.d"
+  "hydro_lex_bench"
+  "hydro_lex_bench.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang CXX)
+  include(CMakeFiles/hydro_lex_bench.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
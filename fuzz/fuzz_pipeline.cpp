@@ -0,0 +1,364 @@
+// In-process harness over the compile pipeline: Tokenizer::tokenize, Parser::parse_prog, then
+// Generator::gen_prog, with a CompileError counting as a rejected input rather than a failure.
+//
+// Built with -DHYDRO_LIBFUZZER=ON (clang only), libFuzzer calls LLVMFuzzerTestOneInput. Otherwise
+// main() replays the files and directories it is given:
+//
+//     hydro_fuzz [--save DIR] [--slack N] PATH...
+//
+// Every input is timed and its peak heap use recorded. Before the first input, a program known to
+// compile in linear time calibrates what a byte of source costs in this build on this machine. An
+// input that costs more than `slack` times that rate, by time or by heap, is reported as superlinear;
+// with --save DIR (HYDRO_FUZZ_SAVE=DIR under libFuzzer) it is minimized and written to DIR, which is
+// how fuzz/corpus is grown. The bench_corpus target replays fuzz/corpus.
+
+#include <malloc.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "../src/generation.hpp"
+
+// Replacing the global allocation functions would hide allocations from a sanitizer's own.
+#if defined(__SANITIZE_ADDRESS__)
+#define HYDRO_COUNT_HEAP 0
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer) || __has_feature(memory_sanitizer)
+#define HYDRO_COUNT_HEAP 0
+#endif
+#endif
+#ifndef HYDRO_COUNT_HEAP
+#define HYDRO_COUNT_HEAP 1
+#endif
+
+namespace {
+
+std::atomic<size_t> g_heap_bytes = 0;
+std::atomic<size_t> g_heap_peak = 0;
+
+} // namespace
+
+#if HYDRO_COUNT_HEAP
+void* operator new(const size_t size)
+{
+    void* ptr = std::malloc(std::max<size_t>(size, 1));
+    if (ptr == nullptr) {
+        throw std::bad_alloc();
+    }
+    const size_t bytes = g_heap_bytes += malloc_usable_size(ptr);
+    for (size_t peak = g_heap_peak; bytes > peak && !g_heap_peak.compare_exchange_weak(peak, bytes);) { }
+    return ptr;
+}
+
+void operator delete(void* ptr) noexcept
+{
+    if (ptr != nullptr) {
+        g_heap_bytes -= malloc_usable_size(ptr);
+        std::free(ptr);
+    }
+}
+
+void operator delete(void* ptr, size_t) noexcept
+{
+    operator delete(ptr);
+}
+#endif
+
+namespace {
+
+struct Cost {
+    double seconds = 0;
+    // Peak heap use above what was live before the input, or 0 when allocations are not counted.
+    size_t heap_bytes = 0;
+    bool compiled = false;
+};
+
+// Runs the pipeline over `src` on a thread with the stack the compiler expects.
+Cost compile(const std::string_view src)
+{
+    Cost cost;
+    const auto run = [&] {
+        const size_t heap_before = g_heap_bytes;
+        g_heap_peak = heap_before;
+        const auto start = std::chrono::steady_clock::now();
+        try {
+            Tokenizer tokenizer { std::string(src) };
+            Parser parser(tokenizer.tokenize());
+            if (std::optional<NodeProg> prog = parser.parse_prog()) {
+                Generator generator(std::move(prog.value()));
+                (void)generator.gen_prog();
+                cost.compiled = true;
+            }
+        }
+        catch (const CompileError&) {
+        }
+        cost.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        cost.heap_bytes = g_heap_peak - heap_before;
+    };
+    pthread_join(start_compile_thread(run), nullptr);
+    return cost;
+}
+
+// Cheapest of `runs` compilations, since a busy machine only ever makes an input look slower.
+Cost cheapest(const std::string_view src, const int runs)
+{
+    Cost best = compile(src);
+    for (int i = 1; i < runs; i++) {
+        const Cost cost = compile(src);
+        best.seconds = std::min(best.seconds, cost.seconds);
+    }
+    return best;
+}
+
+// Inputs costing less than this above the start-up cost are never flagged.
+constexpr double min_flag_seconds = 0.005;
+constexpr double min_flag_heap_bytes = 1 << 20;
+
+class Budget {
+public:
+    // Measures the start-up cost (the parser's first arena block, for one) with an empty program,
+    // then the cost per byte of a few thousand scopes holding every kind of statement, which the
+    // pipeline compiles in linear time.
+    void calibrate()
+    {
+        const Cost empty = cheapest("exit(0);\n", 3);
+        m_fixed_seconds = empty.seconds;
+        m_fixed_heap = static_cast<double>(empty.heap_bytes);
+        std::string src = "let a = 1;\nstatic b[4];\n";
+        for (int i = 0; i < 2000; i++) {
+            const std::string n = std::to_string(i);
+            src += "{\n    let v = a * " + n + " + b[" + std::to_string(i % 4) + "] / 3;\n";
+            src += "    a = (a + v) % 1000 - -" + n + ";\n";
+            src += "    if (a - " + n + ") { b[1] = a; } elif (v) { a = 2; } else { let w = a; a = w * w; }\n}\n";
+        }
+        src += "exit(a);\n";
+        const Cost cost = cheapest(src, 3);
+        m_seconds_per_byte = (cost.seconds - m_fixed_seconds) / static_cast<double>(src.size());
+        m_heap_per_byte = (static_cast<double>(cost.heap_bytes) - m_fixed_heap) / static_cast<double>(src.size());
+    }
+
+    void set_slack(const double slack)
+    {
+        m_slack = slack;
+    }
+
+    [[nodiscard]] bool exceeded(const Cost& cost, const size_t size) const
+    {
+        const auto bytes = static_cast<double>(size);
+        const double seconds = cost.seconds - m_fixed_seconds;
+        const double heap = static_cast<double>(cost.heap_bytes) - m_fixed_heap;
+        return (seconds > min_flag_seconds && seconds > m_slack * m_seconds_per_byte * bytes)
+            || (heap > min_flag_heap_bytes && heap > m_slack * m_heap_per_byte * bytes);
+    }
+
+    // Rechecks a flagged input, so that one slow run on a noisy machine does not flag it.
+    [[nodiscard]] bool superlinear(const std::string_view src) const
+    {
+        return exceeded(compile(src), src.size()) && exceeded(cheapest(src, 3), src.size());
+    }
+
+    [[nodiscard]] double seconds_per_byte() const
+    {
+        return m_seconds_per_byte;
+    }
+
+    [[nodiscard]] double heap_per_byte() const
+    {
+        return m_heap_per_byte;
+    }
+
+private:
+    double m_fixed_seconds = 0;
+    double m_fixed_heap = 0;
+    double m_seconds_per_byte = 0;
+    double m_heap_per_byte = 0;
+    double m_slack = 4;
+};
+
+std::vector<std::string> split_lines(const std::string_view src)
+{
+    std::vector<std::string> lines;
+    for (size_t begin = 0; begin < src.size();) {
+        const size_t end = std::min(src.find('\n', begin), src.size() - 1) + 1;
+        lines.emplace_back(src.substr(begin, end - begin));
+        begin = end;
+    }
+    return lines;
+}
+
+std::string join(const std::vector<std::string>& lines)
+{
+    std::string src;
+    for (const std::string& line : lines) {
+        src += line;
+    }
+    return src;
+}
+
+// Removes runs of lines while the rest stays superlinear, halving the run length whenever no run
+// can go (ddmin over lines), and gives up on further shrinking after `time_limit`.
+std::string minimize(const std::string_view src, const Budget& budget, const std::chrono::seconds time_limit)
+{
+    const auto deadline = std::chrono::steady_clock::now() + time_limit;
+    std::vector<std::string> lines = split_lines(src);
+    for (size_t run = std::max<size_t>(lines.size() / 2, 1); run > 0; run /= 2) {
+        for (size_t begin = 0; begin < lines.size() && lines.size() > 1;) {
+            if (std::chrono::steady_clock::now() > deadline) {
+                return join(lines);
+            }
+            const auto first = lines.begin() + static_cast<ptrdiff_t>(begin);
+            const auto last = lines.begin() + static_cast<ptrdiff_t>(std::min(begin + run, lines.size()));
+            std::vector<std::string> candidate(lines.begin(), first);
+            candidate.insert(candidate.end(), last, lines.end());
+            if (budget.superlinear(join(candidate))) {
+                lines = std::move(candidate);
+            }
+            else {
+                begin += run;
+            }
+        }
+    }
+    return join(lines);
+}
+
+// Writes `src` to `dir`, named after its contents so that the same input is only kept once.
+std::filesystem::path save(const std::filesystem::path& dir, const std::string_view src)
+{
+    std::stringstream name;
+    name << "slow-" << std::hex << std::setw(16) << std::setfill('0') << std::hash<std::string_view> {}(src) << ".hy";
+    std::filesystem::create_directories(dir);
+    const std::filesystem::path path = dir / name.str();
+    std::ofstream(path, std::ios::binary) << src;
+    return path;
+}
+
+Budget g_budget;
+std::string g_save_dir;
+
+// Handles an input that exceeded the budget once: confirms, minimizes and saves it. Returns whether
+// it was confirmed.
+bool report_slow(const std::string_view src)
+{
+    if (!g_budget.superlinear(src)) {
+        return false;
+    }
+    if (!g_save_dir.empty()) {
+        const std::string minimized = minimize(src, g_budget, std::chrono::seconds(120));
+        std::cerr << "saved " << minimized.size() << "-byte minimized input to " << save(g_save_dir, minimized).string()
+                  << std::endl;
+    }
+    return true;
+}
+
+} // namespace
+
+#ifdef HYDRO_LIBFUZZER
+
+extern "C" int LLVMFuzzerInitialize(int*, char***)
+{
+    g_budget.calibrate();
+    if (const char* dir = std::getenv("HYDRO_FUZZ_SAVE")) {
+        g_save_dir = dir;
+    }
+    return 0;
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, const size_t size)
+{
+    const std::string_view src(reinterpret_cast<const char*>(data), size);
+    if (g_budget.exceeded(compile(src), size) && report_slow(src)) {
+        std::cerr << "superlinear input of " << size << " bytes" << std::endl;
+    }
+    return 0;
+}
+
+#else
+
+namespace {
+
+void print_usage()
+{
+    std::cerr << "Usage: hydro_fuzz [--save DIR] [--slack N] PATH...\n"
+                 "Compiles each file (or each file of each directory) in-process and prints its cost.\n"
+                 "  --save DIR   minimize superlinear inputs and write them to DIR\n"
+                 "  --slack N    flag inputs costing over N times the calibrated rate per byte (default 4)"
+              << std::endl;
+}
+
+std::string read_file(const std::filesystem::path& path)
+{
+    std::stringstream contents;
+    contents << std::ifstream(path, std::ios::binary).rdbuf();
+    return contents.str();
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    std::vector<std::filesystem::path> inputs;
+    for (int i = 1; i < argc; i++) {
+        const std::string_view arg = argv[i];
+        if (arg == "--save" && i + 1 < argc) {
+            g_save_dir = argv[++i];
+        }
+        else if (arg == "--slack" && i + 1 < argc) {
+            g_budget.set_slack(std::strtod(argv[++i], nullptr));
+        }
+        else if (arg.starts_with("-")) {
+            print_usage();
+            return EXIT_FAILURE;
+        }
+        else if (std::filesystem::is_directory(arg)) {
+            const auto first = inputs.size();
+            for (const auto& entry : std::filesystem::directory_iterator(arg)) {
+                if (entry.is_regular_file()) {
+                    inputs.push_back(entry.path());
+                }
+            }
+            std::sort(inputs.begin() + static_cast<ptrdiff_t>(first), inputs.end());
+        }
+        else {
+            inputs.emplace_back(arg);
+        }
+    }
+    if (inputs.empty()) {
+        print_usage();
+        return EXIT_FAILURE;
+    }
+
+    g_budget.calibrate();
+    std::cout << std::fixed << std::setprecision(1) << "calibration: " << g_budget.seconds_per_byte() * 1e9
+              << " ns and " << g_budget.heap_per_byte() << " heap bytes per source byte\n"
+              << std::setw(10) << "bytes" << std::setw(12) << "ms" << std::setw(12) << "heap KiB" << std::setw(10)
+              << "ns/byte" << "  input" << std::endl;
+    int slow = 0;
+    for (const std::filesystem::path& path : inputs) {
+        const std::string src = read_file(path);
+        const Cost cost = cheapest(src, 3);
+        const bool flagged = g_budget.exceeded(cost, src.size()) && report_slow(src);
+        slow += flagged ? 1 : 0;
+        std::cout << std::setw(10) << src.size() << std::setw(12) << cost.seconds * 1e3 << std::setw(12)
+                  << static_cast<double>(cost.heap_bytes) / 1024 << std::setw(10)
+                  << cost.seconds * 1e9 / static_cast<double>(std::max<size_t>(src.size(), 1)) << "  "
+                  << path.string() << (cost.compiled ? "" : " (rejected)") << (flagged ? "  SUPERLINEAR" : "")
+                  << std::endl;
+    }
+    std::cout << inputs.size() << " inputs, " << slow << " superlinear" << std::endl;
+    return slow == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+#endif
@@ -1,44 +1,51 @@
 #pragma once
 
+#include <algorithm>
 #include <cstddef>
 #include <memory>
+#include <type_traits>
 #include <utility>
+#include <vector>
 
+// Allocates from blocks of `block_size` bytes, adding another block whenever the current one is full.
+// Objects never move, so the pointers handed out stay valid until reset().
 class ArenaAllocator {
 public:
-    explicit ArenaAllocator(const size_t max_num_bytes)
-        : m_size { max_num_bytes }
-        , m_buffer { new std::byte[max_num_bytes] }
-        , m_offset { m_buffer }
+    explicit ArenaAllocator(const size_t block_size)
+        : m_block_size { block_size }
     {
+        add_block(block_size);
     }
 
     ArenaAllocator(const ArenaAllocator&) = delete;
     ArenaAllocator& operator=(const ArenaAllocator&) = delete;
 
     ArenaAllocator(ArenaAllocator&& other) noexcept
-        : m_size { std::exchange(other.m_size, 0) }
-        , m_buffer { std::exchange(other.m_buffer, nullptr) }
+        : m_block_size { other.m_block_size }
+        , m_blocks { std::move(other.m_blocks) }
         , m_offset { std::exchange(other.m_offset, nullptr) }
+        , m_end { std::exchange(other.m_end, nullptr) }
+        , m_destructors { std::move(other.m_destructors) }
     {
     }
 
     ArenaAllocator& operator=(ArenaAllocator&& other) noexcept
     {
-        std::swap(m_size, other.m_size);
-        std::swap(m_buffer, other.m_buffer);
+        std::swap(m_block_size, other.m_block_size);
+        std::swap(m_blocks, other.m_blocks);
         std::swap(m_offset, other.m_offset);
+        std::swap(m_end, other.m_end);
+        std::swap(m_destructors, other.m_destructors);
         return *this;
     }
 
     template <typename T>
     [[nodiscard]] T* alloc()
     {
-        size_t remaining_num_bytes = m_size - static_cast<size_t>(m_offset - m_buffer);
-        auto pointer = static_cast<void*>(m_offset);
-        const auto aligned_address = std::align(alignof(T), sizeof(T), pointer, remaining_num_bytes);
+        void* aligned_address = align<T>();
         if (aligned_address == nullptr) {
-            throw std::bad_alloc {};
+            add_block(std::max(m_block_size, sizeof(T) + alignof(T)));
+            aligned_address = align<T>();
         }
         m_offset = static_cast<std::byte*>(aligned_address) + sizeof(T);
         return static_cast<T*>(aligned_address);
@@ -48,21 +55,59 @@ public:
     [[nodiscard]] T* emplace(Args&&... args)
     {
         const auto allocated_memory = alloc<T>();
-        return new (allocated_memory) T { std::forward<Args>(args)... };
+        T* object = new (allocated_memory) T { std::forward<Args>(args)... };
+        if constexpr (!std::is_trivially_destructible_v<T>) {
+            m_destructors.push_back({ object, [](void* ptr) { static_cast<T*>(ptr)->~T(); } });
+        }
+        return object;
+    }
+
+    // Destroys every object emplaced so far and makes the first block available again.
+    void reset()
+    {
+        for (auto it = m_destructors.rbegin(); it != m_destructors.rend(); ++it) {
+            it->destroy(it->object);
+        }
+        m_destructors.clear();
+        if (m_blocks.empty()) {
+            return;
+        }
+        m_blocks.resize(1);
+        m_offset = m_blocks.front().get();
+        m_end = m_offset + m_block_size;
     }
 
     ~ArenaAllocator()
     {
-        // No destructors are called for the stored objects. Thus, memory
-        // leaks are possible (e.g. when storing std::vector objects or
-        // other non-trivially destructable objects in the allocator).
-        // Although this could be changed, it would come with additional
-        // runtime overhead and therefore is not implemented.
-        delete[] m_buffer;
+        // Only objects created with emplace() are destroyed; alloc() hands out raw memory.
+        reset();
     }
 
 private:
-    size_t m_size;
-    std::byte* m_buffer;
-    std::byte* m_offset;
-};
\ No newline at end of file
+    struct Destructor {
+        void* object;
+        void (*destroy)(void*);
+    };
+
+    // Space for a T in the current block, or null if it does not fit.
+    template <typename T>
+    void* align()
+    {
+        void* pointer = m_offset;
+        size_t remaining_num_bytes = static_cast<size_t>(m_end - m_offset);
+        return std::align(alignof(T), sizeof(T), pointer, remaining_num_bytes);
+    }
+
+    void add_block(const size_t size)
+    {
+        m_blocks.push_back(std::make_unique_for_overwrite<std::byte[]>(size));
+        m_offset = m_blocks.back().get();
+        m_end = m_offset + size;
+    }
+
+    size_t m_block_size;
+    std::vector<std::unique_ptr<std::byte[]>> m_blocks {};
+    std::byte* m_offset = nullptr;
+    std::byte* m_end = nullptr;
+    std::vector<Destructor> m_destructors {};
+};
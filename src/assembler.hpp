@@ -0,0 +1,998 @@
+#pragma once
+
+#include <cctype>
+#include <charconv>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Encodes the subset of nasm syntax that `Generator` emits into x86-64 machine code, so that a
+// program can be run or written out without invoking an external assembler and linker.
+enum class Section {
+    text,
+    data,
+    bss,
+};
+
+struct Symbol {
+    Section section;
+    size_t offset;
+};
+
+// A RIP-relative reference from the text section to a symbol in another section. Resolved once
+// the sections have load addresses.
+struct Reloc {
+    size_t pos;
+    Section target;
+    int64_t target_offset;
+    size_t pc_end;
+};
+
+struct Assembly {
+    std::vector<uint8_t> text {};
+    std::vector<uint8_t> data {};
+    size_t bss_size = 0;
+    std::unordered_map<std::string, Symbol> symbols {};
+    std::vector<Reloc> relocs {};
+
+    // Patches cross-section references for the given section load addresses.
+    void link(const uint64_t text_addr, const uint64_t data_addr, const uint64_t bss_addr)
+    {
+        for (const auto& [pos, target, target_offset, pc_end] : relocs) {
+            const uint64_t target_addr = (target == Section::data ? data_addr : bss_addr) + target_offset;
+            const auto rel = static_cast<int64_t>(target_addr - (text_addr + pc_end));
+            if (rel < INT32_MIN || rel > INT32_MAX) {
+                std::cerr << "[Assembler] Section too far for RIP-relative addressing" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            const auto rel32 = static_cast<uint32_t>(static_cast<int32_t>(rel));
+            for (int i = 0; i < 4; i++) {
+                text[pos + i] = static_cast<uint8_t>(rel32 >> (8 * i));
+            }
+        }
+    }
+
+    [[nodiscard]] size_t text_offset(const std::string& name) const
+    {
+        const auto it = symbols.find(name);
+        if (it == symbols.end() || it->second.section != Section::text) {
+            std::cerr << "[Assembler] Undefined label: " << name << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        return it->second.offset;
+    }
+};
+
+class Assembler {
+public:
+    explicit Assembler(std::string src)
+        : m_src(std::move(src))
+    {
+    }
+
+    Assembly assemble()
+    {
+        std::istringstream lines(m_src);
+        std::string line;
+        while (std::getline(lines, line)) {
+            m_line++;
+            assemble_line(line);
+        }
+        resolve();
+        return std::move(m_asm);
+    }
+
+private:
+    struct Operand {
+        enum class Kind {
+            reg,
+            vec,
+            imm,
+            mem,
+            label,
+        };
+        Kind kind;
+        int reg = -1; // Register number, or base register of a memory operand.
+        int size = 64; // Bits of a general purpose register; 128 or 256 for vector registers.
+        int64_t imm = 0; // Immediate value, or displacement of a memory operand.
+        int index = -1;
+        int scale = 1;
+        std::string label {}; // Label operand, or symbol of a RIP-relative memory operand.
+    };
+
+    enum class FixupKind {
+        rel32, // PC-relative, to `pc_end`
+        diff32, // label - base_label
+    };
+
+    struct Fixup {
+        FixupKind kind;
+        Section section;
+        size_t pos;
+        std::string label;
+        int64_t addend;
+        size_t pc_end = 0;
+        std::string base_label {};
+    };
+
+    static constexpr std::pair<std::string_view, int> condition_codes[] = {
+        { "o", 0 },   { "no", 1 }, { "b", 2 },   { "c", 2 },    { "nae", 2 }, { "ae", 3 }, { "nb", 3 },  { "nc", 3 },
+        { "e", 4 },   { "z", 4 },  { "ne", 5 },  { "nz", 5 },   { "be", 6 },  { "na", 6 }, { "a", 7 },   { "nbe", 7 },
+        { "s", 8 },   { "ns", 9 }, { "p", 10 },  { "np", 11 },  { "l", 12 },  { "nge", 12 }, { "ge", 13 }, { "nl", 13 },
+        { "le", 14 }, { "ng", 14 }, { "g", 15 }, { "nle", 15 },
+    };
+
+    [[noreturn]] void error(const std::string& msg) const
+    {
+        std::cerr << "[Assembler] " << msg << " on line " << m_line << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    static std::string_view trim(std::string_view str)
+    {
+        while (!str.empty() && std::isspace(static_cast<unsigned char>(str.front()))) {
+            str.remove_prefix(1);
+        }
+        while (!str.empty() && std::isspace(static_cast<unsigned char>(str.back()))) {
+            str.remove_suffix(1);
+        }
+        return str;
+    }
+
+    static std::optional<int> condition_code(const std::string_view suffix)
+    {
+        for (const auto& [name, code] : condition_codes) {
+            if (name == suffix) {
+                return code;
+            }
+        }
+        return {};
+    }
+
+    static std::optional<std::pair<int, int>> parse_reg(const std::string_view name)
+    {
+        static constexpr std::string_view regs64[]
+            = { "rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+                "r8",  "r9",  "r10", "r11", "r12", "r13", "r14", "r15" };
+        static constexpr std::string_view regs32[] = { "eax", "ecx",  "edx",  "ebx",  "esp",  "ebp",  "esi",  "edi",
+                                                       "r8d", "r9d", "r10d", "r11d", "r12d", "r13d", "r14d", "r15d" };
+        static constexpr std::string_view regs8[] = { "al",  "cl",  "dl",   "bl",   "",     "",     "",     "",
+                                                      "r8b", "r9b", "r10b", "r11b", "r12b", "r13b", "r14b", "r15b" };
+        for (int i = 0; i < 16; i++) {
+            if (regs64[i] == name) {
+                return std::pair { i, 64 };
+            }
+            if (regs32[i] == name) {
+                return std::pair { i, 32 };
+            }
+            if (!regs8[i].empty() && regs8[i] == name) {
+                return std::pair { i, 8 };
+            }
+        }
+        if ((name.starts_with("xmm") || name.starts_with("ymm")) && name.size() > 3) {
+            int num = 0;
+            if (const auto [ptr, ec] = std::from_chars(name.data() + 3, name.data() + name.size(), num);
+                ec == std::errc {} && ptr == name.data() + name.size() && num < 16) {
+                return std::pair { num, name[0] == 'x' ? 128 : 256 };
+            }
+        }
+        return {};
+    }
+
+    static std::optional<int64_t> parse_int(std::string_view str)
+    {
+        bool negative = false;
+        if (str.starts_with("-")) {
+            negative = true;
+            str.remove_prefix(1);
+        }
+        int base = 10;
+        if (str.starts_with("0x")) {
+            base = 16;
+            str.remove_prefix(2);
+        }
+        uint64_t value;
+        if (const auto [ptr, ec] = std::from_chars(str.data(), str.data() + str.size(), value, base);
+            ec != std::errc {} || ptr != str.data() + str.size() || str.empty()) {
+            return {};
+        }
+        return static_cast<int64_t>(negative ? uint64_t { 0 } - value : value);
+    }
+
+    Operand parse_mem(std::string_view inner) const
+    {
+        Operand op { .kind = Operand::Kind::mem };
+        inner = trim(inner);
+        if (inner.starts_with("rel ")) {
+            inner.remove_prefix(4);
+            op.label = "?";
+        }
+        bool negative = false;
+        bool first_label = op.label == "?";
+        while (!inner.empty()) {
+            size_t end = 0;
+            while (end < inner.size() && inner[end] != '+' && inner[end] != '-') {
+                end++;
+            }
+            const std::string_view term = trim(inner.substr(0, end));
+            if (!term.empty()) {
+                if (first_label) {
+                    op.label = std::string(term);
+                    first_label = false;
+                }
+                else if (const size_t star = term.find('*'); star != std::string_view::npos) {
+                    const auto reg = parse_reg(trim(term.substr(0, star)));
+                    const auto scale = parse_int(trim(term.substr(star + 1)));
+                    if (!reg.has_value() || !scale.has_value()) {
+                        error("Invalid memory operand");
+                    }
+                    op.index = reg->first;
+                    op.scale = static_cast<int>(scale.value());
+                }
+                else if (const auto reg = parse_reg(term)) {
+                    if (op.reg == -1) {
+                        op.reg = reg->first;
+                    }
+                    else {
+                        op.index = reg->first;
+                    }
+                }
+                else if (const auto value = parse_int(term)) {
+                    op.imm += negative ? -value.value() : value.value();
+                }
+                else {
+                    error("Invalid memory operand");
+                }
+            }
+            if (end == inner.size()) {
+                break;
+            }
+            negative = inner[end] == '-';
+            inner.remove_prefix(end + 1);
+        }
+        return op;
+    }
+
+    Operand parse_operand(std::string_view str) const
+    {
+        str = trim(str);
+        for (const std::string_view size : { "QWORD", "DWORD", "BYTE" }) {
+            if (str.starts_with(size)) {
+                str = trim(str.substr(size.size()));
+            }
+        }
+        if (str.starts_with("[")) {
+            if (!str.ends_with("]")) {
+                error("Invalid memory operand");
+            }
+            return parse_mem(str.substr(1, str.size() - 2));
+        }
+        if (const auto reg = parse_reg(str)) {
+            const bool vec = reg->second >= 128;
+            return { .kind = vec ? Operand::Kind::vec : Operand::Kind::reg, .reg = reg->first, .size = reg->second };
+        }
+        if (const auto value = parse_int(str)) {
+            return { .kind = Operand::Kind::imm, .imm = value.value() };
+        }
+        return { .kind = Operand::Kind::label, .label = std::string(str) };
+    }
+
+    std::vector<uint8_t>& out()
+    {
+        return m_section == Section::data ? m_asm.data : m_asm.text;
+    }
+
+    void byte(const uint8_t value)
+    {
+        out().push_back(value);
+    }
+
+    void bytes(const uint64_t value, const int count)
+    {
+        for (int i = 0; i < count; i++) {
+            byte(static_cast<uint8_t>(value >> (8 * i)));
+        }
+    }
+
+    static bool fits8(const int64_t value)
+    {
+        return value >= INT8_MIN && value <= INT8_MAX;
+    }
+
+    static bool fits32(const int64_t value)
+    {
+        return value >= INT32_MIN && value <= INT32_MAX;
+    }
+
+    void rex(const bool w, const int reg, const int index, const int base, const bool force = false)
+    {
+        const auto value = static_cast<uint8_t>(
+            0x40 | (w ? 8 : 0) | (reg >= 8 ? 4 : 0) | (index >= 8 ? 2 : 0) | (base >= 8 ? 1 : 0));
+        if (value != 0x40 || force) {
+            byte(value);
+        }
+    }
+
+    // ModRM, SIB and displacement for `rm` with `reg` in the reg field.
+    void modrm(const int reg, const Operand& rm)
+    {
+        if (rm.kind == Operand::Kind::reg || rm.kind == Operand::Kind::vec) {
+            byte(static_cast<uint8_t>(0xC0 | (reg & 7) << 3 | (rm.reg & 7)));
+            return;
+        }
+        if (!rm.label.empty()) {
+            byte(static_cast<uint8_t>(0x05 | (reg & 7) << 3));
+            m_fixups.push_back(
+                { .kind = FixupKind::rel32,
+                  .section = m_section,
+                  .pos = out().size(),
+                  .label = rm.label,
+                  .addend = rm.imm });
+            m_pending_fixups.push_back(m_fixups.size() - 1);
+            bytes(0, 4);
+            return;
+        }
+        if (rm.reg == -1) {
+            error("Memory operand without base register");
+        }
+        int mod = 2;
+        if (rm.imm == 0 && (rm.reg & 7) != 5) {
+            mod = 0;
+        }
+        else if (fits8(rm.imm)) {
+            mod = 1;
+        }
+        else if (!fits32(rm.imm)) {
+            error("Displacement out of range");
+        }
+        if (rm.index == -1 && (rm.reg & 7) != 4) {
+            byte(static_cast<uint8_t>(mod << 6 | (reg & 7) << 3 | (rm.reg & 7)));
+        }
+        else {
+            int scale_bits = 0;
+            switch (rm.scale) {
+            case 1:
+                scale_bits = 0;
+                break;
+            case 2:
+                scale_bits = 1;
+                break;
+            case 4:
+                scale_bits = 2;
+                break;
+            case 8:
+                scale_bits = 3;
+                break;
+            default:
+                error("Invalid scale");
+            }
+            if (rm.index == 4) {
+                error("rsp cannot be an index register");
+            }
+            byte(static_cast<uint8_t>(mod << 6 | (reg & 7) << 3 | 4));
+            byte(static_cast<uint8_t>(scale_bits << 6 | ((rm.index == -1 ? 4 : rm.index) & 7) << 3 | (rm.reg & 7)));
+        }
+        if (mod == 1) {
+            bytes(static_cast<uint64_t>(rm.imm), 1);
+        }
+        else if (mod == 2) {
+            bytes(static_cast<uint64_t>(rm.imm), 4);
+        }
+    }
+
+    // Legacy prefix, REX, opcode and ModRM for a general purpose or SSE instruction.
+    void encode(
+        const std::initializer_list<uint8_t> prefix,
+        const bool w,
+        const std::initializer_list<uint8_t> opcode,
+        const int reg,
+        const Operand& rm,
+        const bool force_rex = false)
+    {
+        for (const uint8_t p : prefix) {
+            byte(p);
+        }
+        const bool is_mem = rm.kind == Operand::Kind::mem;
+        rex(w, reg, is_mem ? rm.index : -1, rm.reg, force_rex);
+        for (const uint8_t op : opcode) {
+            byte(op);
+        }
+        modrm(reg, rm);
+    }
+
+    // Three-byte VEX prefix, opcode and ModRM. `pp` selects 66/F3/F2, `map` 0F/0F38/0F3A.
+    void encode_vex(
+        const bool l256,
+        const int pp,
+        const int map,
+        const bool w,
+        const uint8_t opcode,
+        const int reg,
+        const int vvvv,
+        const Operand& rm)
+    {
+        const bool is_mem = rm.kind == Operand::Kind::mem;
+        const int index = is_mem ? rm.index : -1;
+        const int base = rm.reg;
+        byte(0xC4);
+        byte(static_cast<uint8_t>((reg >= 8 ? 0 : 0x80) | (index >= 8 ? 0 : 0x40) | (base >= 8 ? 0 : 0x20) | map));
+        byte(static_cast<uint8_t>((w ? 0x80 : 0) | (~vvvv & 15) << 3 | (l256 ? 4 : 0) | pp));
+        byte(opcode);
+        modrm(reg, rm);
+    }
+
+    // Finishes an instruction: RIP-relative displacements are relative to its end.
+    void end_instruction()
+    {
+        for (const size_t fixup : m_pending_fixups) {
+            m_fixups[fixup].pc_end = out().size();
+        }
+        m_pending_fixups.clear();
+    }
+
+    void rel32_to(const std::string& label)
+    {
+        m_fixups.push_back(
+            { .kind = FixupKind::rel32, .section = m_section, .pos = out().size(), .label = label, .addend = 0 });
+        bytes(0, 4);
+        m_fixups.back().pc_end = out().size();
+    }
+
+    void define_label(const std::string& name)
+    {
+        const size_t offset = m_section == Section::bss ? m_asm.bss_size : out().size();
+        if (!m_asm.symbols.emplace(name, Symbol { .section = m_section, .offset = offset }).second) {
+            error("Duplicate label " + name);
+        }
+    }
+
+    static std::vector<std::string_view> split_operands(const std::string_view str)
+    {
+        std::vector<std::string_view> operands;
+        size_t begin = 0;
+        int depth = 0;
+        bool in_string = false;
+        for (size_t i = 0; i < str.size(); i++) {
+            if (str[i] == '"') {
+                in_string = !in_string;
+            }
+            else if (!in_string && str[i] == '[') {
+                depth++;
+            }
+            else if (!in_string && str[i] == ']') {
+                depth--;
+            }
+            else if (!in_string && depth == 0 && str[i] == ',') {
+                operands.push_back(trim(str.substr(begin, i - begin)));
+                begin = i + 1;
+            }
+        }
+        if (!trim(str.substr(begin)).empty()) {
+            operands.push_back(trim(str.substr(begin)));
+        }
+        return operands;
+    }
+
+    void assemble_line(std::string_view line)
+    {
+        // Strip comments, leaving `;` inside string literals alone.
+        bool in_string = false;
+        for (size_t i = 0; i < line.size(); i++) {
+            if (line[i] == '"') {
+                in_string = !in_string;
+            }
+            else if (line[i] == ';' && !in_string) {
+                line = line.substr(0, i);
+                break;
+            }
+        }
+        line = trim(line);
+        if (line.empty()) {
+            return;
+        }
+        const size_t space = line.find_first_of(" \t");
+        std::string_view mnemonic = line.substr(0, space);
+        if (mnemonic.ends_with(":")) {
+            define_label(std::string(mnemonic.substr(0, mnemonic.size() - 1)));
+            if (space == std::string_view::npos) {
+                return;
+            }
+            assemble_line(line.substr(space));
+            return;
+        }
+        const std::string_view rest = space == std::string_view::npos ? "" : trim(line.substr(space));
+        if (mnemonic == "global") {
+            return;
+        }
+        if (mnemonic == "section") {
+            if (rest == ".text" || rest == ".rodata") {
+                m_section = Section::text;
+            }
+            else if (rest == ".data") {
+                m_section = Section::data;
+            }
+            else if (rest == ".bss") {
+                m_section = Section::bss;
+            }
+            else {
+                error("Unsupported section " + std::string(rest));
+            }
+            return;
+        }
+        if (m_section == Section::bss) {
+            assemble_bss(mnemonic, rest);
+            return;
+        }
+        if (mnemonic == "rep") {
+            if (rest != "stosq") {
+                error("Unsupported instruction rep " + std::string(rest));
+            }
+            byte(0xF3);
+            byte(0x48);
+            byte(0xAB);
+            return;
+        }
+        std::vector<Operand> ops;
+        for (const std::string_view operand : split_operands(rest)) {
+            if (mnemonic == "db" && operand.starts_with("\"")) {
+                for (const char c : operand.substr(1, operand.size() - 2)) {
+                    byte(static_cast<uint8_t>(c));
+                }
+                continue;
+            }
+            if (mnemonic == "dd" && operand.find(" - ") != std::string_view::npos) {
+                const size_t minus = operand.find(" - ");
+                m_fixups.push_back(
+                    { .kind = FixupKind::diff32,
+                      .section = m_section,
+                      .pos = out().size(),
+                      .label = std::string(trim(operand.substr(0, minus))),
+                      .addend = 0,
+                      .base_label = std::string(trim(operand.substr(minus + 3))) });
+                bytes(0, 4);
+                continue;
+            }
+            ops.push_back(parse_operand(operand));
+        }
+        assemble_instruction(mnemonic, ops);
+        end_instruction();
+    }
+
+    void assemble_bss(const std::string_view directive, const std::string_view rest)
+    {
+        const auto count = parse_int(rest);
+        if (!count.has_value() || count.value() < 0) {
+            error("Invalid bss directive");
+        }
+        if (directive == "resq") {
+            m_asm.bss_size += static_cast<size_t>(count.value()) * 8;
+        }
+        else if (directive == "resb") {
+            m_asm.bss_size += static_cast<size_t>(count.value());
+        }
+        else if (directive == "alignb") {
+            const auto align = static_cast<size_t>(count.value());
+            m_asm.bss_size = (m_asm.bss_size + align - 1) / align * align;
+        }
+        else {
+            error("Unsupported bss directive " + std::string(directive));
+        }
+    }
+
+    void check_ops(const std::vector<Operand>& ops, const size_t count, const std::string_view mnemonic) const
+    {
+        if (ops.size() != count) {
+            error("Wrong number of operands for " + std::string(mnemonic));
+        }
+    }
+
+    [[noreturn]] void unsupported(const std::string_view mnemonic) const
+    {
+        error("Unsupported operands for " + std::string(mnemonic));
+    }
+
+    // Opcode extension of the classic two-operand ALU instructions.
+    static std::optional<int> alu_ext(const std::string_view mnemonic)
+    {
+        static constexpr std::string_view alu[] = { "add", "or", "adc", "sbb", "and", "sub", "xor", "cmp" };
+        for (int i = 0; i < 8; i++) {
+            if (alu[i] == mnemonic) {
+                return i;
+            }
+        }
+        return {};
+    }
+
+    void assemble_instruction(const std::string_view mnemonic, const std::vector<Operand>& ops)
+    {
+        using Kind = Operand::Kind;
+        if (mnemonic == "db" || mnemonic == "dq" || mnemonic == "dd") {
+            const int size = mnemonic == "db" ? 1 : mnemonic == "dd" ? 4 : 8;
+            for (const Operand& op : ops) {
+                if (op.kind != Kind::imm) {
+                    unsupported(mnemonic);
+                }
+                bytes(static_cast<uint64_t>(op.imm), size);
+            }
+            return;
+        }
+        if (mnemonic == "align") {
+            check_ops(ops, 1, mnemonic);
+            while (out().size() % static_cast<size_t>(ops[0].imm) != 0) {
+                byte(m_section == Section::text ? 0x90 : 0x00);
+            }
+            return;
+        }
+        if (mnemonic == "syscall") {
+            byte(0x0F);
+            byte(0x05);
+            return;
+        }
+        if (mnemonic == "ret") {
+            byte(0xC3);
+            return;
+        }
+        if (mnemonic == "cqo") {
+            byte(0x48);
+            byte(0x99);
+            return;
+        }
+        if (mnemonic == "ud2") {
+            byte(0x0F);
+            byte(0x0B);
+            return;
+        }
+        if (mnemonic == "vzeroupper") {
+            byte(0xC5);
+            byte(0xF8);
+            byte(0x77);
+            return;
+        }
+        if (mnemonic == "mov") {
+            check_ops(ops, 2, mnemonic);
+            const Operand& dst = ops[0];
+            const Operand& src = ops[1];
+            if (dst.kind == Kind::reg && src.kind == Kind::imm) {
+                if (dst.size == 32 || (src.imm >= 0 && src.imm <= UINT32_MAX && dst.size == 64 && !fits32(src.imm))) {
+                    // mov r32, imm32 zero-extends into the full register.
+                    rex(false, 0, -1, dst.reg);
+                    byte(static_cast<uint8_t>(0xB8 + (dst.reg & 7)));
+                    bytes(static_cast<uint64_t>(src.imm), 4);
+                }
+                else if (fits32(src.imm)) {
+                    encode({}, true, { 0xC7 }, 0, dst);
+                    bytes(static_cast<uint64_t>(src.imm), 4);
+                }
+                else {
+                    rex(true, 0, -1, dst.reg);
+                    byte(static_cast<uint8_t>(0xB8 + (dst.reg & 7)));
+                    bytes(static_cast<uint64_t>(src.imm), 8);
+                }
+                return;
+            }
+            if (dst.kind == Kind::mem && src.kind == Kind::imm && fits32(src.imm)) {
+                encode({}, true, { 0xC7 }, 0, dst);
+                bytes(static_cast<uint64_t>(src.imm), 4);
+                return;
+            }
+            if ((dst.kind == Kind::reg || dst.kind == Kind::mem) && src.kind == Kind::reg) {
+                encode({}, src.size == 64, { 0x89 }, src.reg, dst);
+                return;
+            }
+            if (dst.kind == Kind::reg && src.kind == Kind::mem) {
+                encode({}, dst.size == 64, { 0x8B }, dst.reg, src);
+                return;
+            }
+            unsupported(mnemonic);
+        }
+        if (const auto ext = alu_ext(mnemonic)) {
+            check_ops(ops, 2, mnemonic);
+            const Operand& dst = ops[0];
+            const Operand& src = ops[1];
+            const bool w = dst.kind != Kind::reg || dst.size == 64;
+            if (src.kind == Kind::imm) {
+                if (fits8(src.imm)) {
+                    encode({}, w, { 0x83 }, ext.value(), dst);
+                    bytes(static_cast<uint64_t>(src.imm), 1);
+                }
+                else if (fits32(src.imm)) {
+                    encode({}, w, { 0x81 }, ext.value(), dst);
+                    bytes(static_cast<uint64_t>(src.imm), 4);
+                }
+                else {
+                    error("Immediate out of range");
+                }
+                return;
+            }
+            const auto base = static_cast<uint8_t>(ext.value() * 8);
+            if (src.kind == Kind::reg) {
+                encode({}, src.size == 64, { static_cast<uint8_t>(base + 1) }, src.reg, dst);
+                return;
+            }
+            if (dst.kind == Kind::reg && src.kind == Kind::mem) {
+                encode({}, w, { static_cast<uint8_t>(base + 3) }, dst.reg, src);
+                return;
+            }
+            unsupported(mnemonic);
+        }
+        if (mnemonic == "test") {
+            check_ops(ops, 2, mnemonic);
+            if (ops[1].kind == Kind::reg) {
+                encode({}, ops[1].size == 64, { 0x85 }, ops[1].reg, ops[0]);
+                return;
+            }
+            if (ops[1].kind == Kind::imm && fits32(ops[1].imm)) {
+                encode({}, true, { 0xF7 }, 0, ops[0]);
+                bytes(static_cast<uint64_t>(ops[1].imm), 4);
+                return;
+            }
+            unsupported(mnemonic);
+        }
+        if (mnemonic == "lea") {
+            check_ops(ops, 2, mnemonic);
+            if (ops[0].kind != Kind::reg || ops[1].kind != Kind::mem) {
+                unsupported(mnemonic);
+            }
+            encode({}, true, { 0x8D }, ops[0].reg, ops[1]);
+            return;
+        }
+        if (mnemonic == "push") {
+            check_ops(ops, 1, mnemonic);
+            if (ops[0].kind == Kind::reg) {
+                rex(false, 0, -1, ops[0].reg);
+                byte(static_cast<uint8_t>(0x50 + (ops[0].reg & 7)));
+            }
+            else if (ops[0].kind == Kind::imm && fits8(ops[0].imm)) {
+                byte(0x6A);
+                bytes(static_cast<uint64_t>(ops[0].imm), 1);
+            }
+            else if (ops[0].kind == Kind::imm && fits32(ops[0].imm)) {
+                byte(0x68);
+                bytes(static_cast<uint64_t>(ops[0].imm), 4);
+            }
+            else if (ops[0].kind == Kind::mem) {
+                encode({}, false, { 0xFF }, 6, ops[0]);
+            }
+            else {
+                unsupported(mnemonic);
+            }
+            return;
+        }
+        if (mnemonic == "pop") {
+            check_ops(ops, 1, mnemonic);
+            if (ops[0].kind == Kind::reg) {
+                rex(false, 0, -1, ops[0].reg);
+                byte(static_cast<uint8_t>(0x58 + (ops[0].reg & 7)));
+            }
+            else if (ops[0].kind == Kind::mem) {
+                encode({}, false, { 0x8F }, 0, ops[0]);
+            }
+            else {
+                unsupported(mnemonic);
+            }
+            return;
+        }
+        for (const auto& [name, ext] : std::initializer_list<std::pair<std::string_view, int>> {
+                 { "not", 2 }, { "neg", 3 }, { "mul", 4 }, { "div", 6 }, { "idiv", 7 } }) {
+            if (mnemonic == name) {
+                check_ops(ops, 1, mnemonic);
+                encode({}, true, { 0xF7 }, ext, ops[0]);
+                return;
+            }
+        }
+        if (mnemonic == "imul") {
+            if (ops.size() == 1) {
+                encode({}, true, { 0xF7 }, 5, ops[0]);
+            }
+            else if (ops.size() == 2) {
+                encode({}, true, { 0x0F, 0xAF }, ops[0].reg, ops[1]);
+            }
+            else if (ops.size() == 3 && ops[2].kind == Kind::imm && fits8(ops[2].imm)) {
+                encode({}, true, { 0x6B }, ops[0].reg, ops[1]);
+                bytes(static_cast<uint64_t>(ops[2].imm), 1);
+            }
+            else if (ops.size() == 3 && ops[2].kind == Kind::imm && fits32(ops[2].imm)) {
+                encode({}, true, { 0x69 }, ops[0].reg, ops[1]);
+                bytes(static_cast<uint64_t>(ops[2].imm), 4);
+            }
+            else {
+                unsupported(mnemonic);
+            }
+            return;
+        }
+        for (const auto& [name, ext] :
+             std::initializer_list<std::pair<std::string_view, int>> { { "shl", 4 }, { "shr", 5 }, { "sar", 7 } }) {
+            if (mnemonic == name) {
+                check_ops(ops, 2, mnemonic);
+                if (ops[1].kind == Kind::imm) {
+                    encode({}, true, { 0xC1 }, ext, ops[0]);
+                    bytes(static_cast<uint64_t>(ops[1].imm), 1);
+                }
+                else if (ops[1].kind == Kind::reg && ops[1].reg == 1 && ops[1].size == 8) {
+                    encode({}, true, { 0xD3 }, ext, ops[0]);
+                }
+                else {
+                    unsupported(mnemonic);
+                }
+                return;
+            }
+        }
+        for (const auto& [name, pp] :
+             std::initializer_list<std::pair<std::string_view, int>> { { "shlx", 1 }, { "sarx", 2 }, { "shrx", 3 } }) {
+            if (mnemonic == name) {
+                check_ops(ops, 3, mnemonic);
+                encode_vex(false, pp, 2, true, 0xF7, ops[0].reg, ops[2].reg, ops[1]);
+                return;
+            }
+        }
+        if (mnemonic == "mulx") {
+            check_ops(ops, 3, mnemonic);
+            encode_vex(false, 3, 2, true, 0xF6, ops[0].reg, ops[1].reg, ops[2]);
+            return;
+        }
+        if (mnemonic == "movzx") {
+            check_ops(ops, 2, mnemonic);
+            encode({}, ops[0].size == 64, { 0x0F, 0xB6 }, ops[0].reg, ops[1]);
+            return;
+        }
+        if (mnemonic == "movsxd") {
+            check_ops(ops, 2, mnemonic);
+            encode({}, true, { 0x63 }, ops[0].reg, ops[1]);
+            return;
+        }
+        if (mnemonic == "jmp" || mnemonic == "call") {
+            check_ops(ops, 1, mnemonic);
+            if (ops[0].kind == Kind::label) {
+                byte(mnemonic == "jmp" ? 0xE9 : 0xE8);
+                rel32_to(ops[0].label);
+            }
+            else {
+                encode({}, false, { 0xFF }, mnemonic == "jmp" ? 4 : 2, ops[0]);
+            }
+            return;
+        }
+        if (mnemonic.starts_with("j")) {
+            if (const auto cc = condition_code(mnemonic.substr(1))) {
+                check_ops(ops, 1, mnemonic);
+                byte(0x0F);
+                byte(static_cast<uint8_t>(0x80 + cc.value()));
+                rel32_to(ops[0].label);
+                return;
+            }
+        }
+        if (mnemonic.starts_with("cmov")) {
+            if (const auto cc = condition_code(mnemonic.substr(4))) {
+                check_ops(ops, 2, mnemonic);
+                encode({}, true, { 0x0F, static_cast<uint8_t>(0x40 + cc.value()) }, ops[0].reg, ops[1]);
+                return;
+            }
+        }
+        if (mnemonic.starts_with("set")) {
+            if (const auto cc = condition_code(mnemonic.substr(3))) {
+                check_ops(ops, 1, mnemonic);
+                encode({}, false, { 0x0F, static_cast<uint8_t>(0x90 + cc.value()) }, 0, ops[0]);
+                return;
+            }
+        }
+        if (assemble_vector(mnemonic, ops)) {
+            return;
+        }
+        error("Unsupported instruction " + std::string(mnemonic));
+    }
+
+    bool assemble_vector(const std::string_view mnemonic, const std::vector<Operand>& ops)
+    {
+        using Kind = Operand::Kind;
+        // Packed integer instructions: SSE2 opcode (66 0F xx), also used for the VEX forms.
+        static constexpr std::pair<std::string_view, uint8_t> packed[]
+            = { { "paddq", 0xD4 }, { "psubq", 0xFB }, { "pxor", 0xEF }, { "punpcklqdq", 0x6C } };
+        for (const auto& [name, opcode] : packed) {
+            if (mnemonic == name) {
+                check_ops(ops, 2, mnemonic);
+                encode({ 0x66 }, false, { 0x0F, opcode }, ops[0].reg, ops[1]);
+                return true;
+            }
+            if (mnemonic.starts_with("v") && mnemonic.substr(1) == name) {
+                check_ops(ops, 3, mnemonic);
+                encode_vex(ops[0].size == 256, 1, 1, false, opcode, ops[0].reg, ops[1].reg, ops[2]);
+                return true;
+            }
+        }
+        if (mnemonic == "movdqu" || mnemonic == "movdqa") {
+            check_ops(ops, 2, mnemonic);
+            const uint8_t prefix = mnemonic == "movdqu" ? 0xF3 : 0x66;
+            if (ops[0].kind == Kind::vec) {
+                encode({ prefix }, false, { 0x0F, 0x6F }, ops[0].reg, ops[1]);
+            }
+            else {
+                encode({ prefix }, false, { 0x0F, 0x7F }, ops[1].reg, ops[0]);
+            }
+            return true;
+        }
+        if (mnemonic == "vmovdqu" || mnemonic == "vmovdqa") {
+            check_ops(ops, 2, mnemonic);
+            const int pp = mnemonic == "vmovdqu" ? 2 : 1;
+            if (ops[0].kind == Kind::vec) {
+                encode_vex(ops[0].size == 256, pp, 1, false, 0x6F, ops[0].reg, 0, ops[1]);
+            }
+            else {
+                encode_vex(ops[1].size == 256, pp, 1, false, 0x7F, ops[1].reg, 0, ops[0]);
+            }
+            return true;
+        }
+        if (mnemonic == "movq") {
+            check_ops(ops, 2, mnemonic);
+            if (ops[0].kind == Kind::vec) {
+                encode({ 0x66 }, true, { 0x0F, 0x6E }, ops[0].reg, ops[1]);
+            }
+            else {
+                encode({ 0x66 }, true, { 0x0F, 0x7E }, ops[1].reg, ops[0]);
+            }
+            return true;
+        }
+        if (mnemonic == "vpbroadcastq") {
+            check_ops(ops, 2, mnemonic);
+            encode_vex(ops[0].size == 256, 1, 2, false, 0x59, ops[0].reg, 0, ops[1]);
+            return true;
+        }
+        return false;
+    }
+
+    void resolve()
+    {
+        for (const Fixup& fixup : m_fixups) {
+            const auto it = m_asm.symbols.find(fixup.label);
+            if (it == m_asm.symbols.end()) {
+                std::cerr << "[Assembler] Undefined label: " << fixup.label << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            const Symbol& symbol = it->second;
+            std::vector<uint8_t>& section = fixup.section == Section::data ? m_asm.data : m_asm.text;
+            int64_t value;
+            if (fixup.kind == FixupKind::diff32) {
+                const auto base = m_asm.symbols.find(fixup.base_label);
+                if (base == m_asm.symbols.end() || base->second.section != symbol.section) {
+                    std::cerr << "[Assembler] Invalid label difference" << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+                value = static_cast<int64_t>(symbol.offset) - static_cast<int64_t>(base->second.offset);
+            }
+            else if (symbol.section == fixup.section) {
+                value = static_cast<int64_t>(symbol.offset) + fixup.addend - static_cast<int64_t>(fixup.pc_end);
+            }
+            else {
+                if (fixup.section != Section::text) {
+                    std::cerr << "[Assembler] Unsupported cross-section reference" << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+                m_asm.relocs.push_back(
+                    { .pos = fixup.pos,
+                      .target = symbol.section,
+                      .target_offset = static_cast<int64_t>(symbol.offset) + fixup.addend,
+                      .pc_end = fixup.pc_end });
+                continue;
+            }
+            if (!fits32(value)) {
+                std::cerr << "[Assembler] Reference out of range: " << fixup.label << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            const auto value32 = static_cast<uint32_t>(static_cast<int32_t>(value));
+            for (int i = 0; i < 4; i++) {
+                section[fixup.pos + i] = static_cast<uint8_t>(value32 >> (8 * i));
+            }
+        }
+    }
+
+    const std::string m_src;
+    Assembly m_asm {};
+    Section m_section = Section::text;
+    std::vector<Fixup> m_fixups {};
+    std::vector<size_t> m_pending_fixups {};
+    int m_line = 0;
+};
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <elf.h>
+#include <sys/stat.h>
+
+#include <cstring>
+#include <fstream>
+
+#include "assembler.hpp"
+
+// Writes an assembled program as a static executable laid out for the smallest file and the
+// cheapest exec: the headers, text and data are one read+write+execute PT_LOAD segment mapped
+// from the start of the file, bss follows in the same segment, and there are no section headers.
+// A PT_GNU_STACK header keeps the stack non-executable.
+inline void write_elf(Assembly assembly, const std::string& path)
+{
+    constexpr uint64_t base_addr = 0x400000;
+    constexpr size_t section_align = 16;
+    const auto align_up = [](const size_t size, const size_t align) { return (size + align - 1) / align * align; };
+
+    constexpr size_t headers_size = sizeof(Elf64_Ehdr) + 2 * sizeof(Elf64_Phdr);
+    const size_t text_offset = align_up(headers_size, section_align);
+    const size_t data_offset = align_up(text_offset + assembly.text.size(), section_align);
+    const size_t file_size = data_offset + assembly.data.size();
+    const size_t bss_offset = align_up(file_size, section_align);
+    assembly.link(base_addr + text_offset, base_addr + data_offset, base_addr + bss_offset);
+
+    Elf64_Ehdr header {};
+    std::memcpy(header.e_ident, ELFMAG, SELFMAG);
+    header.e_ident[EI_CLASS] = ELFCLASS64;
+    header.e_ident[EI_DATA] = ELFDATA2LSB;
+    header.e_ident[EI_VERSION] = EV_CURRENT;
+    header.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+    header.e_type = ET_EXEC;
+    header.e_machine = EM_X86_64;
+    header.e_version = EV_CURRENT;
+    header.e_entry = base_addr + text_offset + assembly.text_offset("_start");
+    header.e_phoff = sizeof(Elf64_Ehdr);
+    header.e_ehsize = sizeof(Elf64_Ehdr);
+    header.e_phentsize = sizeof(Elf64_Phdr);
+    header.e_phnum = 2;
+
+    Elf64_Phdr segments[2] {};
+    segments[0].p_type = PT_LOAD;
+    segments[0].p_flags = PF_R | PF_W | PF_X;
+    segments[0].p_vaddr = base_addr;
+    segments[0].p_paddr = base_addr;
+    segments[0].p_filesz = file_size;
+    segments[0].p_memsz = bss_offset + assembly.bss_size;
+    segments[0].p_align = 0x1000;
+    segments[1].p_type = PT_GNU_STACK;
+    segments[1].p_flags = PF_R | PF_W;
+    segments[1].p_align = section_align;
+
+    std::string image(file_size, '\0');
+    std::memcpy(image.data(), &header, sizeof(header));
+    std::memcpy(image.data() + sizeof(header), segments, sizeof(segments));
+    std::memcpy(image.data() + text_offset, assembly.text.data(), assembly.text.size());
+    std::memcpy(image.data() + data_offset, assembly.data.data(), assembly.data.size());
+
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    file << image;
+    file.close();
+    if (!file || chmod(path.c_str(), 0755) != 0) {
+        std::cerr << "[ELF] Failed to write " << path << std::endl;
+        exit(EXIT_FAILURE);
+    }
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stdexcept>
+
+// An error in the program being compiled. The tokenizer, parser and generator throw it instead of
+// exiting, so that they can also be driven in-process; main() prints the message and fails.
+class CompileError : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
@@ -0,0 +1,434 @@
+#pragma once
+
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <unordered_map>
+
+#include "parser.hpp"
+
+// Walks the AST to compute what a program does without generating code. Arithmetic wraps and
+// evaluation order matches the generated code, so a result found here is the one the native
+// binary produces.
+class Evaluator {
+public:
+    enum class Outcome {
+        exited,
+        div_by_zero,
+        over_budget,
+        invalid,
+    };
+
+    struct Result {
+        Outcome outcome;
+        int64_t exit_value = 0;
+    };
+
+    static constexpr int64_t bounds_fail_code = 255;
+    static constexpr int64_t max_array_len = 1 << 24;
+
+    explicit Evaluator(const size_t step_budget)
+        : m_steps_left(step_budget)
+    {
+    }
+
+    Result run(const NodeProg& prog)
+    {
+        try {
+            for (const NodeStmt* stmt : prog.stmts) {
+                eval_stmt(stmt);
+            }
+        }
+        catch (const Exit& exit) {
+            return { .outcome = Outcome::exited, .exit_value = exit.value };
+        }
+        catch (const Abort& abort) {
+            return { .outcome = abort.outcome };
+        }
+        return { .outcome = Outcome::exited, .exit_value = 0 };
+    }
+
+    // Drops cached folds. Needed before the nodes they are keyed on are freed and reused.
+    void forget_folds()
+    {
+        m_folds.clear();
+    }
+
+    // Value of an expression that does not depend on any variable and does not trap. Results are
+    // cached so that folding every subtree of an expression stays linear.
+    std::optional<int64_t> fold(const NodeExpr* expr) // NOLINT(*-no-recursion)
+    {
+        if (const auto it = m_folds.find(expr); it != m_folds.end()) {
+            return it->second;
+        }
+
+        struct FoldVisitor {
+            Evaluator& eval;
+
+            std::optional<int64_t> operator()(const NodeTerm* term) const
+            {
+                return eval.fold_term(term);
+            }
+
+            std::optional<int64_t> operator()(const NodeBinExpr* bin_expr) const
+            {
+                return std::visit(
+                    [&](const auto* bin) -> std::optional<int64_t> {
+                        const auto rhs = eval.fold(bin->rhs);
+                        const auto lhs = eval.fold(bin->lhs);
+                        if (!lhs.has_value() || !rhs.has_value()) {
+                            return {};
+                        }
+                        return apply(bin, lhs.value(), rhs.value());
+                    },
+                    bin_expr->var);
+            }
+        };
+
+        const std::optional<int64_t> value = std::visit(FoldVisitor { .eval = *this }, expr->var);
+        m_folds.emplace(expr, value);
+        return value;
+    }
+
+    static std::optional<int64_t> parse_int_lit(const Token& int_lit)
+    {
+        const std::string& str = int_lit.value.value();
+        int64_t value;
+        if (const auto [ptr, ec] = std::from_chars(str.data(), str.data() + str.size(), value);
+            ec != std::errc {} || ptr != str.data() + str.size()) {
+            return {};
+        }
+        return value;
+    }
+
+    static int64_t wrap(const uint64_t value)
+    {
+        return static_cast<int64_t>(value);
+    }
+
+    static std::optional<int64_t> apply(const NodeBinExprAdd*, const int64_t lhs, const int64_t rhs)
+    {
+        return wrap(static_cast<uint64_t>(lhs) + static_cast<uint64_t>(rhs));
+    }
+
+    static std::optional<int64_t> apply(const NodeBinExprSub*, const int64_t lhs, const int64_t rhs)
+    {
+        return wrap(static_cast<uint64_t>(lhs) - static_cast<uint64_t>(rhs));
+    }
+
+    static std::optional<int64_t> apply(const NodeBinExprMulti*, const int64_t lhs, const int64_t rhs)
+    {
+        return wrap(static_cast<uint64_t>(lhs) * static_cast<uint64_t>(rhs));
+    }
+
+    // Division by zero traps; the INT64_MIN / -1 overflow wraps.
+    static std::optional<int64_t> apply(const NodeBinExprDiv*, const int64_t lhs, const int64_t rhs)
+    {
+        if (rhs == 0) {
+            return {};
+        }
+        if (rhs == -1) {
+            return wrap(uint64_t { 0 } - static_cast<uint64_t>(lhs));
+        }
+        return lhs / rhs;
+    }
+
+    static std::optional<int64_t> apply(const NodeBinExprMod*, const int64_t lhs, const int64_t rhs)
+    {
+        if (rhs == 0) {
+            return {};
+        }
+        if (rhs == -1) {
+            return 0;
+        }
+        return lhs % rhs;
+    }
+
+    static std::optional<int64_t> apply(const NodeBinExprEq*, const int64_t lhs, const int64_t rhs)
+    {
+        return lhs == rhs ? 1 : 0;
+    }
+
+    static std::optional<int64_t> apply(const NodeBinExprNe*, const int64_t lhs, const int64_t rhs)
+    {
+        return lhs != rhs ? 1 : 0;
+    }
+
+private:
+    struct Exit {
+        int64_t value;
+    };
+
+    struct Abort {
+        Outcome outcome;
+    };
+
+    struct Var {
+        std::string name;
+        std::vector<int64_t> values;
+        bool is_array;
+    };
+
+    std::optional<int64_t> fold_term(const NodeTerm* term) // NOLINT(*-no-recursion)
+    {
+        if (std::holds_alternative<NodeTermIntLit*>(term->var)) {
+            return parse_int_lit(std::get<NodeTermIntLit*>(term->var)->int_lit);
+        }
+        if (std::holds_alternative<NodeTermParen*>(term->var)) {
+            return fold(std::get<NodeTermParen*>(term->var)->expr);
+        }
+        if (std::holds_alternative<NodeTermNeg*>(term->var)) {
+            if (const auto value = fold_term(std::get<NodeTermNeg*>(term->var)->term)) {
+                return wrap(uint64_t { 0 } - static_cast<uint64_t>(value.value()));
+            }
+        }
+        return {};
+    }
+
+    // Charges `count` steps against the budget, giving up once it is spent.
+    void step(const size_t count = 1)
+    {
+        if (m_steps_left < count) {
+            m_steps_left = 0;
+            throw Abort { Outcome::over_budget };
+        }
+        m_steps_left -= count;
+    }
+
+    Var* find_var(const Token& ident)
+    {
+        const auto it = m_var_index.find(ident.value.value());
+        return it == m_var_index.end() ? nullptr : &m_vars[it->second];
+    }
+
+    Var& lookup_var(const Token& ident)
+    {
+        Var* var = find_var(ident);
+        if (var == nullptr) {
+            throw Abort { Outcome::invalid };
+        }
+        return *var;
+    }
+
+    void declare(const Token& ident, std::vector<int64_t> values, const bool is_array)
+    {
+        if (find_var(ident) != nullptr) {
+            throw Abort { Outcome::invalid };
+        }
+        m_var_index.emplace(ident.value.value(), m_vars.size());
+        m_vars.push_back({ .name = ident.value.value(), .values = std::move(values), .is_array = is_array });
+    }
+
+    int64_t& element(Var& var, const int64_t index)
+    {
+        if (!var.is_array) {
+            throw Abort { Outcome::invalid };
+        }
+        if (index < 0 || static_cast<uint64_t>(index) >= var.values.size()) {
+            throw Exit { bounds_fail_code };
+        }
+        return var.values[static_cast<size_t>(index)];
+    }
+
+    int64_t eval_term(const NodeTerm* term) // NOLINT(*-no-recursion)
+    {
+        struct TermVisitor {
+            Evaluator& eval;
+
+            int64_t operator()(const NodeTermIntLit* term_int_lit) const
+            {
+                const auto value = parse_int_lit(term_int_lit->int_lit);
+                if (!value.has_value()) {
+                    throw Abort { Outcome::invalid };
+                }
+                return value.value();
+            }
+
+            int64_t operator()(const NodeTermIdent* term_ident) const
+            {
+                Var& var = eval.lookup_var(term_ident->ident);
+                if (var.is_array) {
+                    if (!eval.m_lane.has_value()) {
+                        throw Abort { Outcome::invalid };
+                    }
+                    return var.values.at(eval.m_lane->index);
+                }
+                return var.values.front();
+            }
+
+            int64_t operator()(const NodeTermIndex* term_index) const
+            {
+                Var& var = eval.lookup_var(term_index->ident);
+                return eval.element(var, eval.eval_expr(term_index->index));
+            }
+
+            int64_t operator()(const NodeTermParen* term_paren) const
+            {
+                return eval.eval_expr(term_paren->expr);
+            }
+
+            int64_t operator()(const NodeTermNeg* term_neg) const
+            {
+                return wrap(uint64_t { 0 } - static_cast<uint64_t>(eval.eval_term(term_neg->term)));
+            }
+        };
+
+        step();
+        return std::visit(TermVisitor { .eval = *this }, term->var);
+    }
+
+    int64_t eval_expr(const NodeExpr* expr) // NOLINT(*-no-recursion)
+    {
+        if (m_lane.has_value()) {
+            if (const auto it = m_lane->scalars.find(expr); it != m_lane->scalars.end()) {
+                return it->second;
+            }
+        }
+        if (std::holds_alternative<NodeTerm*>(expr->var)) {
+            return eval_term(std::get<NodeTerm*>(expr->var));
+        }
+        step();
+        return std::visit(
+            [&](const auto* bin) {
+                // The generated code evaluates the right operand first.
+                const int64_t rhs = eval_expr(bin->rhs);
+                const int64_t lhs = eval_expr(bin->lhs);
+                const auto value = apply(bin, lhs, rhs);
+                if (!value.has_value()) {
+                    throw Abort { Outcome::div_by_zero };
+                }
+                return value.value();
+            },
+            std::get<NodeBinExpr*>(expr->var)->var);
+    }
+
+    void eval_elementwise(Var& dst, const NodeExpr* expr)
+    {
+        const size_t len = dst.values.size();
+        m_lane = Lane {};
+        const auto is_array = [&](const Token& ident) {
+            const Var* var = find_var(ident);
+            if (var == nullptr || !var->is_array) {
+                return false;
+            }
+            if (var->values.size() != len) {
+                throw Abort { Outcome::invalid };
+            }
+            return true;
+        };
+        for_each_scalar(expr, is_array, [&](const NodeExpr* scalar) {
+            const int64_t value = eval_expr(scalar);
+            m_lane->scalars.emplace(scalar, value);
+        });
+        for (size_t i = 0; i < len; i++) {
+            m_lane->index = i;
+            dst.values[i] = eval_expr(expr);
+        }
+        m_lane.reset();
+    }
+
+    void eval_scope(const NodeScope* scope) // NOLINT(*-no-recursion)
+    {
+        const size_t scope_begin = m_vars.size();
+        for (const NodeStmt* stmt : scope->stmts) {
+            eval_stmt(stmt);
+        }
+        for (auto it = m_vars.cbegin() + static_cast<std::ptrdiff_t>(scope_begin); it != m_vars.cend(); ++it) {
+            m_var_index.erase(it->name);
+        }
+        m_vars.resize(scope_begin);
+    }
+
+    void eval_if_pred(const NodeIfPred* pred) // NOLINT(*-no-recursion)
+    {
+        if (std::holds_alternative<NodeIfPredElif*>(pred->var)) {
+            const NodeIfPredElif* elif = std::get<NodeIfPredElif*>(pred->var);
+            if (eval_expr(elif->expr) != 0) {
+                eval_scope(elif->scope);
+            }
+            else if (elif->pred.has_value()) {
+                eval_if_pred(elif->pred.value());
+            }
+            return;
+        }
+        eval_scope(std::get<NodeIfPredElse*>(pred->var)->scope);
+    }
+
+    void eval_stmt(const NodeStmt* stmt) // NOLINT(*-no-recursion)
+    {
+        struct StmtVisitor {
+            Evaluator& eval;
+
+            void operator()(const NodeStmtExit* stmt_exit) const
+            {
+                throw Exit { eval.eval_expr(stmt_exit->expr) };
+            }
+
+            void operator()(const NodeStmtLet* stmt_let) const
+            {
+                const int64_t value = eval.eval_expr(stmt_let->expr);
+                eval.declare(stmt_let->ident, { value }, false);
+            }
+
+            void operator()(const NodeStmtLetArray* stmt_let_array) const
+            {
+                const auto len = parse_int_lit(stmt_let_array->size);
+                if (!len.has_value() || len.value() <= 0 || len.value() > max_array_len) {
+                    throw Abort { Outcome::invalid };
+                }
+                // Zeroing the elements costs a step each, so that folding gives up on arrays larger
+                // than its budget instead of allocating them.
+                eval.step(static_cast<size_t>(len.value()));
+                eval.declare(stmt_let_array->ident, std::vector<int64_t>(static_cast<size_t>(len.value())), true);
+            }
+
+            void operator()(const NodeStmtAssign* stmt_assign) const
+            {
+                Var& var = eval.lookup_var(stmt_assign->ident);
+                if (var.is_array) {
+                    eval.eval_elementwise(var, stmt_assign->expr);
+                    return;
+                }
+                var.values.front() = eval.eval_expr(stmt_assign->expr);
+            }
+
+            void operator()(const NodeStmtAssignIndex* stmt_assign_index) const
+            {
+                const int64_t value = eval.eval_expr(stmt_assign_index->expr);
+                const int64_t index = eval.eval_expr(stmt_assign_index->index);
+                Var& var = eval.lookup_var(stmt_assign_index->ident);
+                eval.element(var, index) = value;
+            }
+
+            void operator()(const NodeScope* scope) const
+            {
+                eval.eval_scope(scope);
+            }
+
+            void operator()(const NodeStmtIf* stmt_if) const
+            {
+                if (eval.eval_expr(stmt_if->expr) != 0) {
+                    eval.eval_scope(stmt_if->scope);
+                }
+                else if (stmt_if->pred.has_value()) {
+                    eval.eval_if_pred(stmt_if->pred.value());
+                }
+            }
+        };
+
+        step();
+        std::visit(StmtVisitor { .eval = *this }, stmt->var);
+    }
+
+    struct Lane {
+        size_t index {};
+        std::unordered_map<const NodeExpr*, int64_t> scalars {};
+    };
+
+    size_t m_steps_left;
+    std::vector<Var> m_vars {};
+    // Index in `m_vars` of each variable in scope.
+    std::unordered_map<std::string, size_t> m_var_index {};
+    std::optional<Lane> m_lane {};
+    std::unordered_map<const NodeExpr*, std::optional<int64_t>> m_folds {};
+};
@@ -1,14 +1,134 @@
 #pragma once
 
+#include <fcntl.h>
+
 #include <algorithm>
+#include <bit>
 #include <cassert>
+#include <charconv>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
 
+#include "evaluation.hpp"
+#include "liveness.hpp"
+#include "parallel.hpp"
 #include "parser.hpp"
+#include "profile.hpp"
+
+struct DivMagic {
+    int64_t multiplier;
+    int shift;
+};
+
+// Magic number for signed division by a constant (Hacker's Delight, 10-1).
+// Valid for any divisor with |divisor| >= 2.
+inline DivMagic signed_div_magic(const int64_t divisor)
+{
+    constexpr uint64_t two63 = uint64_t { 1 } << 63;
+    const uint64_t ad = divisor < 0 ? uint64_t { 0 } - static_cast<uint64_t>(divisor) : divisor;
+    const uint64_t t = two63 + (static_cast<uint64_t>(divisor) >> 63);
+    const uint64_t anc = t - 1 - t % ad;
+    int p = 63;
+    uint64_t q1 = two63 / anc;
+    uint64_t r1 = two63 - q1 * anc;
+    uint64_t q2 = two63 / ad;
+    uint64_t r2 = two63 - q2 * ad;
+    uint64_t delta;
+    do {
+        p++;
+        q1 *= 2;
+        r1 *= 2;
+        if (r1 >= anc) {
+            q1++;
+            r1 -= anc;
+        }
+        q2 *= 2;
+        r2 *= 2;
+        if (r2 >= ad) {
+            q2++;
+            r2 -= ad;
+        }
+        delta = ad - r2;
+    } while (q1 < delta || (q1 == delta && r1 == 0));
+    auto multiplier = static_cast<int64_t>(q2 + 1);
+    if (divisor < 0) {
+        multiplier = static_cast<int64_t>(uint64_t { 0 } - static_cast<uint64_t>(multiplier));
+    }
+    return { .multiplier = multiplier, .shift = p - 64 };
+}
+
+// Magic number for unsigned division of a dividend below 2^63 by a constant that is not a power
+// of two (Hacker's Delight, 10-8): the quotient is the high half of dividend * multiplier (read as
+// unsigned) shifted right by `shift`. One bit of headroom means no add-back step is needed.
+inline DivMagic unsigned_div_magic(const int64_t divisor)
+{
+    using u128 = unsigned __int128;
+    const auto d = static_cast<uint64_t>(divisor);
+    const int l = std::bit_width(d);
+    for (int p = 64;; p++) {
+        const u128 m = ((u128 { 1 } << p) + d - 1) / d;
+        if (p == 63 + l || m * d - (u128 { 1 } << p) <= u128 { 1 } << (p - 63)) {
+            return { .multiplier = static_cast<int64_t>(static_cast<uint64_t>(m)), .shift = p - 64 };
+        }
+    }
+}
+
+enum class SimdLevel {
+    none,
+    sse2,
+    avx2,
+};
+
+// x86-64 microarchitecture levels. Scalar code uses instructions beyond the baseline from v3,
+// which has BMI2; v2 adds nothing the generator uses and v4 only AVX-512, which it does not use.
+enum class MarchLevel {
+    x86_64,
+    x86_64_v2,
+    x86_64_v3,
+    x86_64_v4,
+};
+
+struct GeneratorOptions {
+    // Target of the scalar code. From v3, divisions by constants use BMI2's mulx, shrx and sarx.
+    // See `gen_div_const`.
+    MarchLevel march = MarchLevel::x86_64;
+    // Instruction set used for element-wise array assignments. `none` selects the scalar loop.
+    SimdLevel simd = SimdLevel::sse2;
+    // Replace constant subexpressions with their value.
+    bool fold_constants = true;
+    // Steps the compile-time evaluator may spend trying to compute the whole program's exit value.
+    // 0 disables whole-program evaluation.
+    size_t eval_budget = 1 << 20;
+    // Skip stores whose value is never read and give unused variables no stack slot. See `Liveness`.
+    bool eliminate_dead_stores = true;
+    // Compute each expression the parser shared between statements once, keeping its value in a
+    // hidden stack slot. See `NodeExpr::shared`.
+    bool share_exprs = true;
+    // Lower two-armed ifs that only assign one variable to a conditional move, and dense elif
+    // ladders over one variable to a jump table. See `gen_if_cmov` and `gen_if_jump_table`.
+    bool lower_ifs = true;
+    // Emit a `jit_entry` function that runs the program on the stack passed in rdi and returns the
+    // exit code, instead of a `_start` that makes the exit syscall. See `Jit`.
+    bool jit = false;
+    // Threads used to lex and to generate independent top-level units. 0 uses one per core. The
+    // output does not depend on this.
+    size_t threads = 0;
+    // Count how often each if runs and takes each of its arms, and write the counts to
+    // `profile_path` when the program exits. See `ProfileLayout`.
+    bool instrument = false;
+    // Counts from an instrumented run of the same source. Ladders of exclusive tests are reordered
+    // to test the likeliest arm first, and arms that rarely run are moved out of line.
+    std::shared_ptr<const Profile> profile {};
+};
 
 class Generator {
 public:
-    explicit Generator(NodeProg prog)
+    explicit Generator(NodeProg prog, const GeneratorOptions options = {})
         : m_prog(std::move(prog))
+        , m_options(options)
+        , m_folder(0)
     {
     }
 
@@ -19,101 +139,217 @@ public:
 
             void operator()(const NodeTermIntLit* term_int_lit) const
             {
-                gen.m_output << "    mov rax, " << term_int_lit->int_lit.value.value() << "\n";
-                gen.push("rax");
+                const auto value = Evaluator::parse_int_lit(term_int_lit->int_lit);
+                if (!value.has_value()) {
+                    throw CompileError("Integer literal out of range: " + term_int_lit->int_lit.value.value());
+                }
+                gen.push_imm(value.value());
             }
 
             void operator()(const NodeTermIdent* term_ident) const
             {
-                const auto it = std::ranges::find_if(std::as_const(gen.m_vars), [&](const Var& var) {
-                    return var.name == term_ident->ident.value.value();
-                });
-                if (it == gen.m_vars.cend()) {
-                    std::cerr << "Undeclared identifier: " << term_ident->ident.value.value() << std::endl;
-                    exit(EXIT_FAILURE);
+                const Var* it = gen.find_var(term_ident->ident.value.value());
+                if (it == nullptr) {
+                    throw CompileError("Undeclared identifier: " + term_ident->ident.value.value());
                 }
+                if (it->array_len.has_value()) {
+                    if (!gen.m_lane.has_value()) {
+                        throw CompileError("Array used as a scalar: " + term_ident->ident.value.value());
+                    }
+                    gen.m_output << "    mov rax, QWORD [rsp + " << gen.slot_offset(gen.m_lane->counter_loc) << "]\n";
+                    gen.push("QWORD " + gen.elem_addr(*it, {}));
+                    return;
+                }
+                assert(!it->elided);
                 std::stringstream offset;
                 offset << "QWORD [rsp + " << (gen.m_stack_size - it->stack_loc - 1) * 8 << "]";
                 gen.push(offset.str());
             }
 
+            void operator()(const NodeTermIndex* term_index) const
+            {
+                const Var& var = gen.lookup_array(term_index->ident);
+                const std::optional<int64_t> index = gen.gen_elem_index(var, term_index->index);
+                gen.push("QWORD " + gen.elem_addr(var, index));
+            }
+
             void operator()(const NodeTermParen* term_paren) const
             {
                 gen.gen_expr(term_paren->expr);
             }
+
+            void operator()(const NodeTermNeg* term_neg) const
+            {
+                gen.gen_term_into("rax", term_neg->term);
+                gen.m_output << "    neg rax\n";
+                gen.push("rax");
+            }
         };
         TermVisitor visitor({ .gen = *this });
         std::visit(visitor, term->var);
     }
 
-    void gen_bin_expr(const NodeBinExpr* bin_expr)
+    // Computes the operator expression `expr` into rax. The first computation of a shared
+    // expression also fills its slot.
+    void gen_bin_expr(const NodeExpr* expr)
     {
         struct BinExprVisitor {
             Generator& gen;
 
             void operator()(const NodeBinExprSub* sub) const
             {
-                gen.gen_expr(sub->rhs);
-                gen.gen_expr(sub->lhs);
-                gen.pop("rax");
-                gen.pop("rbx");
-                gen.m_output << "    sub rax, rbx\n";
-                gen.push("rax");
+                const Operand rhs = gen.gen_operands(sub->lhs, sub->rhs);
+                gen.m_output << "    sub rax, " << rhs.text << "\n";
             }
 
             void operator()(const NodeBinExprAdd* add) const
             {
-                gen.gen_expr(add->rhs);
-                gen.gen_expr(add->lhs);
-                gen.pop("rax");
-                gen.pop("rbx");
-                gen.m_output << "    add rax, rbx\n";
-                gen.push("rax");
+                gen.gen_add(add->lhs, add->rhs);
             }
 
             void operator()(const NodeBinExprMulti* multi) const
             {
-                gen.gen_expr(multi->rhs);
-                gen.gen_expr(multi->lhs);
-                gen.pop("rax");
-                gen.pop("rbx");
-                gen.m_output << "    mul rbx\n";
-                gen.push("rax");
+                gen.gen_multi(multi->lhs, multi->rhs);
             }
 
             void operator()(const NodeBinExprDiv* div) const
             {
-                gen.gen_expr(div->rhs);
-                gen.gen_expr(div->lhs);
-                gen.pop("rax");
-                gen.pop("rbx");
-                gen.m_output << "    div rbx\n";
-                gen.push("rax");
+                gen.gen_div(div->lhs, div->rhs, false);
+            }
+
+            void operator()(const NodeBinExprMod* mod) const
+            {
+                gen.gen_div(mod->lhs, mod->rhs, true);
+            }
+
+            void operator()(const NodeBinExprEq* eq) const
+            {
+                gen.gen_compare(eq->lhs, eq->rhs);
+                gen.m_output << "    sete al\n";
+                gen.m_output << "    movzx rax, al\n";
+            }
+
+            void operator()(const NodeBinExprNe* ne) const
+            {
+                gen.gen_compare(ne->lhs, ne->rhs);
+                gen.m_output << "    setne al\n";
+                gen.m_output << "    movzx rax, al\n";
             }
         };
 
         BinExprVisitor visitor { .gen = *this };
-        std::visit(visitor, bin_expr->var);
+        std::visit(visitor, std::get<NodeBinExpr*>(expr->var)->var);
+        if (m_lane.has_value() || m_conditional != 0) {
+            return;
+        }
+        if (const auto shared = m_shared_slots.find(expr); shared != m_shared_slots.end()) {
+            m_output << "    mov [rsp + " << slot_offset(shared->second.stack_loc) << "], rax\n";
+            shared->second.ready = true;
+            m_shared_fills.emplace_back(expr, m_scopes.size());
+        }
     }
 
+    // Pushes the value of `expr`.
     void gen_expr(const NodeExpr* expr)
     {
-        struct ExprVisitor {
-            Generator& gen;
-
-            void operator()(const NodeTerm* term) const
-            {
-                gen.gen_term(term);
+        if (const auto stored = stored_value(expr)) {
+            if (stored->imm.has_value()) {
+                push_imm(stored->imm.value());
             }
+            else {
+                push(stored->text);
+            }
+            return;
+        }
+        if (std::holds_alternative<NodeBinExpr*>(expr->var)) {
+            gen_bin_expr(expr);
+            push("rax");
+            return;
+        }
+        gen_term(std::get<NodeTerm*>(expr->var));
+    }
 
-            void operator()(const NodeBinExpr* bin_expr) const
-            {
-                gen.gen_bin_expr(bin_expr);
+    // Gives each shared expression that `stmt` is first to compute a hidden stack slot in the
+    // current scope. The first computation fills the slot and later ones in the scope reload it.
+    void reserve_shared(const NodeStmt* stmt)
+    {
+        // A streamed top-level statement's nodes are released once it is generated.
+        if (m_stream != nullptr && m_scopes.empty()) {
+            return;
+        }
+        std::vector<const NodeExpr*> exprs;
+        if (std::holds_alternative<NodeStmtExit*>(stmt->var)) {
+            exprs.push_back(std::get<NodeStmtExit*>(stmt->var)->expr);
+        }
+        else if (std::holds_alternative<NodeStmtLet*>(stmt->var)) {
+            const NodeStmtLet* stmt_let = std::get<NodeStmtLet*>(stmt->var);
+            const StoreFate fate = store_fate(stmt_let);
+            if (fate == StoreFate::keep || fate == StoreFate::effects_only) {
+                exprs.push_back(stmt_let->expr);
             }
-        };
+        }
+        else if (std::holds_alternative<NodeStmtAssign*>(stmt->var)) {
+            const NodeStmtAssign* stmt_assign = std::get<NodeStmtAssign*>(stmt->var);
+            const StoreFate fate = store_fate(stmt_assign);
+            if (find_scalar(stmt_assign->ident.value.value()) != nullptr
+                && (fate == StoreFate::keep || fate == StoreFate::effects_only)) {
+                exprs.push_back(stmt_assign->expr);
+            }
+        }
+        else if (std::holds_alternative<NodeStmtAssignIndex*>(stmt->var)) {
+            exprs.push_back(std::get<NodeStmtAssignIndex*>(stmt->var)->expr);
+            exprs.push_back(std::get<NodeStmtAssignIndex*>(stmt->var)->index);
+        }
+        std::unordered_set<const NodeExpr*> seen;
+        std::vector<const NodeExpr*> reserved;
+        for (const NodeExpr* expr : exprs) {
+            collect_shared(expr, seen, reserved);
+        }
+        if (reserved.empty()) {
+            return;
+        }
+        m_output << "    sub rsp, " << reserved.size() * 8 << "\n";
+        for (const NodeExpr* expr : reserved) {
+            grow_stack(1);
+            m_vars.push_back({ .name = "", .stack_loc = m_stack_size - 1 });
+            m_shared_slots.emplace(expr, SharedSlot { .stack_loc = m_stack_size - 1 });
+            m_shared_order.push_back(expr);
+        }
+    }
 
-        ExprVisitor visitor { .gen = *this };
-        std::visit(visitor, expr->var);
+    // Shared binary expressions in `expr` that have no slot yet. Leaves are as cheap to recompute
+    // as to reload.
+    void collect_shared( // NOLINT(*-no-recursion)
+        const NodeExpr* expr,
+        std::unordered_set<const NodeExpr*>& seen,
+        std::vector<const NodeExpr*>& reserved)
+    {
+        if (!seen.insert(expr).second || m_shared_slots.contains(expr)
+            || (m_options.fold_constants && m_folder.fold(expr).has_value())) {
+            return;
+        }
+        if (std::holds_alternative<NodeBinExpr*>(expr->var)) {
+            if (expr->shared) {
+                reserved.push_back(expr);
+            }
+            std::visit(
+                [&](const auto* bin) {
+                    collect_shared(bin->lhs, seen, reserved);
+                    collect_shared(bin->rhs, seen, reserved);
+                },
+                std::get<NodeBinExpr*>(expr->var)->var);
+            return;
+        }
+        const NodeTerm* term = std::get<NodeTerm*>(expr->var);
+        while (std::holds_alternative<NodeTermNeg*>(term->var)) {
+            term = std::get<NodeTermNeg*>(term->var)->term;
+        }
+        if (std::holds_alternative<NodeTermParen*>(term->var)) {
+            collect_shared(std::get<NodeTermParen*>(term->var)->expr, seen, reserved);
+        }
+        else if (std::holds_alternative<NodeTermIndex*>(term->var)) {
+            collect_shared(std::get<NodeTermIndex*>(term->var)->index, seen, reserved);
+        }
     }
 
     void gen_scope(const NodeScope* scope)
@@ -125,178 +361,1891 @@ public:
         end_scope();
     }
 
-    void gen_if_pred(const NodeIfPred* pred, const std::string& end_label)
+    struct Comparison {
+        const NodeExpr* lhs;
+        const NodeExpr* rhs;
+        bool equal;
+    };
+
+    // The operands of an expression that is an `==` or `!=` test.
+    static std::optional<Comparison> as_comparison(const NodeExpr* expr)
     {
-        struct PredVisitor {
-            Generator& gen;
-            const std::string& end_label;
+        if (!std::holds_alternative<NodeBinExpr*>(expr->var)) {
+            return {};
+        }
+        const NodeBinExpr* bin_expr = std::get<NodeBinExpr*>(expr->var);
+        if (const auto* eq = std::get_if<NodeBinExprEq*>(&bin_expr->var)) {
+            return Comparison { .lhs = (*eq)->lhs, .rhs = (*eq)->rhs, .equal = true };
+        }
+        if (const auto* ne = std::get_if<NodeBinExprNe*>(&bin_expr->var)) {
+            return Comparison { .lhs = (*ne)->lhs, .rhs = (*ne)->rhs, .equal = false };
+        }
+        return {};
+    }
 
-            void operator()(const NodeIfPredElif* elif) const
-            {
-                gen.m_output << "    ;; elif\n";
-                gen.gen_expr(elif->expr);
-                gen.pop("rax");
-                const std::string label = gen.create_label();
-                gen.m_output << "    test rax, rax\n";
-                gen.m_output << "    jz " << label << "\n";
-                gen.gen_scope(elif->scope);
-                gen.m_output << "    jmp " << end_label << "\n";
-                if (elif->pred.has_value()) {
-                    gen.m_output << label << ":\n";
-                    gen.gen_if_pred(elif->pred.value(), end_label);
+    // Where an operand of an ALU instruction is: an immediate, a stack slot or rbx.
+    struct Operand {
+        std::string text;
+        std::optional<int64_t> imm {};
+    };
+
+    // `expr` as an operand the instruction can read directly, without evaluating it onto the stack
+    // first: an imm32 constant, a scalar variable's slot or a shared value's filled slot. Reading one
+    // has no effects, so it may happen after the other operand is evaluated.
+    std::optional<Operand> direct_operand(const NodeExpr* expr)
+    {
+        if (m_lane.has_value()) {
+            return {};
+        }
+        std::optional<int64_t> value = const_int(expr);
+        if (!value.has_value() && m_options.fold_constants) {
+            value = m_folder.fold(expr);
+        }
+        if (value.has_value()) {
+            if (value.value() < INT32_MIN || value.value() > INT32_MAX) {
+                return {};
+            }
+            return Operand { .text = std::to_string(value.value()), .imm = value };
+        }
+        if (const auto it = m_shared_slots.find(expr); it != m_shared_slots.end() && it->second.ready) {
+            return Operand { .text = "QWORD [rsp + " + std::to_string(slot_offset(it->second.stack_loc)) + "]" };
+        }
+        if (std::holds_alternative<NodeTerm*>(expr->var)) {
+            const NodeTerm* term = std::get<NodeTerm*>(expr->var);
+            if (std::holds_alternative<NodeTermIdent*>(term->var)) {
+                if (const Var* var = find_scalar(std::get<NodeTermIdent*>(term->var)->ident.value.value())) {
+                    return Operand { .text = "QWORD [rsp + " + std::to_string(slot_offset(var->stack_loc)) + "]" };
                 }
             }
+        }
+        return {};
+    }
 
-            void operator()(const NodeIfPredElse* else_) const
-            {
-                gen.m_output << "    ;; else\n";
-                gen.gen_scope(else_->scope);
+    // Where the value of `expr` already is, so that it need not be computed: the slot a lane
+    // evaluated it to, the filled slot of a shared expression, or the constant it folds to.
+    std::optional<Operand> stored_value(const NodeExpr* expr)
+    {
+        if (m_lane.has_value()) {
+            if (const auto it = m_lane->scalars.find(expr); it != m_lane->scalars.end()) {
+                return Operand { .text = "QWORD [rsp + " + std::to_string(slot_offset(it->second)) + "]" };
             }
-        };
-
-        PredVisitor visitor { .gen = *this, .end_label = end_label };
-        std::visit(visitor, pred->var);
+        }
+        else if (const auto it = m_shared_slots.find(expr); it != m_shared_slots.end() && it->second.ready) {
+            return Operand { .text = "QWORD [rsp + " + std::to_string(slot_offset(it->second.stack_loc)) + "]" };
+        }
+        if (m_options.fold_constants && !const_int(expr).has_value()) {
+            if (const auto value = m_folder.fold(expr)) {
+                return Operand { .text = std::to_string(value.value()), .imm = value };
+            }
+        }
+        return {};
     }
 
-    void gen_stmt(const NodeStmt* stmt)
+    // Leaves `lhs` in rax and returns where `rhs` is, evaluating `rhs` first like every binary
+    // operator. A direct `rhs` is not evaluated at all; otherwise it ends up in rbx, and only waits
+    // on the stack if `lhs` has to be computed.
+    Operand gen_operands(const NodeExpr* lhs, const NodeExpr* rhs)
     {
-        struct StmtVisitor {
-            Generator& gen;
+        if (auto operand = direct_operand(rhs)) {
+            gen_expr_into("rax", lhs);
+            return std::move(operand.value());
+        }
+        if (direct_operand(lhs).has_value()) {
+            gen_expr_into("rbx", rhs);
+            gen_expr_into("rax", lhs);
+            return Operand { .text = "rbx" };
+        }
+        gen_expr(rhs);
+        gen_expr_into("rax", lhs);
+        pop("rbx");
+        return Operand { .text = "rbx" };
+    }
 
-            void operator()(const NodeStmtExit* stmt_exit) const
-            {
-                gen.m_output << "    ;; exit\n";
-                gen.gen_expr(stmt_exit->expr);
-                gen.m_output << "    mov rax, 60\n";
-                gen.pop("rdi");
-                gen.m_output << "    syscall\n";
-                gen.m_output << "    ;; /exit\n";
+    // Evaluates `expr` into `reg`. Direct operands are loaded and operators are computed in rax,
+    // so only array elements go through the stack.
+    void gen_expr_into(const std::string& reg, const NodeExpr* expr)
+    {
+        if (const auto operand = direct_operand(expr)) {
+            load_operand(reg, operand.value());
+            return;
+        }
+        if (const auto stored = stored_value(expr)) {
+            load_operand(reg, stored.value());
+            return;
+        }
+        if (std::holds_alternative<NodeBinExpr*>(expr->var)) {
+            gen_bin_expr(expr);
+            if (reg != "rax") {
+                m_output << "    mov " << reg << ", rax\n";
             }
+            return;
+        }
+        gen_term_into(reg, std::get<NodeTerm*>(expr->var));
+    }
 
-            void operator()(const NodeStmtLet* stmt_let) const
-            {
-                gen.m_output << "    ;; let\n";
-                if (std::ranges::find_if(
-                        std::as_const(gen.m_vars),
-                        [&](const Var& var) { return var.name == stmt_let->ident.value.value(); })
-                    != gen.m_vars.cend()) {
-                    std::cerr << "Identifier already used: " << stmt_let->ident.value.value() << std::endl;
-                    exit(EXIT_FAILURE);
-                }
-                gen.m_vars.push_back({ .name = stmt_let->ident.value.value(), .stack_loc = gen.m_stack_size });
-                gen.gen_expr(stmt_let->expr);
-                gen.m_output << "    ;; /let\n";
+    // gen_expr_into for a term.
+    void gen_term_into(const std::string& reg, const NodeTerm* term) // NOLINT(*-no-recursion)
+    {
+        if (const auto* paren = std::get_if<NodeTermParen*>(&term->var)) {
+            gen_expr_into(reg, (*paren)->expr);
+            return;
+        }
+        if (const auto* neg = std::get_if<NodeTermNeg*>(&term->var)) {
+            gen_term_into(reg, (*neg)->term);
+            m_output << "    neg " << reg << "\n";
+            return;
+        }
+        if (const auto* int_lit = std::get_if<NodeTermIntLit*>(&term->var)) {
+            if (const auto value = Evaluator::parse_int_lit((*int_lit)->int_lit)) {
+                gen_load_imm(m_output, reg, value.value());
+                return;
             }
+        }
+        const auto* ident = std::get_if<NodeTermIdent*>(&term->var);
+        if (const Var* var = ident == nullptr ? nullptr : find_scalar((*ident)->ident.value.value())) {
+            m_output << "    mov " << reg << ", QWORD [rsp + " << slot_offset(var->stack_loc) << "]\n";
+            return;
+        }
+        gen_term(term);
+        pop(reg);
+    }
 
-            void operator()(const NodeStmtAssign* stmt_assign) const
-            {
-                const auto it = std::ranges::find_if(gen.m_vars, [&](const Var& var) {
-                    return var.name == stmt_assign->ident.value.value();
-                });
-                if (it == gen.m_vars.end()) {
-                    std::cerr << "Undeclared identifier: " << stmt_assign->ident.value.value() << std::endl;
-                    exit(EXIT_FAILURE);
-                }
-                gen.gen_expr(stmt_assign->expr);
-                gen.pop("rax");
-                gen.m_output << "    mov [rsp + " << (gen.m_stack_size - it->stack_loc - 1) * 8 << "], rax\n";
-            }
+    void load_operand(const std::string& reg, const Operand& operand)
+    {
+        if (operand.imm.has_value()) {
+            gen_load_imm(m_output, reg, operand.imm.value());
+        }
+        else {
+            m_output << "    mov " << reg << ", " << operand.text << "\n";
+        }
+    }
 
-            void operator()(const NodeScope* scope) const
-            {
-                gen.m_output << "    ;; scope\n";
-                gen.gen_scope(scope);
-                gen.m_output << "    ;; /scope\n";
+    // `mov reg, value`, or `xor` on the 32-bit register for zero, which is shorter and breaks the
+    // dependency on the old value. Clobbers the flags.
+    static void gen_load_imm(std::ostream& out, const std::string_view reg, const int64_t value)
+    {
+        if (value == 0) {
+            const std::string reg32 = "e" + std::string(reg.substr(1));
+            out << "    xor " << reg32 << ", " << reg32 << "\n";
+        }
+        else {
+            out << "    mov " << reg << ", " << value << "\n";
+        }
+    }
+
+    // `expr` as `factor * scale` with a scale that an address can encode. A shared product is left
+    // to gen_expr, which computes it once.
+    std::optional<std::pair<const NodeExpr*, int64_t>> as_scaled(const NodeExpr* expr) const
+    {
+        if (!std::holds_alternative<NodeBinExpr*>(expr->var) || m_shared_slots.contains(expr)) {
+            return {};
+        }
+        const auto* multi = std::get_if<NodeBinExprMulti*>(&std::get<NodeBinExpr*>(expr->var)->var);
+        if (multi == nullptr) {
+            return {};
+        }
+        const auto operands = { std::pair((*multi)->lhs, (*multi)->rhs), std::pair((*multi)->rhs, (*multi)->lhs) };
+        for (const auto& [factor, scale] : operands) {
+            if (const auto value = const_int(scale); value == 2 || value == 4 || value == 8) {
+                return std::pair(factor, value.value());
             }
+        }
+        return {};
+    }
 
-            void operator()(const NodeStmtIf* stmt_if) const
-            {
-                gen.m_output << "    ;; if\n";
-                gen.gen_expr(stmt_if->expr);
-                gen.pop("rax");
-                const std::string label = gen.create_label();
-                gen.m_output << "    test rax, rax\n";
-                gen.m_output << "    jz " << label << "\n";
-                gen.gen_scope(stmt_if->scope);
-                if (stmt_if->pred.has_value()) {
-                    const std::string end_label = gen.create_label();
-                    gen.m_output << "    jmp " << end_label << "\n";
-                    gen.m_output << label << ":\n";
-                    gen.gen_if_pred(stmt_if->pred.value(), end_label);
-                    gen.m_output << end_label << ":\n";
+    // Addition, with `a + b * {2,4,8}` as a single `lea`.
+    void gen_add(const NodeExpr* lhs, const NodeExpr* rhs)
+    {
+        if (!m_lane.has_value()) {
+            const auto rhs_scaled = as_scaled(rhs);
+            const auto lhs_scaled = rhs_scaled.has_value() ? std::nullopt : as_scaled(lhs);
+            if (rhs_scaled.has_value() || lhs_scaled.has_value()) {
+                const auto [factor, scale] = rhs_scaled.has_value() ? rhs_scaled.value() : lhs_scaled.value();
+                const NodeExpr* other = rhs_scaled.has_value() ? lhs : rhs;
+                // Keep the evaluation order: whichever side of the `+` is the rhs goes first.
+                std::string base = "rax";
+                std::string index = "rbx";
+                if (rhs_scaled.has_value()) {
+                    const Operand operand = gen_operands(other, factor);
+                    if (operand.text != "rbx") {
+                        m_output << "    mov rbx, " << operand.text << "\n";
+                    }
                 }
                 else {
-                    gen.m_output << label << ":\n";
+                    const Operand operand = gen_operands(factor, other);
+                    if (operand.text != "rbx") {
+                        m_output << "    mov rbx, " << operand.text << "\n";
+                    }
+                    std::swap(base, index);
                 }
-                gen.m_output << "    ;; /if\n";
+                m_output << "    lea rax, [" << base << " + " << index << "*" << scale << "]\n";
+                return;
             }
-        };
-
-        StmtVisitor visitor { .gen = *this };
-        std::visit(visitor, stmt->var);
+        }
+        const Operand operand = gen_commutative(lhs, rhs);
+        m_output << "    add rax, " << operand.text << "\n";
     }
 
-    [[nodiscard]] std::string gen_prog()
+    // Multiplication. A constant factor becomes a shift, a `lea` or a three-operand `imul`.
+    void gen_multi(const NodeExpr* lhs, const NodeExpr* rhs)
     {
-        m_output << "global _start\n_start:\n";
+        const Operand operand = gen_commutative(lhs, rhs);
+        if (!operand.imm.has_value()) {
+            m_output << "    imul rax, " << operand.text << "\n";
+        }
+        else if (const int64_t factor = operand.imm.value(); factor == 0) {
+            gen_load_imm(m_output, "rax", 0);
+        }
+        else if (factor == -1) {
+            m_output << "    neg rax\n";
+        }
+        else if (factor > 1 && std::has_single_bit(static_cast<uint64_t>(factor))) {
+            m_output << "    shl rax, " << std::countr_zero(static_cast<uint64_t>(factor)) << "\n";
+        }
+        else if (factor == 3 || factor == 5 || factor == 9) {
+            m_output << "    lea rax, [rax + rax*" << factor - 1 << "]\n";
+        }
+        else if (factor != 1) {
+            m_output << "    imul rax, rax, " << factor << "\n";
+        }
+    }
 
-        for (const NodeStmt* stmt : m_prog.stmts) {
-            gen_stmt(stmt);
+    // gen_operands for a commutative operator, which can also take `lhs` as the direct operand.
+    Operand gen_commutative(const NodeExpr* lhs, const NodeExpr* rhs)
+    {
+        if (!direct_operand(rhs).has_value() && direct_operand(lhs).has_value()) {
+            return gen_operands(rhs, lhs);
         }
+        return gen_operands(lhs, rhs);
+    }
 
-        m_output << "    mov rax, 60\n";
-        m_output << "    mov rdi, 0\n";
-        m_output << "    syscall\n";
-        return m_output.str();
+    // Evaluates both operands and sets the flags for an equality test between them. Equality is
+    // symmetric, so either operand may be the one compared against.
+    void gen_compare(const NodeExpr* lhs, const NodeExpr* rhs)
+    {
+        const Operand operand = gen_commutative(lhs, rhs);
+        m_output << "    cmp rax, " << operand.text << "\n";
     }
 
-private:
-    void push(const std::string& reg)
+    // Jumps to `label` if the truth of `cond` is `truth`. An equality test branches on the
+    // comparison itself instead of materializing its 0 or 1 first.
+    void gen_jump_if(const NodeExpr* cond, const bool truth, const std::string& label)
     {
-        m_output << "    push " << reg << "\n";
-        m_stack_size++;
+        if (m_options.fold_constants) {
+            if (const auto value = m_folder.fold(cond)) {
+                if ((value.value() != 0) == truth) {
+                    m_output << "    jmp " << label << "\n";
+                }
+                return;
+            }
+        }
+        if (const auto cmp = as_comparison(cond)) {
+            gen_compare(cmp->lhs, cmp->rhs);
+            m_output << "    " << (cmp->equal == truth ? "je " : "jne ") << label << "\n";
+            return;
+        }
+        gen_expr_into("rax", cond);
+        m_output << "    test rax, rax\n";
+        m_output << "    " << (truth ? "jnz " : "jz ") << label << "\n";
     }
 
-    void pop(const std::string& reg)
+    static constexpr int cmov_max_nodes = 8;
+    static constexpr size_t jump_table_min_arms = 4;
+    static constexpr int64_t jump_table_max_span = 1024;
+    static constexpr int range_max_nodes = 256;
+    static constexpr int const_int_max_wrappers = 16;
+
+    // Whether `expr` is small enough to evaluate unconditionally and cannot trap.
+    static bool is_speculatable(const NodeExpr* expr, int& budget) // NOLINT(*-no-recursion)
     {
-        m_output << "    pop " << reg << "\n";
-        m_stack_size--;
+        if (--budget < 0) {
+            return false;
+        }
+        if (std::holds_alternative<NodeBinExpr*>(expr->var)) {
+            return std::visit(
+                [&]<typename BinExpr>(const BinExpr* bin) {
+                    if constexpr (std::is_same_v<BinExpr, NodeBinExprDiv> || std::is_same_v<BinExpr, NodeBinExprMod>) {
+                        return false;
+                    }
+                    else {
+                        return is_speculatable(bin->lhs, budget) && is_speculatable(bin->rhs, budget);
+                    }
+                },
+                std::get<NodeBinExpr*>(expr->var)->var);
+        }
+        const NodeTerm* term = std::get<NodeTerm*>(expr->var);
+        while (std::holds_alternative<NodeTermNeg*>(term->var)) {
+            term = std::get<NodeTermNeg*>(term->var)->term;
+        }
+        if (std::holds_alternative<NodeTermParen*>(term->var)) {
+            return is_speculatable(std::get<NodeTermParen*>(term->var)->expr, budget);
+        }
+        return !std::holds_alternative<NodeTermIndex*>(term->var);
     }
 
-    void begin_scope()
+    // The assignment that is the only statement of `scope`, if that is what it holds.
+    static const NodeStmtAssign* sole_assign(const NodeScope* scope)
     {
-        m_scopes.push_back(m_vars.size());
+        if (scope->stmts.size() != 1 || !std::holds_alternative<NodeStmtAssign*>(scope->stmts.front()->var)) {
+            return nullptr;
+        }
+        return std::get<NodeStmtAssign*>(scope->stmts.front()->var);
     }
 
-    void end_scope()
+    // Lowers `if (c) { x = a; } else { x = b; }`, or the same without the else, to a conditional
+    // move. Both values are evaluated, so they must be cheap and unable to trap.
+    bool gen_if_cmov(const NodeStmtIf* stmt_if)
     {
-        const size_t pop_count = m_vars.size() - m_scopes.back();
-        if (pop_count != 0) {
-            m_output << "    add rsp, " << pop_count * 8 << "\n";
+        // A conditional move has no arms to count.
+        if (m_options.instrument) {
+            return false;
         }
-        m_stack_size -= pop_count;
-        for (size_t i = 0; i < pop_count; i++) {
-            m_vars.pop_back();
+        const NodeStmtAssign* then_assign = sole_assign(stmt_if->scope);
+        if (then_assign == nullptr || store_fate(then_assign) != StoreFate::keep) {
+            return false;
         }
-        m_scopes.pop_back();
+        int budget = cmov_max_nodes;
+        if (!is_speculatable(then_assign->expr, budget)) {
+            return false;
+        }
+        const NodeExpr* else_expr = nullptr;
+        if (stmt_if->pred.has_value()) {
+            const auto* else_ = std::get_if<NodeIfPredElse*>(&stmt_if->pred.value()->var);
+            if (else_ == nullptr) {
+                return false;
+            }
+            const NodeStmtAssign* else_assign = sole_assign((*else_)->scope);
+            budget = cmov_max_nodes;
+            if (else_assign == nullptr || else_assign->ident.value != then_assign->ident.value
+                || store_fate(else_assign) != StoreFate::keep || !is_speculatable(else_assign->expr, budget)) {
+                return false;
+            }
+            else_expr = else_assign->expr;
+        }
+        const Var* var = find_scalar(then_assign->ident.value.value());
+        if (var == nullptr || (m_options.fold_constants && m_folder.fold(stmt_if->expr).has_value())) {
+            return false;
+        }
+
+        m_output << "    ;; if (cmov)\n";
+        if (else_expr != nullptr) {
+            gen_expr(else_expr);
+        }
+        else {
+            push("QWORD [rsp + " + std::to_string(slot_offset(var->stack_loc)) + "]");
+        }
+        gen_expr(then_assign->expr);
+        std::string_view cc = "nz";
+        if (const auto cmp = as_comparison(stmt_if->expr)) {
+            gen_compare(cmp->lhs, cmp->rhs);
+            cc = cmp->equal ? "e" : "ne";
+        }
+        else {
+            gen_expr_into("rax", stmt_if->expr);
+            m_output << "    test rax, rax\n";
+        }
+        pop("rbx");
+        pop("rcx");
+        m_output << "    cmov" << cc << " rcx, rbx\n";
+        m_output << "    mov [rsp + " << slot_offset(var->stack_loc) << "], rcx\n";
+        m_output << "    ;; /if (cmov)\n";
+        return true;
     }
 
-    std::string create_label()
+    // Lowers a ladder `if (x == 1) {..} elif (x == 2) {..} ... else {..}` that compares one scalar
+    // with dense constants to a single indexed jump through a table of arm offsets.
+    bool gen_if_jump_table(const NodeStmtIf* stmt_if)
     {
-        std::stringstream ss;
-        ss << "label" << m_label_count++;
-        return ss.str();
+        std::optional<std::string> name;
+        std::vector<std::pair<int64_t, const NodeScope*>> arms;
+        // Records an arm, or returns false if `cond` is not `name == constant`.
+        const auto add_arm = [&](const NodeExpr* cond, const NodeScope* scope) {
+            const auto cmp = as_comparison(cond);
+            if (!cmp.has_value() || !cmp->equal) {
+                return false;
+            }
+            const NodeExpr* ident = cmp->lhs;
+            std::optional<int64_t> value = const_int(cmp->rhs);
+            if (!value.has_value()) {
+                ident = cmp->rhs;
+                value = const_int(cmp->lhs);
+            }
+            if (!value.has_value() || !std::holds_alternative<NodeTerm*>(ident->var)
+                || !std::holds_alternative<NodeTermIdent*>(std::get<NodeTerm*>(ident->var)->var)) {
+                return false;
+            }
+            const std::string& ident_name
+                = std::get<NodeTermIdent*>(std::get<NodeTerm*>(ident->var)->var)->ident.value.value();
+            if (name.has_value() && name.value() != ident_name) {
+                return false;
+            }
+            name = ident_name;
+            arms.emplace_back(value.value(), scope);
+            return true;
+        };
+        if (!add_arm(stmt_if->expr, stmt_if->scope)) {
+            return false;
+        }
+        const NodeScope* default_scope = nullptr;
+        for (std::optional<NodeIfPred*> pred = stmt_if->pred; pred.has_value();) {
+            if (const auto* else_ = std::get_if<NodeIfPredElse*>(&pred.value()->var)) {
+                default_scope = (*else_)->scope;
+                break;
+            }
+            const NodeIfPredElif* elif = std::get<NodeIfPredElif*>(pred.value()->var);
+            if (!add_arm(elif->expr, elif->scope)) {
+                return false;
+            }
+            pred = elif->pred;
+        }
+        if (arms.size() < jump_table_min_arms) {
+            return false;
+        }
+        const Var* var = find_scalar(name.value());
+        const int64_t lo = std::ranges::min_element(arms)->first;
+        const __int128 span = __int128 { std::ranges::max_element(arms)->first } - lo + 1;
+        if (var == nullptr || span > jump_table_max_span || span > 2 * static_cast<__int128>(arms.size())) {
+            return false;
+        }
+
+        m_output << "    ;; if (jump table)\n";
+        const std::optional<size_t> first
+            = m_profile_layout ? std::optional(m_profile_layout->first_counter(stmt_if)) : std::nullopt;
+        gen_count(first);
+        const std::string table_label = create_label();
+        const std::string default_label = create_label();
+        const std::string end_label = create_label();
+        std::vector<std::string> arm_labels;
+        std::vector<std::string> targets(static_cast<size_t>(span), default_label);
+        for (const auto& [value, scope] : arms) {
+            arm_labels.push_back(create_label());
+            std::string& target = targets[static_cast<size_t>(value - lo)];
+            // The first arm testing a value is the one that runs.
+            if (target == default_label) {
+                target = arm_labels.back();
+            }
+        }
+        m_output << "    mov rax, QWORD [rsp + " << slot_offset(var->stack_loc) << "]\n";
+        if (lo >= INT32_MIN && lo <= INT32_MAX) {
+            if (lo != 0) {
+                m_output << "    sub rax, " << lo << "\n";
+            }
+        }
+        else {
+            m_output << "    mov rbx, " << lo << "\n";
+            m_output << "    sub rax, rbx\n";
+        }
+        m_output << "    cmp rax, " << static_cast<int64_t>(span) << "\n";
+        m_output << "    jae " << default_label << "\n";
+        m_output << "    lea rbx, [rel " << table_label << "]\n";
+        m_output << "    movsxd rax, DWORD [rbx + rax*4]\n";
+        m_output << "    add rax, rbx\n";
+        m_output << "    jmp rax\n";
+        m_output << "    align 4\n";
+        m_output << table_label << ":\n";
+        for (const std::string& target : targets) {
+            m_output << "    dd " << target << " - " << table_label << "\n";
+        }
+        for (size_t i = 0; i < arms.size(); i++) {
+            m_output << arm_labels[i] << ":\n";
+            gen_count(first.has_value() ? std::optional(first.value() + 1 + i) : std::nullopt);
+            gen_scope(arms[i].second);
+            m_output << "    jmp " << end_label << "\n";
+        }
+        m_output << default_label << ":\n";
+        if (default_scope != nullptr) {
+            gen_count(first.has_value() ? std::optional(first.value() + 1 + arms.size()) : std::nullopt);
+            gen_scope(default_scope);
+        }
+        m_output << end_label << ":\n";
+        m_output << "    ;; /if (jump table)\n";
+        return true;
     }
 
-    struct Var {
-        std::string name;
-        size_t stack_loc;
+    struct IfArm {
+        // Null for the else.
+        const NodeExpr* cond;
+        const NodeScope* scope;
+        // Counter of how often the arm is taken, when instrumenting or using a profile.
+        std::optional<size_t> counter {};
     };
 
+    // The arms of an if statement in source order.
+    std::vector<IfArm> if_arms(const NodeStmtIf* stmt_if) const
+    {
+        std::vector<IfArm> arms { { .cond = stmt_if->expr, .scope = stmt_if->scope } };
+        for (std::optional<NodeIfPred*> pred = stmt_if->pred; pred.has_value();) {
+            if (const auto* else_ = std::get_if<NodeIfPredElse*>(&pred.value()->var)) {
+                arms.push_back({ .cond = nullptr, .scope = (*else_)->scope });
+                break;
+            }
+            const NodeIfPredElif* elif = std::get<NodeIfPredElif*>(pred.value()->var);
+            arms.push_back({ .cond = elif->expr, .scope = elif->scope });
+            pred = elif->pred;
+        }
+        if (m_profile_layout) {
+            const size_t first = m_profile_layout->first_counter(stmt_if);
+            for (size_t i = 0; i < arms.size(); i++) {
+                arms[i].counter = first + 1 + i;
+            }
+        }
+        return arms;
+    }
+
+    // Whether at most one of the tests of `arms` (all but an else) can be true, so that testing
+    // them in any order takes the same arm. That holds for `e == constant` with the same side-effect
+    // free `e` and distinct constants.
+    static bool exclusive_tests(const std::vector<IfArm>& arms)
+    {
+        const NodeExpr* subject = nullptr;
+        std::unordered_set<int64_t> values;
+        for (const IfArm& arm : arms) {
+            if (arm.cond == nullptr) {
+                continue;
+            }
+            const auto cmp = as_comparison(arm.cond);
+            if (!cmp.has_value() || !cmp->equal) {
+                return false;
+            }
+            const NodeExpr* expr = cmp->lhs;
+            std::optional<int64_t> value = const_int(cmp->rhs);
+            if (!value.has_value()) {
+                expr = cmp->rhs;
+                value = const_int(cmp->lhs);
+            }
+            int budget = cmov_max_nodes;
+            if (!value.has_value() || !values.insert(value.value()).second || !is_speculatable(expr, budget)) {
+                return false;
+            }
+            if (subject == nullptr) {
+                subject = expr;
+            }
+            else if (expr != subject && !same_ident(expr, subject)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static bool same_ident(const NodeExpr* lhs, const NodeExpr* rhs)
+    {
+        const auto ident = [](const NodeExpr* expr) -> const NodeTermIdent* {
+            if (!std::holds_alternative<NodeTerm*>(expr->var)) {
+                return nullptr;
+            }
+            const auto* term_ident = std::get_if<NodeTermIdent*>(&std::get<NodeTerm*>(expr->var)->var);
+            return term_ident == nullptr ? nullptr : *term_ident;
+        };
+        return ident(lhs) != nullptr && ident(rhs) != nullptr
+            && ident(lhs)->ident.value.value() == ident(rhs)->ident.value.value();
+    }
+
+    // An arm is cold if it is taken less than once in this many runs of its if.
+    static constexpr uint64_t cold_arm_ratio = 16;
+
+    void gen_count(const std::optional<size_t> counter)
+    {
+        if (m_options.instrument && counter.has_value()) {
+            m_output << "    add QWORD [rel prof_counts + " << counter.value() * 8 << "], 1\n";
+        }
+    }
+
+    // An if statement as a chain of tests. With a profile, exclusive tests go hottest first, and
+    // cold arms are generated after the exits, so that the code of the likely path is contiguous
+    // and its branches fall through.
+    void gen_if(const NodeStmtIf* stmt_if)
+    {
+        m_output << "    ;; if\n";
+        std::vector<IfArm> arms = if_arms(stmt_if);
+        std::optional<uint64_t> runs;
+        if (m_profile_layout) {
+            gen_count(m_profile_layout->first_counter(stmt_if));
+            if (m_options.profile) {
+                runs = m_options.profile->count(m_profile_layout->first_counter(stmt_if));
+            }
+        }
+        const auto count = [&](const IfArm& arm) { return m_options.profile->count(arm.counter.value()); };
+        if (runs.value_or(0) != 0 && exclusive_tests(arms)) {
+            const auto tests_end = arms.back().cond == nullptr ? std::prev(arms.end()) : arms.end();
+            std::stable_sort(arms.begin(), tests_end, [&](const IfArm& lhs, const IfArm& rhs) {
+                return count(lhs) > count(rhs);
+            });
+        }
+        const std::string end_label = create_label();
+        for (size_t i = 0; i < arms.size(); i++) {
+            const IfArm& arm = arms[i];
+            if (arm.cond == nullptr) {
+                m_output << "    ;; else\n";
+                gen_count(arm.counter);
+                gen_scope(arm.scope);
+                break;
+            }
+            if (i > 0) {
+                m_output << "    ;; elif\n";
+                // Only reached when the earlier tests are false.
+                m_conditional++;
+            }
+            const bool last = i + 1 == arms.size();
+            // A cold arm is entered by a taken branch, and the test of the next arm falls through.
+            const bool cold = runs.value_or(0) != 0 && count(arm) * cold_arm_ratio < runs.value();
+            const std::string label = cold || !last ? create_label() : end_label;
+            gen_jump_if(arm.cond, cold, label);
+            if (i > 0) {
+                m_conditional--;
+            }
+            if (cold) {
+                std::stringstream hot;
+                std::swap(m_output, hot);
+                m_output << label << ":\n";
+                gen_count(arm.counter);
+                gen_scope(arm.scope);
+                m_output << "    jmp " << end_label << "\n";
+                std::swap(m_output, hot);
+                m_cold += hot.str();
+                continue;
+            }
+            gen_count(arm.counter);
+            gen_scope(arm.scope);
+            if (!last) {
+                m_output << "    jmp " << end_label << "\n";
+                m_output << label << ":\n";
+            }
+        }
+        m_output << end_label << ":\n";
+        m_output << "    ;; /if\n";
+    }
+
+    void gen_stmt(const NodeStmt* stmt)
+    {
+        if (m_options.share_exprs) {
+            reserve_shared(stmt);
+        }
+        struct StmtVisitor {
+            Generator& gen;
+
+            void operator()(const NodeStmtExit* stmt_exit) const
+            {
+                gen.m_output << "    ;; exit\n";
+                gen.gen_expr_into("rdi", stmt_exit->expr);
+                gen.gen_exit(gen.m_output);
+                gen.m_output << "    ;; /exit\n";
+            }
+
+            void operator()(const NodeStmtLet* stmt_let) const
+            {
+                gen.m_output << "    ;; let\n";
+                if (gen.find_var(stmt_let->ident.value.value()) != nullptr) {
+                    throw CompileError("Identifier already used: " + stmt_let->ident.value.value());
+                }
+                Var var { .name = stmt_let->ident.value.value(), .stack_loc = 0 };
+                switch (gen.store_fate(stmt_let)) {
+                case StoreFate::keep:
+                    gen.gen_expr(stmt_let->expr);
+                    break;
+                case StoreFate::drop:
+                    var.elided = true;
+                    break;
+                case StoreFate::effects_only:
+                    gen.gen_expr_into("rax", stmt_let->expr);
+                    var.elided = true;
+                    break;
+                case StoreFate::no_init:
+                    gen.m_output << "    sub rsp, 8\n";
+                    gen.grow_stack(1);
+                    break;
+                }
+                // Declared after its initializer, which therefore cannot refer to it.
+                var.stack_loc = gen.m_stack_size - (var.elided ? 0 : 1);
+                gen.declare(std::move(var));
+                gen.m_output << "    ;; /let\n";
+            }
+
+            void operator()(const NodeStmtLetArray* stmt_let_array) const
+            {
+                gen.m_output << "    ;; let array\n";
+                const std::string& name = stmt_let_array->ident.value.value();
+                if (gen.find_var(name) != nullptr) {
+                    throw CompileError("Identifier already used: " + name);
+                }
+                const std::string& size_str = stmt_let_array->size.value.value();
+                size_t len = 0;
+                if (const auto [ptr, ec] = std::from_chars(size_str.data(), size_str.data() + size_str.size(), len);
+                    ec != std::errc {} || len == 0 || len > max_array_len) {
+                    throw CompileError("Invalid array size: " + size_str);
+                }
+                Var var { .name = name, .stack_loc = gen.m_stack_size, .array_len = len };
+                if (stmt_let_array->is_static) {
+                    var.static_label = gen.create_label();
+                    gen.m_statics.emplace_back(var.static_label.value(), len);
+                }
+                else if (len <= 16) {
+                    gen_load_imm(gen.m_output, "rax", 0);
+                    for (size_t i = 0; i < len; i++) {
+                        gen.push("rax");
+                    }
+                }
+                else {
+                    gen.m_output << "    sub rsp, " << len * 8 << "\n";
+                    gen.m_output << "    mov rdi, rsp\n";
+                    gen.m_output << "    mov rcx, " << len << "\n";
+                    gen_load_imm(gen.m_output, "rax", 0);
+                    gen.m_output << "    rep stosq\n";
+                    gen.grow_stack(len);
+                }
+                gen.declare(std::move(var));
+                gen.m_output << "    ;; /let array\n";
+            }
+
+            void operator()(const NodeStmtAssign* stmt_assign) const
+            {
+                const Var* it = gen.find_var(stmt_assign->ident.value.value());
+                if (it == nullptr) {
+                    throw CompileError("Undeclared identifier: " + stmt_assign->ident.value.value());
+                }
+                if (it->array_len.has_value()) {
+                    gen.gen_elementwise(*it, stmt_assign->expr);
+                    return;
+                }
+                switch (gen.store_fate(stmt_assign)) {
+                case StoreFate::drop:
+                case StoreFate::no_init:
+                    return;
+                case StoreFate::effects_only:
+                    gen.gen_expr_into("rax", stmt_assign->expr);
+                    return;
+                case StoreFate::keep:
+                    break;
+                }
+                assert(!it->elided);
+                gen.gen_expr_into("rax", stmt_assign->expr);
+                gen.m_output << "    mov [rsp + " << (gen.m_stack_size - it->stack_loc - 1) * 8 << "], rax\n";
+            }
+
+            void operator()(const NodeStmtAssignIndex* stmt_assign_index) const
+            {
+                const Var& var = gen.lookup_array(stmt_assign_index->ident);
+                gen.gen_expr(stmt_assign_index->expr);
+                const std::optional<int64_t> index = gen.gen_elem_index(var, stmt_assign_index->index);
+                gen.pop("rbx");
+                const std::string addr = gen.elem_addr(var, index);
+                gen.m_output << "    mov " << addr << ", rbx\n";
+            }
+
+            void operator()(const NodeScope* scope) const
+            {
+                gen.m_output << "    ;; scope\n";
+                gen.gen_scope(scope);
+                gen.m_output << "    ;; /scope\n";
+            }
+
+            void operator()(const NodeStmtIf* stmt_if) const
+            {
+                if (gen.m_options.lower_ifs && (gen.gen_if_cmov(stmt_if) || gen.gen_if_jump_table(stmt_if))) {
+                    return;
+                }
+                gen.gen_if(stmt_if);
+            }
+        };
+
+        StmtVisitor visitor { .gen = *this };
+        std::visit(visitor, stmt->var);
+    }
+
+    [[nodiscard]] std::string gen_prog()
+    {
+        std::optional<int64_t> exit_value;
+        // An instrumented program has to run its branches to count them.
+        if (m_options.eval_budget != 0 && !m_options.instrument) {
+            Evaluator evaluator(m_options.eval_budget);
+            if (const auto [outcome, value] = evaluator.run(m_prog); outcome == Evaluator::Outcome::exited) {
+                exit_value = value;
+            }
+        }
+
+        if (m_options.eliminate_dead_stores) {
+            m_liveness = std::make_shared<const Liveness>(m_prog);
+        }
+        if (m_options.instrument || m_options.profile) {
+            m_profile_layout = std::make_shared<ProfileLayout>();
+            for (const NodeStmt* stmt : m_prog.stmts) {
+                m_profile_layout->add(stmt);
+            }
+            if (m_options.profile) {
+                m_options.profile->check(*m_profile_layout);
+            }
+        }
+
+        gen_entry(m_output);
+
+        // Top-level scopes and ifs leave the variables and the stack as they found them, so each is
+        // generated as a separate unit, in parallel, from a snapshot of the state before it. Units
+        // have their own label namespace, which keeps the stitched output independent of scheduling.
+        // A statement only becomes a unit if it holds at least as many statements as the snapshot has
+        // entries, so that snapshots cost no more than the program, however many variables it has.
+        std::vector<std::string> pieces;
+        std::vector<std::unique_ptr<Generator>> units;
+        std::vector<const NodeStmt*> unit_stmts;
+        for (const NodeStmt* stmt : m_prog.stmts) {
+            const size_t snapshot_size = m_vars.size() + m_shared_slots.size();
+            if ((std::holds_alternative<NodeScope*>(stmt->var) || std::holds_alternative<NodeStmtIf*>(stmt->var))
+                && count_stmts(stmt, snapshot_size) >= snapshot_size) {
+                pieces.push_back(m_output.str());
+                m_output.str("");
+                units.push_back(std::unique_ptr<Generator>(new Generator(*this, units.size())));
+                unit_stmts.push_back(stmt);
+                continue;
+            }
+            gen_stmt(stmt);
+        }
+        parallel_for(units.size(), worker_count(m_options.threads), [&](const size_t i) {
+            units[i]->gen_stmt(unit_stmts[i]);
+        });
+        pieces.push_back(m_output.str());
+        m_output.str("");
+        for (size_t i = 0; i < pieces.size(); i++) {
+            m_output << pieces[i];
+            if (i < units.size()) {
+                m_output << units[i]->m_output.str();
+                m_cold += units[i]->m_cold;
+                m_statics.insert(m_statics.end(), units[i]->m_statics.begin(), units[i]->m_statics.end());
+                m_bounds_checked |= units[i]->m_bounds_checked;
+                m_max_stack_size = std::max(m_max_stack_size, units[i]->m_max_stack_size);
+            }
+        }
+
+        gen_epilogue();
+
+        // The program was still generated in full above so that it is checked for errors.
+        if (exit_value.has_value()) {
+            std::stringstream output;
+            gen_entry(output);
+            gen_load_imm(output, "rdi", exit_value.value());
+            gen_exit(output);
+            return output.str();
+        }
+        return m_output.str();
+    }
+
+    // Most 8-byte stack slots in use at any point of the generated program.
+    [[nodiscard]] size_t max_stack_slots() const
+    {
+        return m_max_stack_size;
+    }
+
+    // Streaming alternative to gen_prog: top-level statements are generated one at a time as they
+    // are parsed, and finished assembly is written to `out` right away, so the caller may free each
+    // statement once it has been passed in. The whole-program evaluation and parallel units of
+    // gen_prog need the complete program and are not used.
+    void begin_stream(std::ostream& out)
+    {
+        m_stream = &out;
+        if (m_options.instrument || m_options.profile) {
+            m_profile_layout = std::make_shared<ProfileLayout>();
+        }
+        gen_entry(m_output);
+        flush_stream();
+    }
+
+    void stream_stmt(const NodeStmt* stmt)
+    {
+        if (m_profile_layout) {
+            m_profile_layout->add(stmt);
+        }
+        gen_stmt(stmt);
+        m_folder.forget_folds();
+        flush_stream();
+    }
+
+    void end_stream()
+    {
+        if (m_options.profile) {
+            m_options.profile->check(*m_profile_layout);
+        }
+        gen_epilogue();
+        flush_stream();
+    }
+
+private:
+    void flush_stream()
+    {
+        *m_stream << m_output.str();
+        m_output.str("");
+        m_output.clear();
+    }
+
+    // Final exit, shared exit paths and the bss section.
+    void gen_epilogue()
+    {
+        gen_load_imm(m_output, "rdi", 0);
+        gen_exit(m_output);
+        if (m_bounds_checked) {
+            m_output << "bounds_fail:\n";
+            m_output << "    mov rdi, " << bounds_fail_code << "\n";
+            gen_exit(m_output);
+        }
+        m_output << m_cold;
+        if (m_options.instrument) {
+            gen_profile_exit();
+        }
+        if (!m_statics.empty()) {
+            m_output << "section .bss\n";
+            for (const auto& [label, len] : m_statics) {
+                m_output << label << ": resq " << len << "\n";
+            }
+        }
+    }
+
+    // Statements in `stmt`, including those of the scopes it holds, or `limit` once there are that many.
+    static size_t count_stmts(const NodeStmt* stmt, const size_t limit) // NOLINT(*-no-recursion)
+    {
+        size_t count = 1;
+        const auto add_scope = [&](const NodeScope* scope) {
+            for (auto it = scope->stmts.begin(); it != scope->stmts.end() && count < limit; ++it) {
+                count += count_stmts(*it, limit - count);
+            }
+        };
+        if (std::holds_alternative<NodeScope*>(stmt->var)) {
+            add_scope(std::get<NodeScope*>(stmt->var));
+        }
+        else if (std::holds_alternative<NodeStmtIf*>(stmt->var)) {
+            const NodeStmtIf* stmt_if = std::get<NodeStmtIf*>(stmt->var);
+            add_scope(stmt_if->scope);
+            for (std::optional<NodeIfPred*> pred = stmt_if->pred; pred.has_value() && count < limit;) {
+                if (const auto* else_ = std::get_if<NodeIfPredElse*>(&pred.value()->var)) {
+                    add_scope((*else_)->scope);
+                    break;
+                }
+                const NodeIfPredElif* elif = std::get<NodeIfPredElif*>(pred.value()->var);
+                add_scope(elif->scope);
+                pred = elif->pred;
+            }
+        }
+        return std::min(count, limit);
+    }
+
+    // A unit generator for one top-level statement, starting from the parent's current state.
+    Generator(const Generator& parent, const size_t unit)
+        : m_prog()
+        , m_options(parent.m_options)
+        , m_stack_size(parent.m_stack_size)
+        , m_vars(parent.m_vars)
+        , m_var_index(parent.m_var_index)
+        , m_scopes(parent.m_scopes)
+        , m_shared_slots(parent.m_shared_slots)
+        , m_shared_order(parent.m_shared_order)
+        , m_shared_fills(parent.m_shared_fills)
+        , m_label_prefix("label" + std::to_string(unit) + "_")
+        , m_folder(0)
+        , m_liveness(parent.m_liveness)
+        , m_profile_layout(parent.m_profile_layout)
+    {
+    }
+
+    // Callee-saved registers preserved by `jit_entry`. r15 holds the caller's stack pointer.
+    static constexpr std::string_view jit_saved_regs[] = { "rbx", "rbp", "r12", "r13", "r14", "r15" };
+
+    void gen_entry(std::stringstream& output) const
+    {
+        if (m_options.jit) {
+            output << "global jit_entry\njit_entry:\n";
+            for (const std::string_view reg : jit_saved_regs) {
+                output << "    push " << reg << "\n";
+            }
+            output << "    mov r15, rsp\n";
+            output << "    mov rsp, rdi\n";
+            output << "    jmp _start\n";
+            output << "jit_exit:\n";
+            output << "    mov rax, rdi\n";
+            output << "    mov rsp, r15\n";
+            for (auto reg = std::rbegin(jit_saved_regs); reg != std::rend(jit_saved_regs); ++reg) {
+                output << "    pop " << *reg << "\n";
+            }
+            output << "    ret\n";
+        }
+        else {
+            output << "global _start\n";
+        }
+        output << "_start:\n";
+        if (has_bmi2()) {
+            output << "    mov " << sign_shift_reg << "d, 63\n";
+        }
+    }
+
+    // Terminates the program with the exit code in rdi.
+    void gen_exit(std::stringstream& output) const
+    {
+        if (m_options.jit) {
+            output << "    jmp jit_exit\n";
+            return;
+        }
+        if (m_options.instrument) {
+            output << "    jmp prof_exit\n";
+            return;
+        }
+        output << "    mov rax, 60\n";
+        output << "    syscall\n";
+    }
+
+    // Writes the branch counters to `profile_path`, then exits with the code in rdi. The exit code
+    // is the same if the file cannot be written.
+    void gen_profile_exit()
+    {
+        const std::string done_label = create_label();
+        const size_t counters = m_profile_layout->size();
+        m_output << "prof_exit:\n";
+        m_output << "    mov r12, rdi\n";
+        m_output << "    mov rax, 2\n"; // open
+        m_output << "    lea rdi, [rel prof_path]\n";
+        m_output << "    mov rsi, " << (O_WRONLY | O_CREAT | O_TRUNC) << "\n";
+        m_output << "    mov rdx, " << 0644 << "\n";
+        m_output << "    syscall\n";
+        m_output << "    test rax, rax\n";
+        m_output << "    js " << done_label << "\n";
+        m_output << "    mov r13, rax\n";
+        m_output << "    mov rdi, rax\n";
+        m_output << "    mov rax, 1\n"; // write
+        m_output << "    lea rsi, [rel prof_data]\n";
+        m_output << "    mov rdx, " << profile_magic.size() + (1 + counters) * 8 << "\n";
+        m_output << "    syscall\n";
+        m_output << "    mov rax, 3\n"; // close
+        m_output << "    mov rdi, r13\n";
+        m_output << "    syscall\n";
+        m_output << done_label << ":\n";
+        m_output << "    mov rdi, r12\n";
+        m_output << "    mov rax, 60\n";
+        m_output << "    syscall\n";
+        m_output << "section .data\n";
+        m_output << "prof_path: db \"" << profile_path << "\", 0\n";
+        m_output << "prof_data: db \"" << profile_magic << "\"\n";
+        m_output << "    dq " << counters << "\n";
+        m_output << "prof_counts:\n";
+        for (size_t i = 0; i < counters; i += 16) {
+            m_output << "    dq 0";
+            for (size_t j = i + 1; j < std::min(i + 16, counters); j++) {
+                m_output << ", 0";
+            }
+            m_output << "\n";
+        }
+    }
+
+    struct Var {
+        std::string name;
+        size_t stack_loc;
+        std::optional<size_t> array_len {};
+        std::optional<std::string> static_label {};
+        // An unused scalar that has no stack slot.
+        bool elided = false;
+
+        [[nodiscard]] size_t slots() const
+        {
+            if (static_label.has_value() || elided) {
+                return 0;
+            }
+            return array_len.value_or(1);
+        }
+    };
+
+    // State of the scalar loop of an element-wise array assignment.
+    struct Lane {
+        size_t counter_loc {};
+        // Scalar operands, evaluated once before the loop, and the stack slot holding each.
+        std::unordered_map<const NodeExpr*, size_t> scalars {};
+        // Vector registers each vectorizable operand needs. See `vec_regs`.
+        std::unordered_map<const NodeExpr*, int> regs {};
+    };
+
+    struct Range {
+        int64_t lo;
+        int64_t hi;
+    };
+
+    // Hidden stack slot of a shared expression, and whether it holds the value yet.
+    struct SharedSlot {
+        size_t stack_loc;
+        bool ready = false;
+    };
+
+    static constexpr size_t max_array_len = Evaluator::max_array_len;
+    static constexpr int64_t bounds_fail_code = Evaluator::bounds_fail_code;
+
+    // Value of an expression that is an integer literal, possibly negated or parenthesized. Only
+    // `const_int_max_wrappers` negations and parentheses are looked through, so that asking at every
+    // level of a deeply wrapped literal stays linear; folding still finds the deeper ones.
+    static std::optional<int64_t> const_int(const NodeExpr* expr)
+    {
+        if (!std::holds_alternative<NodeTerm*>(expr->var)) {
+            return {};
+        }
+        const NodeTerm* term = std::get<NodeTerm*>(expr->var);
+        bool negate = false;
+        for (int wrappers = 0; !std::holds_alternative<NodeTermIntLit*>(term->var); wrappers++) {
+            if (wrappers == const_int_max_wrappers) {
+                return {};
+            }
+            if (std::holds_alternative<NodeTermNeg*>(term->var)) {
+                negate = !negate;
+                term = std::get<NodeTermNeg*>(term->var)->term;
+                continue;
+            }
+            if (!std::holds_alternative<NodeTermParen*>(term->var)) {
+                return {};
+            }
+            const NodeExpr* inner = std::get<NodeTermParen*>(term->var)->expr;
+            if (!std::holds_alternative<NodeTerm*>(inner->var)) {
+                return {};
+            }
+            term = std::get<NodeTerm*>(inner->var);
+        }
+        std::optional<int64_t> value = Evaluator::parse_int_lit(std::get<NodeTermIntLit*>(term->var)->int_lit);
+        if (value.has_value() && negate) {
+            value = static_cast<int64_t>(uint64_t { 0 } - static_cast<uint64_t>(value.value()));
+        }
+        return value;
+    }
+
+    // Signed division or remainder, leaving the result in rax. Constant divisors are lowered to
+    // shifts or a multiply-high sequence instead of `idiv`. Where both operands are provably
+    // non-negative, signed and unsigned division agree and the cheaper unsigned forms are used.
+    void gen_div(const NodeExpr* lhs, const NodeExpr* rhs, const bool remainder)
+    {
+        const std::optional<Range> lhs_range = value_range(lhs);
+        const bool unsigned_lhs = lhs_range.has_value() && lhs_range->lo >= 0;
+        if (const auto divisor = const_int(rhs); divisor.has_value() && divisor.value() != 0) {
+            gen_expr_into("rax", lhs);
+            if (unsigned_lhs && divisor.value() > 0) {
+                gen_udiv_const(divisor.value(), remainder);
+            }
+            else {
+                gen_div_const(divisor.value(), remainder);
+            }
+            return;
+        }
+        if (const Operand operand = gen_operands(lhs, rhs); operand.text != "rbx") {
+            load_operand("rbx", operand);
+        }
+        if (const std::optional<Range> rhs_range = value_range(rhs);
+            unsigned_lhs && rhs_range.has_value() && rhs_range->lo >= 0) {
+            gen_load_imm(m_output, "rdx", 0);
+            m_output << "    div rbx\n";
+        }
+        else {
+            // INT64_MIN / -1 would trap in idiv; it wraps instead.
+            const std::string idiv_label = create_label();
+            const std::string end_label = create_label();
+            m_output << "    cmp rbx, -1\n";
+            m_output << "    jne " << idiv_label << "\n";
+            m_output << "    neg rax\n";
+            gen_load_imm(m_output, "rdx", 0);
+            m_output << "    jmp " << end_label << "\n";
+            m_output << idiv_label << ":\n";
+            m_output << "    cqo\n";
+            m_output << "    idiv rbx\n";
+            m_output << end_label << ":\n";
+        }
+        if (remainder) {
+            m_output << "    mov rax, rdx\n";
+        }
+    }
+
+    // Whether BMI2 may be used. Its shifts take the count from a register, so `sign_shift_reg`
+    // holds 63 from the entry on, which lets shrx and sarx take the sign of a value into another
+    // register without copying it first.
+    [[nodiscard]] bool has_bmi2() const
+    {
+        return m_options.march >= MarchLevel::x86_64_v3;
+    }
+
+    static constexpr std::string_view sign_shift_reg = "r8";
+
+    // Divides rax by a non-zero constant, leaving the quotient (or remainder) in rax.
+    void gen_div_const(const int64_t divisor, const bool remainder)
+    {
+        if (divisor == 1 || divisor == -1) {
+            if (remainder) {
+                gen_load_imm(m_output, "rax", 0);
+            }
+            else if (divisor == -1) {
+                m_output << "    neg rax\n";
+            }
+            return;
+        }
+        const uint64_t abs_divisor
+            = divisor < 0 ? uint64_t { 0 } - static_cast<uint64_t>(divisor) : static_cast<uint64_t>(divisor);
+        if (std::has_single_bit(abs_divisor) && has_bmi2()) {
+            gen_div_pow2_bmi2(divisor, std::countr_zero(abs_divisor), remainder);
+            return;
+        }
+        m_output << "    mov rcx, rax\n";
+        if (std::has_single_bit(abs_divisor)) {
+            const int k = std::countr_zero(abs_divisor);
+            if (k > 1) {
+                m_output << "    sar rax, 63\n";
+            }
+            m_output << "    shr rax, " << 64 - k << "\n";
+            m_output << "    add rax, rcx\n";
+            m_output << "    sar rax, " << k << "\n";
+            if (divisor < 0) {
+                m_output << "    neg rax\n";
+            }
+        }
+        else {
+            const auto [multiplier, shift] = signed_div_magic(divisor);
+            m_output << "    mov rdx, " << multiplier << "\n";
+            m_output << "    imul rdx\n";
+            if (divisor > 0 && multiplier < 0) {
+                m_output << "    add rdx, rcx\n";
+            }
+            else if (divisor < 0 && multiplier > 0) {
+                m_output << "    sub rdx, rcx\n";
+            }
+            if (shift > 0) {
+                m_output << "    sar rdx, " << shift << "\n";
+            }
+            // Rounds towards zero by adding the sign bit.
+            if (has_bmi2()) {
+                m_output << "    shrx rax, rdx, " << sign_shift_reg << "\n";
+            }
+            else {
+                m_output << "    mov rax, rdx\n";
+                m_output << "    shr rax, 63\n";
+            }
+            m_output << "    add rax, rdx\n";
+        }
+        if (remainder) {
+            gen_imul_const("rax", divisor);
+            m_output << "    sub rcx, rax\n";
+            m_output << "    mov rax, rcx\n";
+        }
+    }
+
+    // gen_div_const for a divisor of +-2^k with BMI2. The dividend stays in rax while the rounding
+    // bias, 2^k - 1 for a negative dividend and 0 otherwise, is computed in rdx, so the remainder
+    // needs no multiplication: it is the dividend minus the biased dividend rounded down to a
+    // multiple of 2^k, whatever the sign of the divisor.
+    void gen_div_pow2_bmi2(const int64_t divisor, const int k, const bool remainder)
+    {
+        if (k == 1) {
+            m_output << "    shrx rdx, rax, " << sign_shift_reg << "\n";
+        }
+        else {
+            m_output << "    sarx rdx, rax, " << sign_shift_reg << "\n";
+            m_output << "    shr rdx, " << 64 - k << "\n";
+        }
+        if (!remainder) {
+            m_output << "    add rax, rdx\n";
+            m_output << "    sar rax, " << k << "\n";
+            if (divisor < 0) {
+                m_output << "    neg rax\n";
+            }
+            return;
+        }
+        m_output << "    lea rcx, [rax + rdx]\n";
+        if (k < 32) {
+            m_output << "    and rcx, " << -(int64_t { 1 } << k) << "\n";
+        }
+        else {
+            m_output << "    sar rcx, " << k << "\n";
+            m_output << "    shl rcx, " << k << "\n";
+        }
+        m_output << "    sub rax, rcx\n";
+    }
+
+    // Divides rax, known to be non-negative, by a positive constant, leaving the quotient (or
+    // remainder) in rax.
+    void gen_udiv_const(const int64_t divisor, const bool remainder)
+    {
+        if (std::has_single_bit(static_cast<uint64_t>(divisor))) {
+            const int k = std::countr_zero(static_cast<uint64_t>(divisor));
+            if (remainder) {
+                if (divisor - 1 <= INT32_MAX) {
+                    m_output << "    and rax, " << divisor - 1 << "\n";
+                }
+                else {
+                    m_output << "    mov rdx, " << divisor - 1 << "\n";
+                    m_output << "    and rax, rdx\n";
+                }
+            }
+            else if (k > 0) {
+                m_output << "    shr rax, " << k << "\n";
+            }
+            return;
+        }
+        const auto [multiplier, shift] = unsigned_div_magic(divisor);
+        if (has_bmi2()) {
+            // mulx writes the high half of the product to any register and leaves rax alone, so
+            // the quotient of a remainder is computed next to the dividend.
+            const std::string quotient = remainder ? "rcx" : "rax";
+            m_output << "    mov rdx, " << multiplier << "\n";
+            m_output << "    mulx " << quotient << ", rdx, rax\n";
+            if (shift > 0) {
+                m_output << "    shr " << quotient << ", " << shift << "\n";
+            }
+            if (remainder) {
+                gen_imul_const("rcx", divisor);
+                m_output << "    sub rax, rcx\n";
+            }
+            return;
+        }
+        if (remainder) {
+            m_output << "    mov rcx, rax\n";
+        }
+        m_output << "    mov rdx, " << multiplier << "\n";
+        m_output << "    mul rdx\n";
+        if (shift > 0) {
+            m_output << "    shr rdx, " << shift << "\n";
+        }
+        m_output << "    mov rax, rdx\n";
+        if (remainder) {
+            gen_imul_const("rax", divisor);
+            m_output << "    sub rcx, rax\n";
+            m_output << "    mov rax, rcx\n";
+        }
+    }
+
+    // Multiplies `reg` by `value`, through rdx if it does not fit an imm32.
+    void gen_imul_const(const std::string& reg, const int64_t value)
+    {
+        if (value >= INT32_MIN && value <= INT32_MAX) {
+            m_output << "    imul " << reg << ", " << reg << ", " << value << "\n";
+        }
+        else {
+            m_output << "    mov rdx, " << value << "\n";
+            m_output << "    imul " << reg << ", rdx\n";
+        }
+    }
+
+    [[nodiscard]] size_t slot_offset(const size_t stack_loc) const
+    {
+        return (m_stack_size - stack_loc - 1) * 8;
+    }
+
+    // The variable in scope named `name`, if any.
+    const Var* find_var(const std::string& name) const
+    {
+        const auto it = m_var_index.find(name);
+        return it == m_var_index.end() ? nullptr : &m_vars[it->second];
+    }
+
+    void declare(Var var)
+    {
+        m_var_index.emplace(var.name, m_vars.size());
+        m_vars.push_back(std::move(var));
+    }
+
+    // The scalar variable `name` if it is declared and has a stack slot.
+    const Var* find_scalar(const std::string& name) const
+    {
+        const Var* it = find_var(name);
+        if (it == nullptr || it->array_len.has_value() || it->elided) {
+            return nullptr;
+        }
+        return it;
+    }
+
+    const Var& lookup_array(const Token& ident) const
+    {
+        const Var* it = find_var(ident.value.value());
+        if (it == nullptr) {
+            throw CompileError("Undeclared identifier: " + ident.value.value());
+        }
+        if (!it->array_len.has_value()) {
+            throw CompileError("Not an array: " + ident.value.value());
+        }
+        return *it;
+    }
+
+    static std::optional<Range> make_range(const __int128 lo, const __int128 hi)
+    {
+        if (lo < INT64_MIN || hi > INT64_MAX) {
+            return {};
+        }
+        return Range { .lo = static_cast<int64_t>(lo), .hi = static_cast<int64_t>(hi) };
+    }
+
+    // Conservative range of values an expression can take, if it is known at compile time. Only
+    // the first `range_max_nodes` nodes are looked at, so that asking at every level of a long
+    // chain stays linear.
+    static std::optional<Range> value_range(const NodeExpr* expr)
+    {
+        int budget = range_max_nodes;
+        return value_range(expr, budget);
+    }
+
+    static std::optional<Range> value_range(const NodeExpr* expr, int& budget) // NOLINT(*-no-recursion)
+    {
+        if (--budget < 0) {
+            return {};
+        }
+        if (const auto value = const_int(expr)) {
+            return Range { .lo = value.value(), .hi = value.value() };
+        }
+        if (std::holds_alternative<NodeTerm*>(expr->var)) {
+            const NodeTerm* term = std::get<NodeTerm*>(expr->var);
+            if (std::holds_alternative<NodeTermParen*>(term->var)) {
+                return value_range(std::get<NodeTermParen*>(term->var)->expr, budget);
+            }
+            return {};
+        }
+
+        struct RangeVisitor {
+            int& budget;
+
+            std::optional<Range> operator()(const NodeBinExprAdd* add) const
+            {
+                const auto lhs = value_range(add->lhs, budget);
+                const auto rhs = value_range(add->rhs, budget);
+                if (!lhs.has_value() || !rhs.has_value()) {
+                    return {};
+                }
+                return make_range(__int128 { lhs->lo } + rhs->lo, __int128 { lhs->hi } + rhs->hi);
+            }
+
+            std::optional<Range> operator()(const NodeBinExprSub* sub) const
+            {
+                const auto lhs = value_range(sub->lhs, budget);
+                const auto rhs = value_range(sub->rhs, budget);
+                if (!lhs.has_value() || !rhs.has_value()) {
+                    return {};
+                }
+                return make_range(__int128 { lhs->lo } - rhs->hi, __int128 { lhs->hi } - rhs->lo);
+            }
+
+            std::optional<Range> operator()(const NodeBinExprMulti* multi) const
+            {
+                const auto lhs = value_range(multi->lhs, budget);
+                const auto rhs = value_range(multi->rhs, budget);
+                if (!lhs.has_value() || !rhs.has_value()) {
+                    return {};
+                }
+                const __int128 products[] = { __int128 { lhs->lo } * rhs->lo,
+                                              __int128 { lhs->lo } * rhs->hi,
+                                              __int128 { lhs->hi } * rhs->lo,
+                                              __int128 { lhs->hi } * rhs->hi };
+                return make_range(std::ranges::min(products), std::ranges::max(products));
+            }
+
+            std::optional<Range> operator()(const NodeBinExprDiv* div) const
+            {
+                const auto lhs = value_range(div->lhs, budget);
+                const auto divisor = const_int(div->rhs);
+                if (!lhs.has_value() || !divisor.has_value() || divisor.value() == 0) {
+                    return {};
+                }
+                const __int128 a = __int128 { lhs->lo } / divisor.value();
+                const __int128 b = __int128 { lhs->hi } / divisor.value();
+                return make_range(std::min(a, b), std::max(a, b));
+            }
+
+            std::optional<Range> operator()(const NodeBinExprMod* mod) const
+            {
+                const auto divisor = const_int(mod->rhs);
+                if (!divisor.has_value() || divisor.value() == 0) {
+                    return {};
+                }
+                const __int128 bound = (divisor.value() < 0 ? -__int128 { divisor.value() } : divisor.value()) - 1;
+                const auto lhs = value_range(mod->lhs, budget);
+                // The remainder takes the sign of the dividend.
+                __int128 lo = -bound;
+                __int128 hi = bound;
+                if (lhs.has_value()) {
+                    lo = lhs->lo >= 0 ? 0 : std::max(lo, __int128 { lhs->lo });
+                    hi = lhs->hi <= 0 ? 0 : std::min(hi, __int128 { lhs->hi });
+                }
+                return make_range(lo, hi);
+            }
+
+            std::optional<Range> operator()(const NodeBinExprEq*) const
+            {
+                return Range { .lo = 0, .hi = 1 };
+            }
+
+            std::optional<Range> operator()(const NodeBinExprNe*) const
+            {
+                return Range { .lo = 0, .hi = 1 };
+            }
+        };
+
+        return std::visit(RangeVisitor { budget }, std::get<NodeBinExpr*>(expr->var)->var);
+    }
+
+    // Evaluates an array index. A compile-time constant index is returned; otherwise the index is
+    // left in rax, bounds checked unless its range is provably within the array.
+    std::optional<int64_t> gen_elem_index(const Var& var, const NodeExpr* index)
+    {
+        const auto len = static_cast<int64_t>(var.array_len.value());
+        const std::optional<Range> range = value_range(index);
+        if (range.has_value() && range->lo == range->hi) {
+            if (range->lo < 0 || range->lo >= len) {
+                throw CompileError("Array index out of bounds: " + var.name + "[" + std::to_string(range->lo) + "]");
+            }
+            // `x % 1` is always 0, but computing `x` may still divide by zero or index out of bounds.
+            if (!const_int(index).has_value()) {
+                gen_expr_into("rax", index);
+            }
+            return range->lo;
+        }
+        gen_expr_into("rax", index);
+        if (!range.has_value() || range->lo < 0 || range->hi >= len) {
+            m_output << "    cmp rax, " << len << "\n";
+            m_output << "    jae bounds_fail\n";
+            m_bounds_checked = true;
+        }
+        return {};
+    }
+
+    // Memory operand of an array element. A non-constant index is taken from rax.
+    std::string elem_addr(const Var& var, const std::optional<int64_t> index)
+    {
+        std::stringstream addr;
+        if (var.static_label.has_value()) {
+            if (index.has_value()) {
+                addr << "[rel " << var.static_label.value() << " + " << index.value() * 8 << "]";
+            }
+            else {
+                m_output << "    lea rdx, [rel " << var.static_label.value() << "]\n";
+                addr << "[rdx + rax*8]";
+            }
+            return addr.str();
+        }
+        const size_t base = slot_offset(var.stack_loc + var.array_len.value() - 1);
+        if (index.has_value()) {
+            addr << "[rsp + " << base + static_cast<size_t>(index.value()) * 8 << "]";
+        }
+        else {
+            addr << "[rsp + " << base << " + rax*8]";
+        }
+        return addr.str();
+    }
+
+    // Evaluates each maximal scalar subexpression of an element-wise expression onto the stack.
+    void hoist_scalars(const NodeExpr* expr, Lane& lane, const size_t len)
+    {
+        const auto is_array = [&](const Token& ident) {
+            const Var* it = find_var(ident.value.value());
+            if (it == nullptr || !it->array_len.has_value()) {
+                return false;
+            }
+            if (it->array_len.value() != len) {
+                throw CompileError("Array length mismatch: " + ident.value.value());
+            }
+            return true;
+        };
+        for_each_scalar(expr, is_array, [&](const NodeExpr* scalar) {
+            gen_expr(scalar);
+            lane.scalars.emplace(scalar, m_stack_size - 1);
+        });
+    }
+
+    // Number of vector registers needed to evaluate an element-wise expression, if it can be vectorized.
+    // Remembered in `lane` for gen_vec, which needs it at every level.
+    static std::optional<int> vec_regs(const NodeExpr* expr, Lane& lane) // NOLINT(*-no-recursion)
+    {
+        if (const auto it = lane.regs.find(expr); it != lane.regs.end()) {
+            return it->second;
+        }
+        const std::optional<int> regs = count_vec_regs(expr, lane);
+        if (regs.has_value()) {
+            lane.regs.emplace(expr, regs.value());
+        }
+        return regs;
+    }
+
+    static std::optional<int> count_vec_regs(const NodeExpr* expr, Lane& lane) // NOLINT(*-no-recursion)
+    {
+        if (lane.scalars.contains(expr)) {
+            return 1;
+        }
+        if (std::holds_alternative<NodeBinExpr*>(expr->var)) {
+            const NodeBinExpr* bin_expr = std::get<NodeBinExpr*>(expr->var);
+            const NodeExpr* lhs;
+            const NodeExpr* rhs;
+            if (std::holds_alternative<NodeBinExprAdd*>(bin_expr->var)) {
+                lhs = std::get<NodeBinExprAdd*>(bin_expr->var)->lhs;
+                rhs = std::get<NodeBinExprAdd*>(bin_expr->var)->rhs;
+            }
+            else if (std::holds_alternative<NodeBinExprSub*>(bin_expr->var)) {
+                lhs = std::get<NodeBinExprSub*>(bin_expr->var)->lhs;
+                rhs = std::get<NodeBinExprSub*>(bin_expr->var)->rhs;
+            }
+            else {
+                // No packed 64-bit multiply or divide below AVX-512.
+                return {};
+            }
+            const auto lhs_regs = vec_regs(lhs, lane);
+            const auto rhs_regs = vec_regs(rhs, lane);
+            if (!lhs_regs.has_value() || !rhs_regs.has_value()) {
+                return {};
+            }
+            if (lhs_regs.value() == rhs_regs.value()) {
+                return lhs_regs.value() + 1;
+            }
+            return std::max(lhs_regs.value(), rhs_regs.value());
+        }
+        const NodeTerm* term = std::get<NodeTerm*>(expr->var);
+        int negations = 0;
+        while (std::holds_alternative<NodeTermNeg*>(term->var)) {
+            term = std::get<NodeTermNeg*>(term->var)->term;
+            negations++;
+        }
+        std::optional<int> regs;
+        if (std::holds_alternative<NodeTermParen*>(term->var)) {
+            regs = vec_regs(std::get<NodeTermParen*>(term->var)->expr, lane);
+        }
+        else if (std::holds_alternative<NodeTermIdent*>(term->var)) {
+            regs = 1;
+        }
+        if (regs.has_value() && negations > 0) {
+            regs = std::max(regs.value(), 2);
+        }
+        return regs;
+    }
+
+    [[nodiscard]] std::string vec_reg(const int reg) const
+    {
+        return (m_options.simd == SimdLevel::avx2 ? "ymm" : "xmm") + std::to_string(reg);
+    }
+
+    // Memory operand of the vector of elements at byte offset rcx.
+    std::string vec_addr(const Var& var)
+    {
+        if (var.static_label.has_value()) {
+            m_output << "    lea rdx, [rel " << var.static_label.value() << "]\n";
+            return "[rdx + rcx]";
+        }
+        return "[rsp + " + std::to_string(slot_offset(var.stack_loc + var.array_len.value() - 1)) + " + rcx]";
+    }
+
+    // Evaluates the vector at byte offset rcx of an element-wise expression into vector register `reg`.
+    void gen_vec(const NodeExpr* expr, Lane& lane, const int reg) // NOLINT(*-no-recursion)
+    {
+        const bool avx = m_options.simd == SimdLevel::avx2;
+        if (const auto it = lane.scalars.find(expr); it != lane.scalars.end()) {
+            const std::string slot = "QWORD [rsp + " + std::to_string(slot_offset(it->second)) + "]";
+            if (avx) {
+                m_output << "    vpbroadcastq " << vec_reg(reg) << ", " << slot << "\n";
+            }
+            else {
+                m_output << "    movq " << vec_reg(reg) << ", " << slot << "\n";
+                m_output << "    punpcklqdq " << vec_reg(reg) << ", " << vec_reg(reg) << "\n";
+            }
+            return;
+        }
+        if (std::holds_alternative<NodeBinExpr*>(expr->var)) {
+            const NodeBinExpr* bin_expr = std::get<NodeBinExpr*>(expr->var);
+            const bool is_add = std::holds_alternative<NodeBinExprAdd*>(bin_expr->var);
+            const NodeExpr* lhs = is_add ? std::get<NodeBinExprAdd*>(bin_expr->var)->lhs
+                                         : std::get<NodeBinExprSub*>(bin_expr->var)->lhs;
+            const NodeExpr* rhs = is_add ? std::get<NodeBinExprAdd*>(bin_expr->var)->rhs
+                                         : std::get<NodeBinExprSub*>(bin_expr->var)->rhs;
+            // Evaluate the operand needing more registers first.
+            int lhs_reg = reg;
+            int rhs_reg = reg + 1;
+            if (vec_regs(lhs, lane).value() < vec_regs(rhs, lane).value()) {
+                std::swap(lhs_reg, rhs_reg);
+                gen_vec(rhs, lane, rhs_reg);
+                gen_vec(lhs, lane, lhs_reg);
+            }
+            else {
+                gen_vec(lhs, lane, lhs_reg);
+                gen_vec(rhs, lane, rhs_reg);
+            }
+            const std::string op = is_add ? "paddq" : "psubq";
+            if (avx) {
+                m_output << "    v" << op << " " << vec_reg(reg) << ", " << vec_reg(lhs_reg) << ", " << vec_reg(rhs_reg)
+                         << "\n";
+            }
+            else if (lhs_reg == reg) {
+                m_output << "    " << op << " " << vec_reg(reg) << ", " << vec_reg(rhs_reg) << "\n";
+            }
+            else {
+                m_output << "    " << op << " " << vec_reg(lhs_reg) << ", " << vec_reg(rhs_reg) << "\n";
+                m_output << "    movdqa " << vec_reg(reg) << ", " << vec_reg(lhs_reg) << "\n";
+            }
+            return;
+        }
+        const NodeTerm* term = std::get<NodeTerm*>(expr->var);
+        int negations = 0;
+        while (std::holds_alternative<NodeTermNeg*>(term->var)) {
+            term = std::get<NodeTermNeg*>(term->var)->term;
+            negations++;
+        }
+        if (std::holds_alternative<NodeTermParen*>(term->var)) {
+            gen_vec(std::get<NodeTermParen*>(term->var)->expr, lane, reg);
+        }
+        else {
+            const Var& var = lookup_array(std::get<NodeTermIdent*>(term->var)->ident);
+            const std::string addr = vec_addr(var);
+            m_output << "    " << (avx ? "vmovdqu " : "movdqu ") << vec_reg(reg) << ", " << addr << "\n";
+        }
+        if (negations % 2 == 1) {
+            if (avx) {
+                m_output << "    vpxor " << vec_reg(reg + 1) << ", " << vec_reg(reg + 1) << ", " << vec_reg(reg + 1)
+                         << "\n";
+                m_output << "    vpsubq " << vec_reg(reg) << ", " << vec_reg(reg + 1) << ", " << vec_reg(reg) << "\n";
+            }
+            else {
+                m_output << "    pxor " << vec_reg(reg + 1) << ", " << vec_reg(reg + 1) << "\n";
+                m_output << "    psubq " << vec_reg(reg + 1) << ", " << vec_reg(reg) << "\n";
+                m_output << "    movdqa " << vec_reg(reg) << ", " << vec_reg(reg + 1) << "\n";
+            }
+        }
+    }
+
+    // Assigns an expression element-wise to every element of an array. Scalar operands are
+    // evaluated once up front; the elements are then computed in a vector loop when the target
+    // and the operators allow it, with a scalar loop for the remainder.
+    void gen_elementwise(const Var& dst, const NodeExpr* expr)
+    {
+        m_output << "    ;; elementwise\n";
+        const size_t len = dst.array_len.value();
+        const size_t temps_begin = m_stack_size;
+        Lane lane;
+        hoist_scalars(expr, lane, len);
+
+        size_t vectorized = 0;
+        const size_t width = m_options.simd == SimdLevel::avx2 ? 4 : m_options.simd == SimdLevel::sse2 ? 2 : 1;
+        if (const auto regs = vec_regs(expr, lane); width > 1 && len >= width && regs.has_value() && regs <= 16) {
+            vectorized = len / width * width;
+            const std::string loop_label = create_label();
+            gen_load_imm(m_output, "rcx", 0);
+            m_output << loop_label << ":\n";
+            gen_vec(expr, lane, 0);
+            const std::string addr = vec_addr(dst);
+            m_output << "    " << (m_options.simd == SimdLevel::avx2 ? "vmovdqu " : "movdqu ") << addr << ", "
+                     << vec_reg(0) << "\n";
+            m_output << "    add rcx, " << width * 8 << "\n";
+            m_output << "    cmp rcx, " << vectorized * 8 << "\n";
+            m_output << "    jb " << loop_label << "\n";
+            if (m_options.simd == SimdLevel::avx2) {
+                m_output << "    vzeroupper\n";
+            }
+        }
+
+        if (vectorized < len) {
+            m_output << "    mov rax, " << vectorized << "\n";
+            push("rax");
+            lane.counter_loc = m_stack_size - 1;
+            m_lane = std::move(lane);
+            const std::string loop_label = create_label();
+            m_output << loop_label << ":\n";
+            gen_expr_into("rbx", expr);
+            const std::string counter = "QWORD [rsp + " + std::to_string(slot_offset(m_lane->counter_loc)) + "]";
+            m_output << "    mov rax, " << counter << "\n";
+            const std::string addr = elem_addr(dst, {});
+            m_output << "    mov " << addr << ", rbx\n";
+            m_output << "    add rax, 1\n";
+            m_output << "    mov " << counter << ", rax\n";
+            m_output << "    cmp rax, " << len << "\n";
+            m_output << "    jb " << loop_label << "\n";
+            m_lane.reset();
+        }
+
+        if (const size_t temps = m_stack_size - temps_begin; temps != 0) {
+            m_output << "    add rsp, " << temps * 8 << "\n";
+            m_stack_size = temps_begin;
+        }
+        m_output << "    ;; /elementwise\n";
+    }
+
+    void push(const std::string& reg)
+    {
+        m_output << "    push " << reg << "\n";
+        grow_stack(1);
+    }
+
+    // Pushes a constant, as an immediate if it fits the sign-extended imm32 of `push`.
+    void push_imm(const int64_t value)
+    {
+        if (value >= INT32_MIN && value <= INT32_MAX) {
+            push(std::to_string(value));
+        }
+        else {
+            m_output << "    mov rax, " << value << "\n";
+            push("rax");
+        }
+    }
+
+    void grow_stack(const size_t slots)
+    {
+        m_stack_size += slots;
+        m_max_stack_size = std::max(m_max_stack_size, m_stack_size);
+    }
+
+    template <typename Stmt>
+    [[nodiscard]] StoreFate store_fate(const Stmt* stmt) const
+    {
+        return m_liveness ? m_liveness->fate(stmt) : StoreFate::keep;
+    }
+
+    void pop(const std::string& reg)
+    {
+        m_output << "    pop " << reg << "\n";
+        m_stack_size--;
+    }
+
+    void begin_scope()
+    {
+        m_scopes.push_back(m_vars.size());
+    }
+
+    void end_scope()
+    {
+        size_t pop_count = 0;
+        for (auto it = m_vars.cbegin() + static_cast<std::ptrdiff_t>(m_scopes.back()); it != m_vars.cend(); ++it) {
+            pop_count += it->slots();
+            m_var_index.erase(it->name);
+        }
+        if (pop_count != 0) {
+            m_output << "    add rsp, " << pop_count * 8 << "\n";
+        }
+        m_stack_size -= pop_count;
+        m_vars.resize(m_scopes.back());
+        m_scopes.pop_back();
+        // Values computed in the scope may not have been computed on every path past it.
+        while (!m_shared_fills.empty() && m_shared_fills.back().second > m_scopes.size()) {
+            if (const auto it = m_shared_slots.find(m_shared_fills.back().first); it != m_shared_slots.end()) {
+                it->second.ready = false;
+            }
+            m_shared_fills.pop_back();
+        }
+        while (!m_shared_order.empty() && m_shared_slots.at(m_shared_order.back()).stack_loc >= m_stack_size) {
+            m_shared_slots.erase(m_shared_order.back());
+            m_shared_order.pop_back();
+        }
+    }
+
+    std::string create_label()
+    {
+        std::stringstream ss;
+        ss << m_label_prefix << m_label_count++;
+        return ss.str();
+    }
+
     const NodeProg m_prog;
+    const GeneratorOptions m_options;
     std::stringstream m_output;
     size_t m_stack_size = 0;
     std::vector<Var> m_vars {};
+    // Index in `m_vars` of each named variable. Names are never shadowed, so there is one per name.
+    std::unordered_map<std::string, size_t> m_var_index {};
     std::vector<size_t> m_scopes {};
+    std::unordered_map<const NodeExpr*, SharedSlot> m_shared_slots {};
+    // Shared expressions in the order their slots were reserved, and in the order they were
+    // computed together with the scope depth at the time, so that both unwind with the scopes.
+    std::vector<const NodeExpr*> m_shared_order {};
+    std::vector<std::pair<const NodeExpr*, size_t>> m_shared_fills {};
+    // Nesting of code that only runs on some paths, where computed values are not kept.
+    int m_conditional = 0;
+    std::string m_label_prefix = "label";
     int m_label_count = 0;
+    Evaluator m_folder;
+    std::optional<Lane> m_lane {};
+    std::vector<std::pair<std::string, size_t>> m_statics {};
+    bool m_bounds_checked = false;
+    std::ostream* m_stream = nullptr;
+    std::shared_ptr<const Liveness> m_liveness {};
+    std::shared_ptr<ProfileLayout> m_profile_layout {};
+    // Arms moved out of line, emitted after the exits.
+    std::string m_cold {};
+    size_t m_max_stack_size = 0;
 };
@@ -0,0 +1,569 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <unordered_map>
+
+#include "evaluation.hpp"
+#include "parser.hpp"
+
+// Compiles a program to register-based bytecode and runs it. Variables and temporaries live in
+// registers of a single frame, allocated in scope order like the generator's stack slots, so a
+// program behaves exactly as its native build does.
+class Interpreter {
+public:
+    explicit Interpreter(const NodeProg& prog)
+        : m_folder(0)
+    {
+        for (const NodeStmt* stmt : prog.stmts) {
+            compile_stmt(stmt);
+        }
+        emit(Op::halt);
+    }
+
+    [[nodiscard]] Evaluator::Result run() const
+    {
+        std::vector<int64_t> frame(m_frame_size);
+        int64_t* regs = frame.data();
+        const Instr* code = m_code.data();
+        const Instr* ip = code;
+
+#if defined(__GNUC__)
+        // Computed-goto dispatch; the table follows the order of `Op`.
+        static void* const dispatch_table[] = {
+            &&op_load_const, &&op_move,         &&op_neg,       &&op_add,      &&op_sub,  &&op_mul,
+            &&op_div,        &&op_mod,          &&op_eq,        &&op_ne,       &&op_load_elem,
+            &&op_store_elem, &&op_zero,         &&op_jump,      &&op_jump_if_zero, &&op_lane_next,
+            &&op_exit,       &&op_halt,
+        };
+#define DISPATCH() goto* dispatch_table[static_cast<uint8_t>(ip->op)]
+#define CASE(name) op_##name:
+#define NEXT()                                                                                                         \
+    ++ip;                                                                                                              \
+    DISPATCH()
+#define JUMP(target)                                                                                                   \
+    ip = code + (target);                                                                                              \
+    DISPATCH()
+        DISPATCH();
+#else
+#define CASE(name) case Op::name:
+#define NEXT()                                                                                                         \
+    ++ip;                                                                                                              \
+    continue
+#define JUMP(target)                                                                                                   \
+    ip = code + (target);                                                                                              \
+    continue
+        while (true) {
+            switch (ip->op) {
+#endif
+        CASE(load_const)
+        {
+            regs[ip->a] = m_consts[ip->b];
+            NEXT();
+        }
+        CASE(move)
+        {
+            regs[ip->a] = regs[ip->b];
+            NEXT();
+        }
+        CASE(neg)
+        {
+            regs[ip->a] = Evaluator::wrap(uint64_t { 0 } - static_cast<uint64_t>(regs[ip->b]));
+            NEXT();
+        }
+        CASE(add)
+        {
+            regs[ip->a] = Evaluator::wrap(static_cast<uint64_t>(regs[ip->b]) + static_cast<uint64_t>(regs[ip->c]));
+            NEXT();
+        }
+        CASE(sub)
+        {
+            regs[ip->a] = Evaluator::wrap(static_cast<uint64_t>(regs[ip->b]) - static_cast<uint64_t>(regs[ip->c]));
+            NEXT();
+        }
+        CASE(mul)
+        {
+            regs[ip->a] = Evaluator::wrap(static_cast<uint64_t>(regs[ip->b]) * static_cast<uint64_t>(regs[ip->c]));
+            NEXT();
+        }
+        CASE(div)
+        {
+            const auto value = Evaluator::apply(static_cast<const NodeBinExprDiv*>(nullptr), regs[ip->b], regs[ip->c]);
+            if (!value.has_value()) {
+                return { .outcome = Evaluator::Outcome::div_by_zero };
+            }
+            regs[ip->a] = value.value();
+            NEXT();
+        }
+        CASE(mod)
+        {
+            const auto value = Evaluator::apply(static_cast<const NodeBinExprMod*>(nullptr), regs[ip->b], regs[ip->c]);
+            if (!value.has_value()) {
+                return { .outcome = Evaluator::Outcome::div_by_zero };
+            }
+            regs[ip->a] = value.value();
+            NEXT();
+        }
+        CASE(eq)
+        {
+            regs[ip->a] = regs[ip->b] == regs[ip->c] ? 1 : 0;
+            NEXT();
+        }
+        CASE(ne)
+        {
+            regs[ip->a] = regs[ip->b] != regs[ip->c] ? 1 : 0;
+            NEXT();
+        }
+        CASE(load_elem)
+        {
+            const auto [base, len] = m_arrays[ip->b];
+            const auto index = static_cast<uint64_t>(regs[ip->c]);
+            if (index >= len) {
+                return { .outcome = Evaluator::Outcome::exited, .exit_value = Evaluator::bounds_fail_code };
+            }
+            regs[ip->a] = regs[base + index];
+            NEXT();
+        }
+        CASE(store_elem)
+        {
+            const auto [base, len] = m_arrays[ip->a];
+            const auto index = static_cast<uint64_t>(regs[ip->b]);
+            if (index >= len) {
+                return { .outcome = Evaluator::Outcome::exited, .exit_value = Evaluator::bounds_fail_code };
+            }
+            regs[base + index] = regs[ip->c];
+            NEXT();
+        }
+        CASE(zero)
+        {
+            std::fill_n(regs + ip->a, ip->b, 0);
+            NEXT();
+        }
+        CASE(jump)
+        {
+            JUMP(ip->a);
+        }
+        CASE(jump_if_zero)
+        {
+            if (regs[ip->a] == 0) {
+                JUMP(ip->b);
+            }
+            NEXT();
+        }
+        CASE(lane_next)
+        {
+            if (++regs[ip->a] < ip->b) {
+                JUMP(ip->c);
+            }
+            NEXT();
+        }
+        CASE(exit)
+        {
+            return { .outcome = Evaluator::Outcome::exited, .exit_value = regs[ip->a] };
+        }
+        CASE(halt)
+        {
+            return { .outcome = Evaluator::Outcome::exited, .exit_value = 0 };
+        }
+#if !defined(__GNUC__)
+            }
+        }
+#endif
+#undef DISPATCH
+#undef CASE
+#undef NEXT
+#undef JUMP
+    }
+
+private:
+    enum class Op : uint8_t {
+        load_const, // a = consts[b]
+        move, // a = b
+        neg, // a = -b
+        add, // a = b + c
+        sub, // a = b - c
+        mul, // a = b * c
+        div, // a = b / c
+        mod, // a = b % c
+        eq, // a = b == c
+        ne, // a = b != c
+        load_elem, // a = arrays[b][c], bounds checked
+        store_elem, // arrays[a][b] = c, bounds checked
+        zero, // a..a+b = 0
+        jump, // goto a
+        jump_if_zero, // if a == 0 goto b
+        lane_next, // if ++a < b goto c
+        exit, // exit(a)
+        halt, // exit(0)
+    };
+
+    struct Instr {
+        Op op;
+        uint32_t a = 0;
+        uint32_t b = 0;
+        uint32_t c = 0;
+    };
+
+    struct Array {
+        uint32_t base;
+        uint32_t len;
+    };
+
+    struct Var {
+        std::string name;
+        uint32_t reg;
+        std::optional<uint32_t> array {};
+    };
+
+    struct Lane {
+        uint32_t counter {};
+        std::unordered_map<const NodeExpr*, uint32_t> scalars {};
+    };
+
+    [[noreturn]] static void error_invalid()
+    {
+        std::cerr << "Invalid program" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    size_t emit(const Op op, const uint32_t a = 0, const uint32_t b = 0, const uint32_t c = 0)
+    {
+        m_code.push_back({ .op = op, .a = a, .b = b, .c = c });
+        return m_code.size() - 1;
+    }
+
+    [[nodiscard]] uint32_t here() const
+    {
+        return static_cast<uint32_t>(m_code.size());
+    }
+
+    uint32_t alloc_regs(const uint32_t count)
+    {
+        const uint32_t reg = m_next_reg;
+        m_next_reg += count;
+        m_frame_size = std::max(m_frame_size, static_cast<size_t>(m_next_reg));
+        return reg;
+    }
+
+    uint32_t load_const(const int64_t value)
+    {
+        const uint32_t reg = alloc_regs(1);
+        emit(Op::load_const, reg, static_cast<uint32_t>(m_consts.size()));
+        m_consts.push_back(value);
+        return reg;
+    }
+
+    const Var* find_var(const Token& ident) const
+    {
+        const auto it = m_var_index.find(ident.value.value());
+        return it == m_var_index.end() ? nullptr : &m_vars[it->second];
+    }
+
+    const Var& lookup_var(const Token& ident) const
+    {
+        const Var* var = find_var(ident);
+        if (var == nullptr) {
+            error_invalid();
+        }
+        return *var;
+    }
+
+    void declare(const Var& var)
+    {
+        if (!m_var_index.emplace(var.name, m_vars.size()).second) {
+            error_invalid();
+        }
+        m_vars.push_back(var);
+    }
+
+    // Compiles an expression and returns the register holding its value. Variables are read in place.
+    uint32_t compile_expr(const NodeExpr* expr) // NOLINT(*-no-recursion)
+    {
+        if (m_lane.has_value()) {
+            if (const auto it = m_lane->scalars.find(expr); it != m_lane->scalars.end()) {
+                return it->second;
+            }
+        }
+        if (const auto value = m_folder.fold(expr)) {
+            return load_const(value.value());
+        }
+        if (std::holds_alternative<NodeTerm*>(expr->var)) {
+            return compile_term(std::get<NodeTerm*>(expr->var));
+        }
+
+        struct BinExprVisitor {
+            Interpreter& interp;
+
+            [[nodiscard]] uint32_t binary(const Op op, const NodeExpr* lhs, const NodeExpr* rhs) const
+            {
+                // The generated code evaluates the right operand first.
+                const uint32_t rhs_reg = interp.compile_expr(rhs);
+                const uint32_t lhs_reg = interp.compile_expr(lhs);
+                const uint32_t reg = interp.alloc_regs(1);
+                interp.emit(op, reg, lhs_reg, rhs_reg);
+                return reg;
+            }
+
+            uint32_t operator()(const NodeBinExprAdd* add) const
+            {
+                return binary(Op::add, add->lhs, add->rhs);
+            }
+
+            uint32_t operator()(const NodeBinExprSub* sub) const
+            {
+                return binary(Op::sub, sub->lhs, sub->rhs);
+            }
+
+            uint32_t operator()(const NodeBinExprMulti* multi) const
+            {
+                return binary(Op::mul, multi->lhs, multi->rhs);
+            }
+
+            uint32_t operator()(const NodeBinExprDiv* div) const
+            {
+                return binary(Op::div, div->lhs, div->rhs);
+            }
+
+            uint32_t operator()(const NodeBinExprMod* mod) const
+            {
+                return binary(Op::mod, mod->lhs, mod->rhs);
+            }
+
+            uint32_t operator()(const NodeBinExprEq* eq) const
+            {
+                return binary(Op::eq, eq->lhs, eq->rhs);
+            }
+
+            uint32_t operator()(const NodeBinExprNe* ne) const
+            {
+                return binary(Op::ne, ne->lhs, ne->rhs);
+            }
+        };
+
+        return std::visit(BinExprVisitor { .interp = *this }, std::get<NodeBinExpr*>(expr->var)->var);
+    }
+
+    uint32_t compile_term(const NodeTerm* term) // NOLINT(*-no-recursion)
+    {
+        struct TermVisitor {
+            Interpreter& interp;
+
+            uint32_t operator()(const NodeTermIntLit* term_int_lit) const
+            {
+                const auto value = Evaluator::parse_int_lit(term_int_lit->int_lit);
+                if (!value.has_value()) {
+                    error_invalid();
+                }
+                return interp.load_const(value.value());
+            }
+
+            uint32_t operator()(const NodeTermIdent* term_ident) const
+            {
+                const Var& var = interp.lookup_var(term_ident->ident);
+                if (!var.array.has_value()) {
+                    return var.reg;
+                }
+                if (!interp.m_lane.has_value()) {
+                    error_invalid();
+                }
+                const uint32_t reg = interp.alloc_regs(1);
+                interp.emit(Op::load_elem, reg, var.array.value(), interp.m_lane->counter);
+                return reg;
+            }
+
+            uint32_t operator()(const NodeTermIndex* term_index) const
+            {
+                const Var& var = interp.lookup_var(term_index->ident);
+                if (!var.array.has_value()) {
+                    error_invalid();
+                }
+                const uint32_t index = interp.compile_expr(term_index->index);
+                const uint32_t reg = interp.alloc_regs(1);
+                interp.emit(Op::load_elem, reg, var.array.value(), index);
+                return reg;
+            }
+
+            uint32_t operator()(const NodeTermParen* term_paren) const
+            {
+                return interp.compile_expr(term_paren->expr);
+            }
+
+            uint32_t operator()(const NodeTermNeg* term_neg) const
+            {
+                const uint32_t operand = interp.compile_term(term_neg->term);
+                const uint32_t reg = interp.alloc_regs(1);
+                interp.emit(Op::neg, reg, operand);
+                return reg;
+            }
+        };
+
+        return std::visit(TermVisitor { .interp = *this }, term->var);
+    }
+
+    void compile_elementwise(const Var& dst, const NodeExpr* expr)
+    {
+        const uint32_t len = m_arrays[dst.array.value()].len;
+        const auto is_array = [&](const Token& ident) {
+            const Var* it = find_var(ident);
+            if (it == nullptr || !it->array.has_value()) {
+                return false;
+            }
+            if (m_arrays[it->array.value()].len != len) {
+                error_invalid();
+            }
+            return true;
+        };
+        Lane lane;
+        for_each_scalar(expr, is_array, [&](const NodeExpr* scalar) {
+            lane.scalars.emplace(scalar, compile_expr(scalar));
+        });
+        lane.counter = load_const(0);
+        m_lane = std::move(lane);
+        const uint32_t loop = here();
+        const uint32_t value = compile_expr(expr);
+        emit(Op::store_elem, dst.array.value(), m_lane->counter, value);
+        emit(Op::lane_next, m_lane->counter, len, loop);
+        m_lane.reset();
+    }
+
+    void compile_scope(const NodeScope* scope) // NOLINT(*-no-recursion)
+    {
+        const size_t vars_begin = m_vars.size();
+        const uint32_t regs_begin = m_vars_top;
+        for (const NodeStmt* stmt : scope->stmts) {
+            compile_stmt(stmt);
+        }
+        for (auto it = m_vars.cbegin() + static_cast<std::ptrdiff_t>(vars_begin); it != m_vars.cend(); ++it) {
+            m_var_index.erase(it->name);
+        }
+        m_vars.resize(vars_begin);
+        m_vars_top = regs_begin;
+        m_next_reg = regs_begin;
+    }
+
+    // Compiles a condition and returns the index of its jump over the body, to be patched.
+    size_t compile_cond(const NodeExpr* expr)
+    {
+        const uint32_t regs_begin = m_next_reg;
+        const uint32_t cond = compile_expr(expr);
+        m_next_reg = regs_begin;
+        return emit(Op::jump_if_zero, cond);
+    }
+
+    void compile_if_pred(const NodeIfPred* pred, std::vector<size_t>& end_jumps) // NOLINT(*-no-recursion)
+    {
+        if (std::holds_alternative<NodeIfPredElse*>(pred->var)) {
+            compile_scope(std::get<NodeIfPredElse*>(pred->var)->scope);
+            return;
+        }
+        const NodeIfPredElif* elif = std::get<NodeIfPredElif*>(pred->var);
+        const size_t skip = compile_cond(elif->expr);
+        compile_scope(elif->scope);
+        if (elif->pred.has_value()) {
+            end_jumps.push_back(emit(Op::jump));
+            m_code[skip].b = here();
+            compile_if_pred(elif->pred.value(), end_jumps);
+        }
+        else {
+            m_code[skip].b = here();
+        }
+    }
+
+    void compile_stmt(const NodeStmt* stmt) // NOLINT(*-no-recursion)
+    {
+        struct StmtVisitor {
+            Interpreter& interp;
+
+            void operator()(const NodeStmtExit* stmt_exit) const
+            {
+                interp.emit(Op::exit, interp.compile_expr(stmt_exit->expr));
+            }
+
+            void operator()(const NodeStmtLet* stmt_let) const
+            {
+                const uint32_t value = interp.compile_expr(stmt_let->expr);
+                interp.m_next_reg = interp.m_vars_top;
+                const uint32_t reg = interp.alloc_regs(1);
+                if (reg != value) {
+                    interp.emit(Op::move, reg, value);
+                }
+                interp.declare({ .name = stmt_let->ident.value.value(), .reg = reg });
+                interp.m_vars_top = interp.m_next_reg;
+            }
+
+            void operator()(const NodeStmtLetArray* stmt_let_array) const
+            {
+                const auto len = Evaluator::parse_int_lit(stmt_let_array->size);
+                if (!len.has_value() || len.value() <= 0 || len.value() > Evaluator::max_array_len) {
+                    error_invalid();
+                }
+                const auto array_len = static_cast<uint32_t>(len.value());
+                const uint32_t base = interp.alloc_regs(array_len);
+                interp.m_vars_top = interp.m_next_reg;
+                interp.emit(Op::zero, base, array_len);
+                const auto array = static_cast<uint32_t>(interp.m_arrays.size());
+                interp.m_arrays.push_back({ .base = base, .len = array_len });
+                interp.declare({ .name = stmt_let_array->ident.value.value(), .reg = base, .array = array });
+            }
+
+            void operator()(const NodeStmtAssign* stmt_assign) const
+            {
+                const Var& var = interp.lookup_var(stmt_assign->ident);
+                if (var.array.has_value()) {
+                    interp.compile_elementwise(var, stmt_assign->expr);
+                    return;
+                }
+                interp.emit(Op::move, var.reg, interp.compile_expr(stmt_assign->expr));
+            }
+
+            void operator()(const NodeStmtAssignIndex* stmt_assign_index) const
+            {
+                const Var& var = interp.lookup_var(stmt_assign_index->ident);
+                if (!var.array.has_value()) {
+                    error_invalid();
+                }
+                const uint32_t value = interp.compile_expr(stmt_assign_index->expr);
+                const uint32_t index = interp.compile_expr(stmt_assign_index->index);
+                interp.emit(Op::store_elem, var.array.value(), index, value);
+            }
+
+            void operator()(const NodeScope* scope) const
+            {
+                interp.compile_scope(scope);
+            }
+
+            void operator()(const NodeStmtIf* stmt_if) const
+            {
+                const size_t skip = interp.compile_cond(stmt_if->expr);
+                interp.compile_scope(stmt_if->scope);
+                if (!stmt_if->pred.has_value()) {
+                    interp.m_code[skip].b = interp.here();
+                    return;
+                }
+                std::vector<size_t> end_jumps { interp.emit(Op::jump) };
+                interp.m_code[skip].b = interp.here();
+                interp.compile_if_pred(stmt_if->pred.value(), end_jumps);
+                for (const size_t jump : end_jumps) {
+                    interp.m_code[jump].a = interp.here();
+                }
+            }
+        };
+
+        std::visit(StmtVisitor { .interp = *this }, stmt->var);
+        // Temporaries do not outlive their statement.
+        m_next_reg = m_vars_top;
+    }
+
+    std::vector<Instr> m_code {};
+    std::vector<int64_t> m_consts {};
+    std::vector<Array> m_arrays {};
+    std::vector<Var> m_vars {};
+    // Index in `m_vars` of each variable in scope.
+    std::unordered_map<std::string, size_t> m_var_index {};
+    std::optional<Lane> m_lane {};
+    uint32_t m_next_reg = 0;
+    // First register not holding a variable; temporaries are allocated from here.
+    uint32_t m_vars_top = 0;
+    size_t m_frame_size = 0;
+    Evaluator m_folder;
+};
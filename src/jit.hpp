@@ -0,0 +1,89 @@
+#pragma once
+
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+
+#include "assembler.hpp"
+
+// Runs assembled `Generator` output (built with `GeneratorOptions::jit`) in-process. The code is
+// mapped read+execute, data and bss read+write, and the program gets its own stack the size of the
+// native stack limit so that deep programs fail the same way the compiled binary would.
+class Jit {
+public:
+    explicit Jit(Assembly assembly)
+        : m_assembly(std::move(assembly))
+    {
+        const size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        const size_t text_size = align_up(std::max<size_t>(m_assembly.text.size(), 1), page);
+        const size_t data_size = align_up(m_assembly.data.size(), 16);
+        const size_t rw_size = align_up(data_size + m_assembly.bss_size, page);
+        m_image_size = text_size + rw_size;
+        m_image = map(m_image_size, PROT_READ | PROT_WRITE, 0);
+
+        const auto text_addr = reinterpret_cast<uint64_t>(m_image);
+        const uint64_t data_addr = text_addr + text_size;
+        const uint64_t bss_addr = data_addr + data_size;
+        m_assembly.link(text_addr, data_addr, bss_addr);
+        std::memcpy(m_image, m_assembly.text.data(), m_assembly.text.size());
+        std::memcpy(m_image + text_size, m_assembly.data.data(), m_assembly.data.size());
+        if (mprotect(m_image, text_size, PROT_READ | PROT_EXEC) != 0) {
+            std::cerr << "[JIT] Failed to make code executable" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+
+        rlimit limit {};
+        m_stack_size = default_stack_size;
+        if (getrlimit(RLIMIT_STACK, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY) {
+            m_stack_size = align_up(limit.rlim_cur, page);
+        }
+        // The lowest page stays inaccessible so that overflowing the stack faults.
+        m_stack_size += page;
+        m_stack = map(m_stack_size, PROT_READ | PROT_WRITE, MAP_NORESERVE | MAP_STACK);
+        mprotect(m_stack, page, PROT_NONE);
+    }
+
+    Jit(const Jit&) = delete;
+    Jit& operator=(const Jit&) = delete;
+
+    ~Jit()
+    {
+        munmap(m_image, m_image_size);
+        munmap(m_stack, m_stack_size);
+    }
+
+    // Runs the program and returns the value it passed to `exit`.
+    [[nodiscard]] int64_t run() const
+    {
+        using Entry = int64_t (*)(uint8_t* stack_top);
+        const auto entry = reinterpret_cast<Entry>(m_image + m_assembly.text_offset("jit_entry"));
+        return entry(m_stack + m_stack_size);
+    }
+
+private:
+    static constexpr size_t default_stack_size = 8 << 20;
+
+    static size_t align_up(const size_t size, const size_t align)
+    {
+        return (size + align - 1) / align * align;
+    }
+
+    static uint8_t* map(const size_t size, const int prot, const int flags)
+    {
+        void* mem = mmap(nullptr, size, prot, MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+        if (mem == MAP_FAILED) {
+            std::cerr << "[JIT] Failed to map memory" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        return static_cast<uint8_t*>(mem);
+    }
+
+    Assembly m_assembly;
+    uint8_t* m_image = nullptr;
+    size_t m_image_size = 0;
+    uint8_t* m_stack = nullptr;
+    size_t m_stack_size = 0;
+};
@@ -0,0 +1,468 @@
+#pragma once
+
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+
+#include "evaluation.hpp"
+
+// What the generator does with a `let` or a scalar assignment.
+enum class StoreFate {
+    keep,
+    // The value is never read and computing it cannot trap: the statement is skipped.
+    drop,
+    // The value is never read, but computing it may trap: it is computed and discarded.
+    effects_only,
+    // `let` only: the variable is read later, but never this initial value. The slot is reserved
+    // without computing it.
+    no_init,
+};
+
+// Backward liveness analysis of scalar variables. The language has no loops and `exit` ends the
+// program, so a single backward pass over the statements is exact. Names are first resolved to
+// their declarations, scope by scope, the same way the generator looks them up, since a name may
+// be declared again once the scope of an earlier declaration has ended. Arrays are never
+// considered dead.
+class Liveness {
+public:
+    explicit Liveness(const NodeProg& prog)
+    {
+        resolve_stmts(prog.stmts);
+        m_resolve_scope.clear();
+        m_resolved.clear();
+        Live live;
+        for (auto it = prog.stmts.rbegin(); it != prog.stmts.rend(); ++it) {
+            live_stmt(*it, live);
+        }
+    }
+
+    [[nodiscard]] StoreFate fate(const NodeStmtLet* stmt_let) const
+    {
+        const auto it = m_let_fates.find(stmt_let);
+        return it == m_let_fates.end() ? StoreFate::keep : it->second;
+    }
+
+    [[nodiscard]] StoreFate fate(const NodeStmtAssign* stmt_assign) const
+    {
+        const auto it = m_assign_fates.find(stmt_assign);
+        return it == m_assign_fates.end() ? StoreFate::keep : it->second;
+    }
+
+    // Scalar variables whose value is never read, last declared first.
+    [[nodiscard]] const std::vector<Token>& unused_vars() const
+    {
+        return m_unused_vars;
+    }
+
+    // Assignments and initial values of used variables that are never read.
+    [[nodiscard]] size_t dead_stores() const
+    {
+        return m_dead_stores;
+    }
+
+private:
+    struct Decl {
+        bool is_array;
+        bool used = false;
+    };
+
+    // The declarations live at a point of the program. Inside the arms of an if, a set only records
+    // how it differs from the set live after the if, so that an if costs what its arms do rather than
+    // a copy of every live variable.
+    class Live {
+    public:
+        Live() = default;
+
+        explicit Live(const Live* base)
+            : m_base(base)
+        {
+        }
+
+        [[nodiscard]] bool contains(const size_t decl) const
+        {
+            return m_added.contains(decl) || (in_base(decl) && !m_removed.contains(decl));
+        }
+
+        void insert(const size_t decl)
+        {
+            if (in_base(decl)) {
+                m_removed.erase(decl);
+            }
+            else {
+                m_added.insert(decl);
+            }
+        }
+
+        // Whether the declaration was live.
+        bool erase(const size_t decl)
+        {
+            if (m_added.erase(decl) != 0) {
+                return true;
+            }
+            if (!in_base(decl) || m_removed.contains(decl)) {
+                return false;
+            }
+            m_removed.insert(decl);
+            return true;
+        }
+
+        void clear()
+        {
+            m_added.clear();
+            m_removed.clear();
+            m_cleared = true;
+        }
+
+        // Sets this set, the base of both ways through a statement, to the declarations live on either.
+        void merge(const Live& a, const Live& b)
+        {
+            if (a.m_cleared && b.m_cleared) {
+                clear();
+            }
+            else if (a.m_cleared || b.m_cleared) {
+                for (const size_t decl : (a.m_cleared ? b : a).m_removed) {
+                    erase(decl);
+                }
+            }
+            else {
+                for (const size_t decl : a.m_removed) {
+                    if (b.m_removed.contains(decl)) {
+                        erase(decl);
+                    }
+                }
+            }
+            for (const Live* way : { &a, &b }) {
+                for (const size_t decl : way->m_added) {
+                    insert(decl);
+                }
+            }
+        }
+
+    private:
+        [[nodiscard]] bool in_base(const size_t decl) const
+        {
+            return !m_cleared && m_base != nullptr && m_base->contains(decl);
+        }
+
+        const Live* m_base = nullptr;
+        // Live here but not in the base.
+        std::unordered_set<size_t> m_added {};
+        // Live in the base but not here.
+        std::unordered_set<size_t> m_removed {};
+        // Nothing of the base is live here.
+        bool m_cleared = false;
+    };
+
+    // A declaration in scope, and the one of the same name it hides until its scope ends.
+    struct Binding {
+        std::string name;
+        std::optional<size_t> hidden;
+    };
+
+    std::optional<size_t> lookup(const Token& ident) const
+    {
+        const auto it = m_resolved.find(ident.value.value());
+        if (it == m_resolved.end()) {
+            return {};
+        }
+        return it->second;
+    }
+
+    void declare(const Token& ident, const bool is_array)
+    {
+        m_decls.push_back({ .is_array = is_array });
+        const auto [it, inserted] = m_resolved.try_emplace(ident.value.value(), m_decls.size() - 1);
+        m_resolve_scope.push_back({ .name = ident.value.value(), .hidden = {} });
+        if (!inserted) {
+            m_resolve_scope.back().hidden = std::exchange(it->second, m_decls.size() - 1);
+        }
+    }
+
+    void resolve_expr(const NodeExpr* expr) // NOLINT(*-no-recursion)
+    {
+        if (std::holds_alternative<NodeBinExpr*>(expr->var)) {
+            std::visit(
+                [&](const auto* bin) {
+                    resolve_expr(bin->lhs);
+                    resolve_expr(bin->rhs);
+                },
+                std::get<NodeBinExpr*>(expr->var)->var);
+            return;
+        }
+        const NodeTerm* term = std::get<NodeTerm*>(expr->var);
+        while (std::holds_alternative<NodeTermNeg*>(term->var)) {
+            term = std::get<NodeTermNeg*>(term->var)->term;
+        }
+        if (std::holds_alternative<NodeTermParen*>(term->var)) {
+            resolve_expr(std::get<NodeTermParen*>(term->var)->expr);
+        }
+        else if (std::holds_alternative<NodeTermIndex*>(term->var)) {
+            resolve_expr(std::get<NodeTermIndex*>(term->var)->index);
+        }
+        else if (std::holds_alternative<NodeTermIdent*>(term->var)) {
+            const NodeTermIdent* term_ident = std::get<NodeTermIdent*>(term->var);
+            if (const auto decl = lookup(term_ident->ident)) {
+                m_read_decls.emplace(term_ident, decl.value());
+            }
+        }
+    }
+
+    void resolve_scope(const NodeScope* scope) // NOLINT(*-no-recursion)
+    {
+        const size_t scope_begin = m_resolve_scope.size();
+        resolve_stmts(scope->stmts);
+        while (m_resolve_scope.size() > scope_begin) {
+            const Binding& binding = m_resolve_scope.back();
+            if (binding.hidden.has_value()) {
+                m_resolved[binding.name] = binding.hidden.value();
+            }
+            else {
+                m_resolved.erase(binding.name);
+            }
+            m_resolve_scope.pop_back();
+        }
+    }
+
+    void resolve_stmts(const std::vector<NodeStmt*>& stmts) // NOLINT(*-no-recursion)
+    {
+        struct StmtVisitor {
+            Liveness& liveness;
+
+            void operator()(const NodeStmtExit* stmt_exit) const
+            {
+                liveness.resolve_expr(stmt_exit->expr);
+            }
+
+            void operator()(const NodeStmtLet* stmt_let) const
+            {
+                liveness.resolve_expr(stmt_let->expr);
+                liveness.declare(stmt_let->ident, false);
+                liveness.m_let_decls.emplace(stmt_let, liveness.m_decls.size() - 1);
+            }
+
+            void operator()(const NodeStmtLetArray* stmt_let_array) const
+            {
+                liveness.declare(stmt_let_array->ident, true);
+            }
+
+            void operator()(const NodeStmtAssign* stmt_assign) const
+            {
+                liveness.resolve_expr(stmt_assign->expr);
+                if (const auto decl = liveness.lookup(stmt_assign->ident)) {
+                    liveness.m_assign_decls.emplace(stmt_assign, decl.value());
+                }
+            }
+
+            void operator()(const NodeStmtAssignIndex* stmt_assign_index) const
+            {
+                liveness.resolve_expr(stmt_assign_index->index);
+                liveness.resolve_expr(stmt_assign_index->expr);
+            }
+
+            void operator()(const NodeScope* scope) const
+            {
+                liveness.resolve_scope(scope);
+            }
+
+            void operator()(const NodeStmtIf* stmt_if) const
+            {
+                liveness.resolve_expr(stmt_if->expr);
+                liveness.resolve_scope(stmt_if->scope);
+                std::optional<NodeIfPred*> pred = stmt_if->pred;
+                while (pred.has_value()) {
+                    if (std::holds_alternative<NodeIfPredElse*>(pred.value()->var)) {
+                        liveness.resolve_scope(std::get<NodeIfPredElse*>(pred.value()->var)->scope);
+                        break;
+                    }
+                    const NodeIfPredElif* elif = std::get<NodeIfPredElif*>(pred.value()->var);
+                    liveness.resolve_expr(elif->expr);
+                    liveness.resolve_scope(elif->scope);
+                    pred = elif->pred;
+                }
+            }
+        };
+
+        for (const NodeStmt* stmt : stmts) {
+            std::visit(StmtVisitor { .liveness = *this }, stmt->var);
+        }
+    }
+
+    // Whether evaluating the expression can trap: division by a value that may be zero, or an
+    // array access that may be out of bounds.
+    bool can_trap(const NodeExpr* expr) // NOLINT(*-no-recursion)
+    {
+        if (std::holds_alternative<NodeBinExpr*>(expr->var)) {
+            const NodeBinExpr* bin_expr = std::get<NodeBinExpr*>(expr->var);
+            return std::visit(
+                [&](const auto* bin) {
+                    using Bin = std::remove_cvref_t<decltype(*bin)>;
+                    if constexpr (std::is_same_v<Bin, NodeBinExprDiv> || std::is_same_v<Bin, NodeBinExprMod>) {
+                        const std::optional<int64_t> divisor = m_folder.fold(bin->rhs);
+                        if (!divisor.has_value() || divisor.value() == 0) {
+                            return true;
+                        }
+                    }
+                    return can_trap(bin->lhs) || can_trap(bin->rhs);
+                },
+                bin_expr->var);
+        }
+        const NodeTerm* term = std::get<NodeTerm*>(expr->var);
+        while (std::holds_alternative<NodeTermNeg*>(term->var)) {
+            term = std::get<NodeTermNeg*>(term->var)->term;
+        }
+        if (std::holds_alternative<NodeTermParen*>(term->var)) {
+            return can_trap(std::get<NodeTermParen*>(term->var)->expr);
+        }
+        return std::holds_alternative<NodeTermIndex*>(term->var);
+    }
+
+    // Marks every scalar the expression reads as live and used.
+    void read_expr(const NodeExpr* expr, Live& live) // NOLINT(*-no-recursion)
+    {
+        if (std::holds_alternative<NodeBinExpr*>(expr->var)) {
+            std::visit(
+                [&](const auto* bin) {
+                    read_expr(bin->lhs, live);
+                    read_expr(bin->rhs, live);
+                },
+                std::get<NodeBinExpr*>(expr->var)->var);
+            return;
+        }
+        const NodeTerm* term = std::get<NodeTerm*>(expr->var);
+        while (std::holds_alternative<NodeTermNeg*>(term->var)) {
+            term = std::get<NodeTermNeg*>(term->var)->term;
+        }
+        if (std::holds_alternative<NodeTermParen*>(term->var)) {
+            read_expr(std::get<NodeTermParen*>(term->var)->expr, live);
+        }
+        else if (std::holds_alternative<NodeTermIndex*>(term->var)) {
+            read_expr(std::get<NodeTermIndex*>(term->var)->index, live);
+        }
+        else if (std::holds_alternative<NodeTermIdent*>(term->var)) {
+            if (const auto it = m_read_decls.find(std::get<NodeTermIdent*>(term->var)); it != m_read_decls.end()) {
+                live.insert(it->second);
+                m_decls[it->second].used = true;
+            }
+        }
+    }
+
+    void live_scope(const NodeScope* scope, Live& live) // NOLINT(*-no-recursion)
+    {
+        for (auto it = scope->stmts.rbegin(); it != scope->stmts.rend(); ++it) {
+            live_stmt(*it, live);
+        }
+    }
+
+    // Updates `live` from the variables live after the statement to those live before it.
+    void live_stmt(const NodeStmt* stmt, Live& live) // NOLINT(*-no-recursion)
+    {
+        struct StmtVisitor {
+            Liveness& liveness;
+            Live& live;
+
+            void operator()(const NodeStmtExit* stmt_exit) const
+            {
+                live.clear();
+                liveness.read_expr(stmt_exit->expr, live);
+            }
+
+            void operator()(const NodeStmtLet* stmt_let) const
+            {
+                const size_t decl = liveness.m_let_decls.at(stmt_let);
+                const bool traps = liveness.can_trap(stmt_let->expr);
+                const bool init_live = live.erase(decl);
+                if (init_live || traps) {
+                    liveness.read_expr(stmt_let->expr, live);
+                }
+                // Every read of the variable comes after its declaration and has been seen by now.
+                if (!liveness.m_decls[decl].used) {
+                    liveness.m_let_fates.emplace(stmt_let, traps ? StoreFate::effects_only : StoreFate::drop);
+                    liveness.m_unused_vars.push_back(stmt_let->ident);
+                }
+                else if (!init_live && !traps) {
+                    liveness.m_let_fates.emplace(stmt_let, StoreFate::no_init);
+                    liveness.m_dead_stores++;
+                }
+            }
+
+            void operator()(const NodeStmtLetArray*) const
+            {
+            }
+
+            void operator()(const NodeStmtAssign* stmt_assign) const
+            {
+                const auto it = liveness.m_assign_decls.find(stmt_assign);
+                if (it == liveness.m_assign_decls.end() || liveness.m_decls[it->second].is_array
+                    || live.erase(it->second)) {
+                    liveness.read_expr(stmt_assign->expr, live);
+                    return;
+                }
+                if (liveness.can_trap(stmt_assign->expr)) {
+                    liveness.m_assign_fates.emplace(stmt_assign, StoreFate::effects_only);
+                    liveness.m_dead_stores++;
+                    liveness.read_expr(stmt_assign->expr, live);
+                    return;
+                }
+                liveness.m_assign_fates.emplace(stmt_assign, StoreFate::drop);
+                liveness.m_dead_stores++;
+            }
+
+            void operator()(const NodeStmtAssignIndex* stmt_assign_index) const
+            {
+                // The generator evaluates the value first, then the index.
+                liveness.read_expr(stmt_assign_index->index, live);
+                liveness.read_expr(stmt_assign_index->expr, live);
+            }
+
+            void operator()(const NodeScope* scope) const
+            {
+                liveness.live_scope(scope, live);
+            }
+
+            void operator()(const NodeStmtIf* stmt_if) const
+            {
+                Live taken(&live);
+                liveness.live_scope(stmt_if->scope, taken);
+                Live rest(&live);
+                liveness.live_if_pred(stmt_if->pred, rest);
+                live.merge(taken, rest);
+                liveness.read_expr(stmt_if->expr, live);
+            }
+        };
+
+        std::visit(StmtVisitor { .liveness = *this, .live = live }, stmt->var);
+    }
+
+    // Updates `live` from the variables live after an if statement to those live before its
+    // predicate chain.
+    void live_if_pred(const std::optional<NodeIfPred*>& pred, Live& live) // NOLINT(*-no-recursion)
+    {
+        if (!pred.has_value()) {
+            return;
+        }
+        if (std::holds_alternative<NodeIfPredElse*>(pred.value()->var)) {
+            live_scope(std::get<NodeIfPredElse*>(pred.value()->var)->scope, live);
+            return;
+        }
+        const NodeIfPredElif* elif = std::get<NodeIfPredElif*>(pred.value()->var);
+        Live taken(&live);
+        live_scope(elif->scope, taken);
+        Live rest(&live);
+        live_if_pred(elif->pred, rest);
+        live.merge(taken, rest);
+        read_expr(elif->expr, live);
+    }
+
+    std::vector<Decl> m_decls {};
+    std::vector<Binding> m_resolve_scope {};
+    // The declaration each name in scope resolves to.
+    std::unordered_map<std::string, size_t> m_resolved {};
+    std::unordered_map<const NodeTermIdent*, size_t> m_read_decls {};
+    std::unordered_map<const NodeStmtLet*, size_t> m_let_decls {};
+    std::unordered_map<const NodeStmtAssign*, size_t> m_assign_decls {};
+    std::unordered_map<const NodeStmtLet*, StoreFate> m_let_fates {};
+    std::unordered_map<const NodeStmtAssign*, StoreFate> m_assign_fates {};
+    std::vector<Token> m_unused_vars {};
+    size_t m_dead_stores = 0;
+    Evaluator m_folder { 0 };
+};
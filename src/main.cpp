@@ -1,42 +1,369 @@
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <csignal>
+#include <cstdint>
 #include <fstream>
 #include <iostream>
 #include <optional>
 #include <sstream>
+#include <string_view>
 #include <vector>
 
 #include "generation.hpp"
+#include "interpretation.hpp"
+#include "elf.hpp"
+#include "jit.hpp"
+#include "serialization.hpp"
 
-int main(int argc, char* argv[])
+void print_usage()
 {
-    if (argc != 2) {
-        std::cerr << "Incorrect usage. Correct usage is..." << std::endl;
-        std::cerr << "hydro <input.hy>" << std::endl;
-        return EXIT_FAILURE;
+    std::cerr << "Incorrect usage. Correct usage is..." << std::endl;
+    std::cerr << "hydro [options] <input.hy|input.hyast>" << std::endl;
+    std::cerr << "Options:" << std::endl;
+    std::cerr << "  --march=<x86-64|x86-64-v2|x86-64-v3|x86-64-v4|native>" << std::endl;
+    std::cerr << "                           target CPU (native: the host's level); from v3, BMI2 in divisions"
+              << std::endl;
+    std::cerr << "                           by constants and a default --simd of avx2 instead of sse2" << std::endl;
+    std::cerr << "  --simd=<none|sse2|avx2>  vector instructions for element-wise array assignments" << std::endl;
+    std::cerr << "  --no-fold                do not evaluate constant expressions or programs at compile time"
+              << std::endl;
+    std::cerr << "  --threads=<n>            threads used for lexing and code generation (default: one per core)"
+              << std::endl;
+    std::cerr << "  --stream                 generate each statement as soon as it is parsed (no whole-program folding)"
+              << std::endl;
+    std::cerr << "  --no-dse                 keep dead stores and unused variables" << std::endl;
+    std::cerr << "  --no-cse                 recompute repeated expressions instead of reusing their value"
+              << std::endl;
+    std::cerr << "  --no-if-lowering         branch on every if instead of using cmov and jump tables" << std::endl;
+    std::cerr << "  --warn-unused            report variables whose value is never read" << std::endl;
+    std::cerr << "  --stats                  report what dead store elimination saved" << std::endl;
+    std::cerr << "  --instrument             make `out` count the arms taken by each if and write them to `out.prof`"
+              << std::endl;
+    std::cerr << "  --profile-use=<file>     test likely if arms first and move unlikely ones out of line"
+              << std::endl;
+    std::cerr << "  --run                    evaluate the program directly instead of building `out`" << std::endl;
+    std::cerr << "  --interp                 run the program on the bytecode interpreter instead of building `out`"
+              << std::endl;
+    std::cerr << "  --jit                    assemble the program in memory and run it instead of building `out`"
+              << std::endl;
+    std::cerr << "  --emit-ast               write the parsed program to `out.hyast` instead of building `out`"
+              << std::endl;
+    std::cerr << "  --elf                    write `out` as a minimal single-segment executable, without nasm or ld"
+              << std::endl;
+}
+
+constexpr std::array<std::pair<std::string_view, MarchLevel>, 4> march_levels { {
+    { "x86-64", MarchLevel::x86_64 },
+    { "x86-64-v2", MarchLevel::x86_64_v2 },
+    { "x86-64-v3", MarchLevel::x86_64_v3 },
+    { "x86-64-v4", MarchLevel::x86_64_v4 },
+} };
+
+// The highest level this CPU supports.
+MarchLevel host_march()
+{
+    if (__builtin_cpu_supports("x86-64-v4")) {
+        return MarchLevel::x86_64_v4;
+    }
+    if (__builtin_cpu_supports("x86-64-v3")) {
+        return MarchLevel::x86_64_v3;
+    }
+    if (__builtin_cpu_supports("x86-64-v2")) {
+        return MarchLevel::x86_64_v2;
     }
+    return MarchLevel::x86_64;
+}
 
-    std::string contents;
-    {
-        std::stringstream contents_stream;
-        std::fstream input(argv[1], std::ios::in);
-        contents_stream << input.rdbuf();
-        contents = contents_stream.str();
+std::optional<MarchLevel> parse_march(const std::string_view march)
+{
+    for (const auto& [name, level] : march_levels) {
+        if (march == name) {
+            return level;
+        }
+    }
+    if (march == "native") {
+        return host_march();
     }
+    return {};
+}
 
-    Tokenizer tokenizer(std::move(contents));
-    std::vector<Token> tokens = tokenizer.tokenize();
+// The widest vector instructions of a level, its default --simd. AVX-512 is not generated.
+SimdLevel march_simd(const MarchLevel march)
+{
+    return march >= MarchLevel::x86_64_v3 ? SimdLevel::avx2 : SimdLevel::sse2;
+}
 
-    Parser parser(std::move(tokens));
-    std::optional<NodeProg> prog = parser.parse_prog();
+enum class RunMode {
+    native,
+    run,
+    interp,
+    jit,
+};
 
-    if (!prog.has_value()) {
+// Executes the program in-process and terminates the way the compiled binary would.
+int run_prog(const NodeProg& prog, GeneratorOptions options, const RunMode mode)
+{
+    if (mode == RunMode::jit) {
+        options.jit = true;
+        Generator generator(prog, options);
+        Assembler assembler(generator.gen_prog());
+        const Jit jit(assembler.assemble());
+        return static_cast<uint8_t>(jit.run());
+    }
+    options.fold_constants = false;
+    options.eval_budget = 0;
+    {
+        // Generated for its error checking only.
+        Generator generator(prog, options);
+        (void)generator.gen_prog();
+    }
+    Evaluator::Result result;
+    if (mode == RunMode::interp) {
+        const Interpreter interpreter(prog);
+        result = interpreter.run();
+    }
+    else {
+        Evaluator evaluator(SIZE_MAX);
+        result = evaluator.run(prog);
+    }
+    const auto [outcome, exit_value] = result;
+    if (outcome == Evaluator::Outcome::div_by_zero) {
+        std::signal(SIGFPE, SIG_DFL);
+        std::raise(SIGFPE);
+    }
+    if (outcome != Evaluator::Outcome::exited) {
         std::cerr << "Invalid program" << std::endl;
-        exit(EXIT_FAILURE);
+        return EXIT_FAILURE;
+    }
+    return static_cast<uint8_t>(exit_value);
+}
+
+size_t count_instructions(const std::string& assembly)
+{
+    std::istringstream lines(assembly);
+    size_t count = 0;
+    for (std::string line; std::getline(lines, line);) {
+        if (line.starts_with("    ") && !line.starts_with("    ;")) {
+            count++;
+        }
     }
+    return count;
+}
 
-    {
-        Generator generator(prog.value());
+// Compares against a build without dead store elimination.
+void print_stats(const NodeProg& prog, const GeneratorOptions& options, const std::string& assembly, const size_t slots)
+{
+    GeneratorOptions baseline_options = options;
+    baseline_options.eliminate_dead_stores = false;
+    Generator baseline(prog, baseline_options);
+    const std::string baseline_assembly = baseline.gen_prog();
+    const Liveness liveness(prog);
+    std::cerr << "dead store elimination:" << std::endl;
+    std::cerr << "  dead stores:       " << liveness.dead_stores() << std::endl;
+    std::cerr << "  unused variables:  " << liveness.unused_vars().size() << std::endl;
+    std::cerr << "  instructions:      " << count_instructions(baseline_assembly) << " -> "
+              << count_instructions(assembly) << std::endl;
+    std::cerr << "  stack slots:       " << baseline.max_stack_slots() << " -> " << slots << std::endl;
+}
+
+void warn_unused(const NodeProg& prog)
+{
+    std::vector<Token> unused = Liveness(prog).unused_vars();
+    std::ranges::stable_sort(unused, {}, &Token::line);
+    for (const Token& ident : unused) {
+        std::cerr << "Unused variable: " << ident.value.value() << " on line " << ident.line << std::endl;
+    }
+}
+
+// Writes `out.asm` without holding the whole source, token list or AST in memory: tokens are pulled
+// as the parser needs them and each top-level statement is freed once generated.
+void stream_prog(const std::string& input_path, const GeneratorOptions& options)
+{
+    std::fstream input(input_path, std::ios::in);
+    Tokenizer tokenizer(input);
+    Parser parser(tokenizer);
+    std::fstream file("out.asm", std::ios::out);
+    Generator generator({}, options);
+    generator.begin_stream(file);
+    while (const std::optional<NodeStmt*> stmt = parser.parse_top_stmt()) {
+        generator.stream_stmt(stmt.value());
+        parser.release_nodes();
+    }
+    generator.end_stream();
+}
+
+int hydro_main(int argc, char* argv[])
+{
+    GeneratorOptions options;
+    std::optional<SimdLevel> simd;
+    std::optional<MarchLevel> march;
+    std::optional<std::string> input_path;
+    auto mode = RunMode::native;
+    bool stream = false;
+    bool emit_ast = false;
+    bool elf = false;
+    bool stats = false;
+    bool unused_warnings = false;
+    for (int i = 1; i < argc; i++) {
+        const std::string_view arg = argv[i];
+        if (arg == "--simd=none") {
+            simd = SimdLevel::none;
+        }
+        else if (arg == "--simd=sse2") {
+            simd = SimdLevel::sse2;
+        }
+        else if (arg == "--simd=avx2") {
+            simd = SimdLevel::avx2;
+        }
+        else if (arg.starts_with("--march=")) {
+            march = parse_march(arg.substr(std::string_view("--march=").size()));
+            if (!march.has_value()) {
+                print_usage();
+                return EXIT_FAILURE;
+            }
+        }
+        else if (arg == "--no-fold") {
+            options.fold_constants = false;
+            options.eval_budget = 0;
+        }
+        else if (arg.starts_with("--threads=")) {
+            const std::string_view count = arg.substr(std::string_view("--threads=").size());
+            if (const auto [ptr, ec] = std::from_chars(count.data(), count.data() + count.size(), options.threads);
+                ec != std::errc {} || ptr != count.data() + count.size() || options.threads == 0) {
+                print_usage();
+                return EXIT_FAILURE;
+            }
+        }
+        else if (arg == "--no-dse") {
+            options.eliminate_dead_stores = false;
+        }
+        else if (arg == "--no-cse") {
+            options.share_exprs = false;
+        }
+        else if (arg == "--no-if-lowering") {
+            options.lower_ifs = false;
+        }
+        else if (arg == "--warn-unused") {
+            unused_warnings = true;
+        }
+        else if (arg == "--stats") {
+            stats = true;
+        }
+        else if (arg == "--stream") {
+            stream = true;
+        }
+        else if (arg == "--run") {
+            mode = RunMode::run;
+        }
+        else if (arg == "--interp") {
+            mode = RunMode::interp;
+        }
+        else if (arg == "--jit") {
+            mode = RunMode::jit;
+        }
+        else if (arg == "--emit-ast") {
+            emit_ast = true;
+        }
+        else if (arg == "--elf") {
+            elf = true;
+        }
+        else if (arg == "--instrument") {
+            options.instrument = true;
+        }
+        else if (arg.starts_with("--profile-use=")) {
+            options.profile
+                = std::make_shared<const Profile>(std::string(arg.substr(std::string_view("--profile-use=").size())));
+        }
+        else if (arg.starts_with("-") || input_path.has_value()) {
+            print_usage();
+            return EXIT_FAILURE;
+        }
+        else {
+            input_path = arg;
+        }
+    }
+    if (!input_path.has_value() || (stream && mode != RunMode::native)
+        || ((emit_ast || elf) && (stream || mode != RunMode::native))
+        || (options.instrument && mode != RunMode::native)) {
+        print_usage();
+        return EXIT_FAILURE;
+    }
+    // An explicit --simd wins over the default of --march.
+    options.march = march.value_or(options.march);
+    options.simd = simd.value_or(march.has_value() ? march_simd(march.value()) : options.simd);
+    if (mode == RunMode::jit && options.simd == SimdLevel::avx2 && !__builtin_cpu_supports("avx2")) {
+        std::cerr << "[JIT] This CPU does not support AVX2" << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (mode == RunMode::jit && options.march > host_march()) {
+        std::cerr << "[JIT] This CPU does not support the --march level" << std::endl;
+        return EXIT_FAILURE;
+    }
+    // Serialized programs are loaded whole; there is nothing to stream.
+    const bool ast_input = AstFile::is_ast(input_path.value());
+    if (stream && ast_input) {
+        print_usage();
+        return EXIT_FAILURE;
+    }
+
+    if (stream) {
+        stream_prog(input_path.value(), options);
+    }
+    else {
+        // Own the nodes of `prog`.
+        std::optional<Parser> parser;
+        std::optional<AstFile> ast_file;
+        std::optional<NodeProg> prog;
+        if (ast_input) {
+            ast_file.emplace(input_path.value());
+            prog = ast_file->prog();
+        }
+        else {
+            std::string contents;
+            {
+                std::stringstream contents_stream;
+                std::fstream input(input_path.value(), std::ios::in);
+                contents_stream << input.rdbuf();
+                contents = contents_stream.str();
+            }
+
+            Tokenizer tokenizer(std::move(contents));
+            std::vector<Token> tokens = tokenizer.tokenize_parallel(worker_count(options.threads));
+
+            parser.emplace(std::move(tokens));
+            prog = parser->parse_prog();
+        }
+
+        if (!prog.has_value()) {
+            throw CompileError("Invalid program");
+        }
+
+        if (emit_ast) {
+            std::ofstream file("out.hyast", std::ios::binary);
+            file << AstWriter::write(prog.value());
+            return EXIT_SUCCESS;
+        }
+
+        if (unused_warnings) {
+            warn_unused(prog.value());
+        }
+
+        if (mode != RunMode::native) {
+            return run_prog(prog.value(), options, mode);
+        }
+
+        Generator generator(prog.value(), options);
+        const std::string assembly = generator.gen_prog();
+        if (stats) {
+            print_stats(prog.value(), options, assembly, generator.max_stack_slots());
+        }
         std::fstream file("out.asm", std::ios::out);
-        file << generator.gen_prog();
+        file << assembly;
+        if (elf) {
+            write_elf(Assembler(assembly).assemble(), "out");
+            return EXIT_SUCCESS;
+        }
     }
 
     system("nasm -felf64 out.asm");
@@ -44,3 +371,19 @@ int main(int argc, char* argv[])
 
     return EXIT_SUCCESS;
 }
+
+int main(int argc, char* argv[])
+{
+    // Compiles on a thread with room for the deepest tree the parser accepts.
+    int status = EXIT_FAILURE;
+    const auto compile = [&] {
+        try {
+            status = hydro_main(argc, argv);
+        }
+        catch (const CompileError& error) {
+            std::cerr << error.what() << std::endl;
+        }
+    };
+    pthread_join(start_compile_thread(compile), nullptr);
+    return status;
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <pthread.h>
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+// Stack size of every thread that parses or generates code. The passes over the tree recurse, and
+// this leaves room for the deepest tree the parser accepts (see `Parser::max_height`) in an
+// unoptimized build. Pages are only committed as the stack grows into them.
+constexpr size_t compile_stack_size = size_t { 512 } << 20;
+
+// Starts a thread with a stack of `compile_stack_size` bytes that calls `func()`, which must not
+// throw and must outlive the thread. Pair with pthread_join().
+template <typename Func>
+pthread_t start_compile_thread(const Func& func)
+{
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, compile_stack_size);
+    pthread_t thread;
+    const int error = pthread_create(
+        &thread,
+        &attr,
+        [](void* arg) -> void* {
+            (*static_cast<const Func*>(arg))();
+            return nullptr;
+        },
+        const_cast<Func*>(&func));
+    pthread_attr_destroy(&attr);
+    if (error != 0) {
+        throw std::system_error(error, std::generic_category(), "pthread_create");
+    }
+    return thread;
+}
+
+// Number of worker threads to use when the caller asked for `requested` (0 means one per core).
+inline size_t worker_count(const size_t requested)
+{
+    if (requested != 0) {
+        return requested;
+    }
+    return std::max<size_t>(std::thread::hardware_concurrency(), 1);
+}
+
+// Calls `func(i)` for every i in [0, count) on up to `threads` threads, including the calling one.
+// Work items are handed out one at a time, so uneven items balance across the threads. If any call
+// throws, no more items are started and the exception of the lowest such i is rethrown, as a
+// sequential loop would have.
+template <typename Func>
+void parallel_for(const size_t count, const size_t threads, const Func& func)
+{
+    std::atomic<size_t> next = 0;
+    std::mutex error_mutex;
+    std::exception_ptr error;
+    size_t error_index = count;
+    const auto work = [&] {
+        for (size_t i = next++; i < count; i = next++) {
+            try {
+                func(i);
+            }
+            catch (...) {
+                const std::lock_guard lock(error_mutex);
+                if (i < error_index) {
+                    error = std::current_exception();
+                    error_index = i;
+                }
+                next = count;
+            }
+        }
+    };
+    std::vector<pthread_t> workers;
+    for (size_t i = 1; i < std::min(threads, count); i++) {
+        workers.push_back(start_compile_thread(work));
+    }
+    work();
+    for (const pthread_t worker : workers) {
+        pthread_join(worker, nullptr);
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
@@ -1,6 +1,10 @@
 #pragma once
 
+#include <array>
 #include <cassert>
+#include <charconv>
+#include <unordered_map>
+#include <unordered_set>
 #include <variant>
 
 #include "arena.hpp"
@@ -16,10 +20,21 @@ struct NodeTermIdent {
 
 struct NodeExpr;
 
+struct NodeTermIndex {
+    Token ident;
+    NodeExpr* index {};
+};
+
 struct NodeTermParen {
     NodeExpr* expr;
 };
 
+struct NodeTerm;
+
+struct NodeTermNeg {
+    NodeTerm* term;
+};
+
 struct NodeBinExprAdd {
     NodeExpr* lhs;
     NodeExpr* rhs;
@@ -40,16 +55,49 @@ struct NodeBinExprDiv {
     NodeExpr* rhs;
 };
 
+struct NodeBinExprMod {
+    NodeExpr* lhs;
+    NodeExpr* rhs;
+};
+
+struct NodeBinExprEq {
+    NodeExpr* lhs;
+    NodeExpr* rhs;
+};
+
+struct NodeBinExprNe {
+    NodeExpr* lhs;
+    NodeExpr* rhs;
+};
+
 struct NodeBinExpr {
-    std::variant<NodeBinExprAdd*, NodeBinExprMulti*, NodeBinExprSub*, NodeBinExprDiv*> var;
+    std::variant<
+        NodeBinExprAdd*,
+        NodeBinExprMulti*,
+        NodeBinExprSub*,
+        NodeBinExprDiv*,
+        NodeBinExprMod*,
+        NodeBinExprEq*,
+        NodeBinExprNe*>
+        var;
 };
 
 struct NodeTerm {
-    std::variant<NodeTermIntLit*, NodeTermIdent*, NodeTermParen*> var;
+    std::variant<NodeTermIntLit*, NodeTermIdent*, NodeTermIndex*, NodeTermParen*, NodeTermNeg*> var;
+    // Set by the parser on a hash-consed term. See `Parser::share`.
+    bool pure = false;
+    // Levels of the tree from this node down, as counted by the parser. See `Parser::height_over`.
+    uint32_t height = 1;
 };
 
 struct NodeExpr {
     std::variant<NodeTerm*, NodeBinExpr*> var;
+    // Set on a hash-consed expression that the parser found more than once. Every occurrence
+    // reads the same value, so it need only be computed once. See `Parser::share`.
+    bool shared = false;
+    // Set by the parser on every hash-consed expression.
+    bool pure = false;
+    uint32_t height = 1;
 };
 
 struct NodeStmtExit {
@@ -61,6 +109,12 @@ struct NodeStmtLet {
     NodeExpr* expr {};
 };
 
+struct NodeStmtLetArray {
+    Token ident;
+    Token size;
+    bool is_static {};
+};
+
 struct NodeStmt;
 
 struct NodeScope {
@@ -94,14 +148,103 @@ struct NodeStmtAssign {
     NodeExpr* expr {};
 };
 
+struct NodeStmtAssignIndex {
+    Token ident;
+    NodeExpr* index {};
+    NodeExpr* expr {};
+};
+
 struct NodeStmt {
-    std::variant<NodeStmtExit*, NodeStmtLet*, NodeScope*, NodeStmtIf*, NodeStmtAssign*> var;
+    std::variant<
+        NodeStmtExit*,
+        NodeStmtLet*,
+        NodeStmtLetArray*,
+        NodeScope*,
+        NodeStmtIf*,
+        NodeStmtAssign*,
+        NodeStmtAssignIndex*>
+        var;
 };
 
 struct NodeProg {
     std::vector<NodeStmt*> stmts;
 };
 
+// Adds to `refs` each subexpression of an element-wise array assignment, `expr` included, that
+// refers to whole arrays, and returns whether `expr` does. `is_array` is called with each
+// identifier operand.
+template <typename IsArray>
+bool find_array_refs( // NOLINT(*-no-recursion)
+    const NodeExpr* expr,
+    const IsArray& is_array,
+    std::unordered_set<const NodeExpr*>& refs)
+{
+    bool found = false;
+    if (std::holds_alternative<NodeBinExpr*>(expr->var)) {
+        found = std::visit(
+            [&](const auto* bin) {
+                const bool lhs = find_array_refs(bin->lhs, is_array, refs);
+                const bool rhs = find_array_refs(bin->rhs, is_array, refs);
+                return lhs || rhs;
+            },
+            std::get<NodeBinExpr*>(expr->var)->var);
+    }
+    else {
+        const NodeTerm* term = std::get<NodeTerm*>(expr->var);
+        while (std::holds_alternative<NodeTermNeg*>(term->var)) {
+            term = std::get<NodeTermNeg*>(term->var)->term;
+        }
+        if (std::holds_alternative<NodeTermParen*>(term->var)) {
+            found = find_array_refs(std::get<NodeTermParen*>(term->var)->expr, is_array, refs);
+        }
+        else if (std::holds_alternative<NodeTermIdent*>(term->var)) {
+            found = is_array(std::get<NodeTermIdent*>(term->var)->ident);
+        }
+    }
+    if (found) {
+        refs.insert(expr);
+    }
+    return found;
+}
+
+template <typename OnScalar>
+void for_each_scalar_outside( // NOLINT(*-no-recursion)
+    const NodeExpr* expr,
+    const std::unordered_set<const NodeExpr*>& refs,
+    const OnScalar& on_scalar)
+{
+    if (!refs.contains(expr)) {
+        on_scalar(expr);
+        return;
+    }
+    if (std::holds_alternative<NodeBinExpr*>(expr->var)) {
+        std::visit(
+            [&](const auto* bin) {
+                for_each_scalar_outside(bin->lhs, refs, on_scalar);
+                for_each_scalar_outside(bin->rhs, refs, on_scalar);
+            },
+            std::get<NodeBinExpr*>(expr->var)->var);
+        return;
+    }
+    const NodeTerm* term = std::get<NodeTerm*>(expr->var);
+    while (std::holds_alternative<NodeTermNeg*>(term->var)) {
+        term = std::get<NodeTermNeg*>(term->var)->term;
+    }
+    if (std::holds_alternative<NodeTermParen*>(term->var)) {
+        for_each_scalar_outside(std::get<NodeTermParen*>(term->var)->expr, refs, on_scalar);
+    }
+}
+
+// Calls `on_scalar`, left to right, with each maximal subexpression of an element-wise array
+// assignment that does not refer to whole arrays. These are evaluated once before the elements.
+template <typename IsArray, typename OnScalar>
+void for_each_scalar(const NodeExpr* expr, const IsArray& is_array, const OnScalar& on_scalar)
+{
+    std::unordered_set<const NodeExpr*> refs;
+    find_array_refs(expr, is_array, refs);
+    for_each_scalar_outside(expr, refs, on_scalar);
+}
+
 class Parser {
 public:
     explicit Parser(std::vector<Token> tokens)
@@ -110,33 +253,92 @@ public:
     {
     }
 
-    void error_expected(const std::string& msg) const
+    // Pulls tokens from `tokenizer` as they are needed, keeping only `lookahead` of them buffered.
+    explicit Parser(Tokenizer& tokenizer)
+        : m_tokenizer(&tokenizer)
+        , m_allocator(1024 * 1024 * 4) // 4 mb
     {
-        std::cerr << "[Parse Error] Expected " << msg << " on line " << peek(-1).value().line << std::endl;
-        exit(EXIT_FAILURE);
+    }
+
+    [[noreturn]] void error_expected(const std::string& msg) const
+    {
+        throw CompileError("[Parse Error] Expected " + msg + " on line " + std::to_string(m_prev_line));
     }
 
     std::optional<NodeTerm*> parse_term() // NOLINT(*-no-recursion)
     {
         if (auto int_lit = try_consume(TokenType::int_lit)) {
-            auto term_int_lit = m_allocator.emplace<NodeTermIntLit>(int_lit.value());
-            auto term = m_allocator.emplace<NodeTerm>(term_int_lit);
+            const std::string& text = int_lit->value.value();
+            int64_t value;
+            if (std::from_chars(text.data(), text.data() + text.size(), value).ec != std::errc {}) {
+                throw CompileError(
+                    "[Parse Error] Integer literal out of range on line " + std::to_string(int_lit->line));
+            }
+            return share<NodeTerm>({ .kind = ShareKind::int_lit, .lhs = static_cast<uint64_t>(value) }, [&] {
+                auto term_int_lit = m_allocator.emplace<NodeTermIntLit>(int_lit.value());
+                return m_allocator.emplace<NodeTerm>(term_int_lit);
+            });
+        }
+        if (peek().has_value() && peek().value().type == TokenType::ident && peek(1).has_value()
+            && peek(1).value().type == TokenType::open_bracket) {
+            const Nested nested(*this);
+            auto term_index = m_allocator.emplace<NodeTermIndex>();
+            term_index->ident = consume();
+            consume();
+            if (const auto index = parse_expr()) {
+                term_index->index = index.value();
+            }
+            else {
+                error_expected("expression");
+            }
+            try_consume_err(TokenType::close_bracket);
+            auto term = m_allocator.emplace<NodeTerm>(term_index);
+            term->height = height_over(term_index->index->height);
             return term;
         }
         if (auto ident = try_consume(TokenType::ident)) {
-            auto expr_ident = m_allocator.emplace<NodeTermIdent>(ident.value());
-            auto term = m_allocator.emplace<NodeTerm>(expr_ident);
-            return term;
+            const std::string& name = ident->value.value();
+            return share<NodeTerm>({ .kind = ShareKind::ident, .lhs = version(name) }, [&] {
+                auto expr_ident = m_allocator.emplace<NodeTermIdent>(ident.value());
+                return m_allocator.emplace<NodeTerm>(expr_ident);
+            });
         }
         if (const auto open_paren = try_consume(TokenType::open_paren)) {
+            const Nested nested(*this);
             auto expr = parse_expr();
             if (!expr.has_value()) {
                 error_expected("expression");
             }
             try_consume_err(TokenType::close_paren);
-            auto term_paren = m_allocator.emplace<NodeTermParen>(expr.value());
-            auto term = m_allocator.emplace<NodeTerm>(term_paren);
-            return term;
+            const uint32_t height = height_over(expr.value()->height);
+            const auto make = [&] {
+                auto term_paren = m_allocator.emplace<NodeTermParen>(expr.value());
+                auto term = m_allocator.emplace<NodeTerm>(term_paren);
+                term->height = height;
+                return term;
+            };
+            if (expr.value()->pure) {
+                return share<NodeTerm>({ .kind = ShareKind::paren, .lhs = node_id(expr.value()) }, make);
+            }
+            return make();
+        }
+        if (try_consume(TokenType::minus)) {
+            const Nested nested(*this);
+            auto operand = parse_term();
+            if (!operand.has_value()) {
+                error_expected("term");
+            }
+            const uint32_t height = height_over(operand.value()->height);
+            const auto make = [&] {
+                auto term_neg = m_allocator.emplace<NodeTermNeg>(operand.value());
+                auto term = m_allocator.emplace<NodeTerm>(term_neg);
+                term->height = height;
+                return term;
+            };
+            if (operand.value()->pure) {
+                return share<NodeTerm>({ .kind = ShareKind::neg, .lhs = node_id(operand.value()) }, make);
+            }
+            return make();
         }
         return {};
     }
@@ -147,7 +349,19 @@ public:
         if (!term_lhs.has_value()) {
             return {};
         }
-        auto expr_lhs = m_allocator.emplace<NodeExpr>(term_lhs.value());
+        NodeExpr* expr_lhs;
+        const uint32_t lhs_height = height_over(term_lhs.value()->height);
+        const auto make_lhs = [&] {
+            auto expr = m_allocator.emplace<NodeExpr>(term_lhs.value());
+            expr->height = lhs_height;
+            return expr;
+        };
+        if (term_lhs.value()->pure) {
+            expr_lhs = share<NodeExpr>({ .kind = ShareKind::term, .lhs = node_id(term_lhs.value()) }, make_lhs);
+        }
+        else {
+            expr_lhs = make_lhs();
+        }
 
         while (true) {
             std::optional<Token> curr_tok = peek();
@@ -167,32 +381,47 @@ public:
             if (!expr_rhs.has_value()) {
                 error_expected("expression");
             }
-            auto expr = m_allocator.emplace<NodeBinExpr>();
-            auto expr_lhs2 = m_allocator.emplace<NodeExpr>();
-            if (type == TokenType::plus) {
-                expr_lhs2->var = expr_lhs->var;
-                auto add = m_allocator.emplace<NodeBinExprAdd>(expr_lhs2, expr_rhs.value());
-                expr->var = add;
-            }
-            else if (type == TokenType::star) {
-                expr_lhs2->var = expr_lhs->var;
-                auto multi = m_allocator.emplace<NodeBinExprMulti>(expr_lhs2, expr_rhs.value());
-                expr->var = multi;
-            }
-            else if (type == TokenType::minus) {
-                expr_lhs2->var = expr_lhs->var;
-                auto sub = m_allocator.emplace<NodeBinExprSub>(expr_lhs2, expr_rhs.value());
-                expr->var = sub;
-            }
-            else if (type == TokenType::fslash) {
-                expr_lhs2->var = expr_lhs->var;
-                auto div = m_allocator.emplace<NodeBinExprDiv>(expr_lhs2, expr_rhs.value());
-                expr->var = div;
+            // A chain of operators nests down its left operands, one level per operator.
+            const uint32_t height = height_over(std::max(expr_lhs->height, expr_rhs.value()->height));
+            const auto make = [&] {
+                auto expr = m_allocator.emplace<NodeBinExpr>();
+                if (type == TokenType::plus) {
+                    expr->var = m_allocator.emplace<NodeBinExprAdd>(expr_lhs, expr_rhs.value());
+                }
+                else if (type == TokenType::star) {
+                    expr->var = m_allocator.emplace<NodeBinExprMulti>(expr_lhs, expr_rhs.value());
+                }
+                else if (type == TokenType::minus) {
+                    expr->var = m_allocator.emplace<NodeBinExprSub>(expr_lhs, expr_rhs.value());
+                }
+                else if (type == TokenType::fslash) {
+                    expr->var = m_allocator.emplace<NodeBinExprDiv>(expr_lhs, expr_rhs.value());
+                }
+                else if (type == TokenType::percent) {
+                    expr->var = m_allocator.emplace<NodeBinExprMod>(expr_lhs, expr_rhs.value());
+                }
+                else if (type == TokenType::double_eq) {
+                    expr->var = m_allocator.emplace<NodeBinExprEq>(expr_lhs, expr_rhs.value());
+                }
+                else if (type == TokenType::bang_eq) {
+                    expr->var = m_allocator.emplace<NodeBinExprNe>(expr_lhs, expr_rhs.value());
+                }
+                else {
+                    assert(false); // Unreachable;
+                }
+                auto node = m_allocator.emplace<NodeExpr>(expr);
+                node->height = height;
+                return node;
+            };
+            if (expr_lhs->pure && expr_rhs.value()->pure) {
+                const ShareKey key {
+                    .kind = ShareKind::bin_expr, .op = type, .lhs = node_id(expr_lhs), .rhs = node_id(expr_rhs.value())
+                };
+                expr_lhs = share<NodeExpr>(key, make);
             }
             else {
-                assert(false); // Unreachable;
+                expr_lhs = make();
             }
-            expr_lhs->var = expr;
         }
         return expr_lhs;
     }
@@ -202,19 +431,27 @@ public:
         if (!try_consume(TokenType::open_curly).has_value()) {
             return {};
         }
+        const Nested nested(*this);
         auto scope = m_allocator.emplace<NodeScope>();
+        m_scope_decls.emplace_back();
         while (auto stmt = parse_stmt()) {
             scope->stmts.push_back(stmt.value());
         }
         try_consume_err(TokenType::close_curly);
+        // Uses of a name after the scope refer to a different variable than the ones in it.
+        for (const std::string& name : m_scope_decls.back()) {
+            new_version(name);
+        }
+        m_scope_decls.pop_back();
         return scope;
     }
 
     std::optional<NodeIfPred*> parse_if_pred() // NOLINT(*-no-recursion)
     {
         if (try_consume(TokenType::elif)) {
+            const Nested nested(*this);
             try_consume_err(TokenType::open_paren);
-            const auto elif = m_allocator.alloc<NodeIfPredElif>();
+            const auto elif = m_allocator.emplace<NodeIfPredElif>();
             if (const auto expr = parse_expr()) {
                 elif->expr = expr.value();
             }
@@ -233,7 +470,7 @@ public:
             return pred;
         }
         if (try_consume(TokenType::else_)) {
-            auto else_ = m_allocator.alloc<NodeIfPredElse>();
+            auto else_ = m_allocator.emplace<NodeIfPredElse>();
             if (const auto scope = parse_scope()) {
                 else_->scope = scope.value();
             }
@@ -279,13 +516,53 @@ public:
                 error_expected("expression");
             }
             try_consume_err(TokenType::semi);
+            declare(stmt_let->ident.value.value());
             auto stmt = m_allocator.emplace<NodeStmt>();
             stmt->var = stmt_let;
             return stmt;
         }
+        if ((peek().has_value() && peek().value().type == TokenType::let && peek(1).has_value()
+             && peek(1).value().type == TokenType::ident && peek(2).has_value()
+             && peek(2).value().type == TokenType::open_bracket)
+            || (peek().has_value() && peek().value().type == TokenType::static_)) {
+            auto stmt_let_array = m_allocator.emplace<NodeStmtLetArray>();
+            stmt_let_array->is_static = consume().type == TokenType::static_;
+            stmt_let_array->ident = try_consume_err(TokenType::ident);
+            try_consume_err(TokenType::open_bracket);
+            stmt_let_array->size = try_consume_err(TokenType::int_lit);
+            try_consume_err(TokenType::close_bracket);
+            try_consume_err(TokenType::semi);
+            declare(stmt_let_array->ident.value.value());
+            auto stmt = m_allocator.emplace<NodeStmt>(stmt_let_array);
+            return stmt;
+        }
+        if (peek().has_value() && peek().value().type == TokenType::ident && peek(1).has_value()
+            && peek(1).value().type == TokenType::open_bracket) {
+            const auto assign_index = m_allocator.emplace<NodeStmtAssignIndex>();
+            assign_index->ident = consume();
+            consume();
+            if (const auto index = parse_expr()) {
+                assign_index->index = index.value();
+            }
+            else {
+                error_expected("expression");
+            }
+            try_consume_err(TokenType::close_bracket);
+            try_consume_err(TokenType::eq);
+            if (const auto expr = parse_expr()) {
+                assign_index->expr = expr.value();
+            }
+            else {
+                error_expected("expression");
+            }
+            try_consume_err(TokenType::semi);
+            new_version(assign_index->ident.value.value());
+            auto stmt = m_allocator.emplace<NodeStmt>(assign_index);
+            return stmt;
+        }
         if (peek().has_value() && peek().value().type == TokenType::ident && peek(1).has_value()
             && peek(1).value().type == TokenType::eq) {
-            const auto assign = m_allocator.alloc<NodeStmtAssign>();
+            const auto assign = m_allocator.emplace<NodeStmtAssign>();
             assign->ident = consume();
             consume();
             if (const auto expr = parse_expr()) {
@@ -295,6 +572,7 @@ public:
                 error_expected("expression");
             }
             try_consume_err(TokenType::semi);
+            new_version(assign->ident.value.value());
             auto stmt = m_allocator.emplace<NodeStmt>(assign);
             return stmt;
         }
@@ -331,31 +609,196 @@ public:
     std::optional<NodeProg> parse_prog()
     {
         NodeProg prog;
-        while (peek().has_value()) {
-            if (auto stmt = parse_stmt()) {
-                prog.stmts.push_back(stmt.value());
-            }
-            else {
-                error_expected("statement");
-            }
+        while (std::optional<NodeStmt*> stmt = parse_top_stmt()) {
+            prog.stmts.push_back(stmt.value());
         }
         return prog;
     }
 
-private:
-    [[nodiscard]] std::optional<Token> peek(const int offset = 0) const
+    // Parses the next top-level statement, or returns nothing at the end of the input.
+    std::optional<NodeStmt*> parse_top_stmt()
     {
-        if (m_index + offset >= m_tokens.size()) {
+        if (!peek().has_value()) {
             return {};
         }
-        return m_tokens.at(m_index + offset);
+        if (auto stmt = parse_stmt()) {
+            return stmt;
+        }
+        error_expected("statement");
+        return {};
+    }
+
+    // Destroys every node parsed so far. Used to release top-level statements once generated.
+    void release_nodes()
+    {
+        m_allocator.reset();
+        m_shared.clear();
+    }
+
+private:
+    static constexpr size_t lookahead = 3;
+
+    enum class ShareKind : uint8_t {
+        int_lit,
+        ident,
+        paren,
+        neg,
+        term,
+        bin_expr,
+    };
+
+    // What a hash-consed node is made of: an integer literal's value, an identifier's version, or
+    // the children of any other node, with the operator of a binary expression.
+    struct ShareKey {
+        ShareKind kind;
+        TokenType op {};
+        uint64_t lhs;
+        uint64_t rhs = 0;
+
+        bool operator==(const ShareKey&) const = default;
+    };
+
+    struct ShareKeyHash {
+        size_t operator()(const ShareKey& key) const
+        {
+            uint64_t hash = (static_cast<uint64_t>(key.kind) << 8 | static_cast<uint64_t>(key.op)) ^ key.lhs;
+            hash = (hash ^ hash >> 31) * 0x9e3779b97f4a7c15;
+            hash = (hash ^ key.rhs) * 0xbf58476d1ce4e5b9;
+            return hash ^ hash >> 29;
+        }
+    };
+
+    // Hash-consing of pure expressions, those without array elements. An identifier is keyed by
+    // the version of its name, which changes at every assignment and declaration, so equal keys
+    // mean equal values. `make` allocates the node the first time its key is seen.
+    template <typename Node, typename Make>
+    Node* share(const ShareKey& key, const Make& make)
+    {
+        const auto [it, inserted] = m_shared.try_emplace(key);
+        if (inserted) {
+            Node* node = make();
+            node->pure = true;
+            it->second = node;
+        }
+        else if constexpr (std::is_same_v<Node, NodeExpr>) {
+            static_cast<NodeExpr*>(it->second)->shared = true;
+        }
+        return static_cast<Node*>(it->second);
+    }
+
+    static uint64_t node_id(const void* node)
+    {
+        return reinterpret_cast<uintptr_t>(node);
+    }
+
+    // The current version of `name`. Versions are unique across names, so a name used before it
+    // is declared gets one of its own.
+    uint64_t version(const std::string& name)
+    {
+        size_t& version = m_versions[name];
+        if (version == 0) {
+            version = ++m_version_count;
+        }
+        return version;
+    }
+
+    // Gives `name` a new version. The old one can no longer be parsed, so its node and the
+    // expression wrapping it are dropped from the table; the nodes already built on them keep them.
+    void new_version(const std::string& name)
+    {
+        size_t& version = m_versions[name];
+        if (const auto it = m_shared.find({ .kind = ShareKind::ident, .lhs = version }); it != m_shared.end()) {
+            m_shared.erase({ .kind = ShareKind::term, .lhs = node_id(it->second) });
+            m_shared.erase(it);
+        }
+        version = ++m_version_count;
+    }
+
+    void declare(const std::string& name)
+    {
+        new_version(name);
+        if (!m_scope_decls.empty()) {
+            m_scope_decls.back().push_back(name);
+        }
+    }
+
+    [[nodiscard]] std::optional<Token> peek(const size_t offset = 0)
+    {
+        assert(offset < lookahead);
+        while (m_ahead_count <= offset) {
+            std::optional<Token> token = next_token();
+            if (!token.has_value()) {
+                return {};
+            }
+            m_ahead[(m_ahead_head + m_ahead_count++) % lookahead] = std::move(token.value());
+        }
+        return m_ahead[(m_ahead_head + offset) % lookahead];
     }
 
     Token consume()
     {
-        return m_tokens.at(m_index++);
+        (void)peek();
+        Token token = std::move(m_ahead[m_ahead_head]);
+        m_ahead_head = (m_ahead_head + 1) % lookahead;
+        m_ahead_count--;
+        m_prev_line = token.line;
+        return token;
+    }
+
+    std::optional<Token> next_token()
+    {
+        if (m_tokenizer != nullptr) {
+            return m_tokenizer->next();
+        }
+        if (m_index >= m_tokens.size()) {
+            return {};
+        }
+        return std::move(m_tokens[m_index++]);
+    }
+
+    // Bounds how deeply terms, scopes and elifs nest, which the parser itself recurses over.
+    static constexpr size_t max_depth = 1000;
+    // Bounds the height of an expression tree. The parser reads a chain of operators in a loop, but
+    // later passes recurse down its left operands, so this bounds the stack they need.
+    static constexpr uint32_t max_height = 100'000;
+
+    // Height of a node whose tallest child has height `child_height`.
+    [[nodiscard]] uint32_t height_over(const uint32_t child_height) const
+    {
+        if (child_height >= max_height) {
+            throw CompileError("[Parse Error] Expression too deep on line " + std::to_string(m_prev_line));
+        }
+        return child_height + 1;
+    }
+
+    void nest()
+    {
+        if (++m_depth > max_depth) {
+            throw CompileError("[Parse Error] Nesting too deep on line " + std::to_string(m_prev_line));
+        }
     }
 
+    // One level of nesting for as long as it is alive.
+    class Nested {
+    public:
+        explicit Nested(Parser& parser)
+            : m_parser(parser)
+        {
+            m_parser.nest();
+        }
+
+        Nested(const Nested&) = delete;
+        Nested& operator=(const Nested&) = delete;
+
+        ~Nested()
+        {
+            m_parser.m_depth--;
+        }
+
+    private:
+        Parser& m_parser;
+    };
+
     Token try_consume_err(const TokenType type)
     {
         if (peek().has_value() && peek().value().type == type) {
@@ -373,7 +816,17 @@ private:
         return {};
     }
 
-    const std::vector<Token> m_tokens;
+    std::vector<Token> m_tokens {};
     size_t m_index = 0;
+    Tokenizer* m_tokenizer = nullptr;
+    std::array<Token, lookahead> m_ahead {};
+    size_t m_ahead_head = 0;
+    size_t m_ahead_count = 0;
+    int m_prev_line = 1;
+    size_t m_depth = 0;
     ArenaAllocator m_allocator;
+    std::unordered_map<ShareKey, void*, ShareKeyHash> m_shared {};
+    std::unordered_map<std::string, size_t> m_versions {};
+    size_t m_version_count = 0;
+    std::vector<std::vector<std::string>> m_scope_decls {};
 };
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string_view>
+#include <unordered_map>
+
+#include "parser.hpp"
+
+// Branch counters of a program built with `--instrument`, which writes them to `profile_path`
+// when it exits. Each if statement owns a run of counters: how often it ran, then how often each
+// of its arms (the if, every elif, and the else if there is one) was taken. The file is
+// `profile_magic`, the number of counters as a little-endian u64, then the counters.
+constexpr std::string_view profile_magic = "HYPROF01";
+constexpr std::string_view profile_path = "out.prof";
+
+// Where each if statement's counters start. Ifs are numbered in program order with nested ones
+// after their parent, which depends only on the source, so a profile fits any build of it.
+class ProfileLayout {
+public:
+    // Numbers the ifs of a top-level statement, after those of the statements added before it.
+    void add(const NodeStmt* stmt) // NOLINT(*-no-recursion)
+    {
+        if (std::holds_alternative<NodeScope*>(stmt->var)) {
+            add_scope(std::get<NodeScope*>(stmt->var));
+            return;
+        }
+        if (!std::holds_alternative<NodeStmtIf*>(stmt->var)) {
+            return;
+        }
+        const NodeStmtIf* stmt_if = std::get<NodeStmtIf*>(stmt->var);
+        m_first.emplace(stmt_if, m_size);
+        m_size += 2;
+        add_scope(stmt_if->scope);
+        for (std::optional<NodeIfPred*> pred = stmt_if->pred; pred.has_value();) {
+            m_size++;
+            if (const auto* else_ = std::get_if<NodeIfPredElse*>(&pred.value()->var)) {
+                add_scope((*else_)->scope);
+                break;
+            }
+            const NodeIfPredElif* elif = std::get<NodeIfPredElif*>(pred.value()->var);
+            add_scope(elif->scope);
+            pred = elif->pred;
+        }
+    }
+
+    // The counter of how often `stmt_if` ran. Its arms' counters follow in order.
+    [[nodiscard]] size_t first_counter(const NodeStmtIf* stmt_if) const
+    {
+        return m_first.at(stmt_if);
+    }
+
+    [[nodiscard]] size_t size() const
+    {
+        return m_size;
+    }
+
+private:
+    void add_scope(const NodeScope* scope) // NOLINT(*-no-recursion)
+    {
+        for (const NodeStmt* stmt : scope->stmts) {
+            add(stmt);
+        }
+    }
+
+    std::unordered_map<const NodeStmtIf*, size_t> m_first;
+    size_t m_size = 0;
+};
+
+class Profile {
+public:
+    explicit Profile(const std::string& path)
+    {
+        std::string contents;
+        {
+            std::ifstream file(path, std::ios::binary);
+            if (!file) {
+                throw CompileError("[Profile] Cannot open " + path);
+            }
+            std::stringstream contents_stream;
+            contents_stream << file.rdbuf();
+            contents = contents_stream.str();
+        }
+        const size_t header_size = profile_magic.size() + sizeof(uint64_t);
+        uint64_t count = 0;
+        if (contents.size() >= header_size) {
+            std::memcpy(&count, contents.data() + profile_magic.size(), sizeof(count));
+        }
+        if (contents.size() < header_size || !contents.starts_with(profile_magic)
+            || count != (contents.size() - header_size) / sizeof(uint64_t)
+            || (contents.size() - header_size) % sizeof(uint64_t) != 0) {
+            throw CompileError("[Profile] Corrupt or truncated file " + path);
+        }
+        m_counts.resize(count);
+        std::memcpy(m_counts.data(), contents.data() + header_size, count * sizeof(uint64_t));
+    }
+
+    // Stops compilation if the profile was not recorded from a program with this layout.
+    void check(const ProfileLayout& layout) const
+    {
+        if (layout.size() != m_counts.size()) {
+            throw CompileError("[Profile] The profile was recorded from a different program");
+        }
+    }
+
+    [[nodiscard]] uint64_t count(const size_t counter) const
+    {
+        if (counter >= m_counts.size()) {
+            throw CompileError("[Profile] The profile was recorded from a different program");
+        }
+        return m_counts[counter];
+    }
+
+private:
+    std::vector<uint64_t> m_counts;
+};
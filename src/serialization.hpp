@@ -0,0 +1,658 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <fstream>
+#include <string_view>
+#include <unordered_map>
+
+#include "parser.hpp"
+
+// A parsed program saved by `--emit-ast`, which hydro accepts in place of source. The file is
+// `ast_magic`, the format version and the record count as little-endian u32 and u64, then one
+// record per node. Records come children first, so each reference is the distance back to the
+// referenced record, and a shared (hash-consed) expression is written once. A record is a tag byte
+// followed by its fields: LEB128 integers, and tokens as their line and the length and bytes of
+// their text. The last record is the program.
+constexpr std::string_view ast_magic = "HYDROAST";
+// Bump on any change to the record layout.
+constexpr uint32_t ast_version = 1;
+
+enum class AstRecord : uint8_t {
+    int_lit,
+    ident,
+    index,
+    paren,
+    neg,
+    term_expr,
+    add,
+    multi,
+    sub,
+    div,
+    mod,
+    eq,
+    ne,
+    exit,
+    let,
+    let_array,
+    scope_stmt,
+    if_,
+    assign,
+    assign_index,
+    scope,
+    elif,
+    else_,
+    prog,
+};
+
+// Set in the tag byte of an expression record with `NodeExpr::shared`.
+constexpr uint8_t ast_shared_flag = 0x80;
+
+class AstWriter {
+public:
+    // The serialized form of `prog`.
+    [[nodiscard]] static std::string write(const NodeProg& prog)
+    {
+        AstWriter writer;
+        std::vector<size_t> stmts;
+        for (const NodeStmt* stmt : prog.stmts) {
+            stmts.push_back(writer.write_stmt(stmt));
+        }
+        const size_t index = writer.begin_record(AstRecord::prog);
+        writer.put_varint(stmts.size());
+        for (const size_t stmt : stmts) {
+            writer.put_ref(index, stmt);
+        }
+
+        std::string output(ast_magic);
+        for (int i = 0; i < 4; i++) {
+            output.push_back(static_cast<char>(ast_version >> (i * 8)));
+        }
+        for (int i = 0; i < 8; i++) {
+            output.push_back(static_cast<char>(static_cast<uint64_t>(writer.m_count) >> (i * 8)));
+        }
+        return output + writer.m_body;
+    }
+
+private:
+    size_t write_term(const NodeTerm* term) // NOLINT(*-no-recursion)
+    {
+        if (const auto it = m_records.find(term); it != m_records.end()) {
+            return it->second;
+        }
+        struct TermVisitor {
+            AstWriter& writer;
+
+            size_t operator()(const NodeTermIntLit* term_int_lit) const
+            {
+                const size_t index = writer.begin_record(AstRecord::int_lit);
+                writer.put_token(term_int_lit->int_lit);
+                return index;
+            }
+
+            size_t operator()(const NodeTermIdent* term_ident) const
+            {
+                const size_t index = writer.begin_record(AstRecord::ident);
+                writer.put_token(term_ident->ident);
+                return index;
+            }
+
+            size_t operator()(const NodeTermIndex* term_index) const
+            {
+                const size_t expr = writer.write_expr(term_index->index);
+                const size_t index = writer.begin_record(AstRecord::index);
+                writer.put_token(term_index->ident);
+                writer.put_ref(index, expr);
+                return index;
+            }
+
+            size_t operator()(const NodeTermParen* term_paren) const
+            {
+                const size_t expr = writer.write_expr(term_paren->expr);
+                const size_t index = writer.begin_record(AstRecord::paren);
+                writer.put_ref(index, expr);
+                return index;
+            }
+
+            size_t operator()(const NodeTermNeg* term_neg) const
+            {
+                const size_t operand = writer.write_term(term_neg->term);
+                const size_t index = writer.begin_record(AstRecord::neg);
+                writer.put_ref(index, operand);
+                return index;
+            }
+        };
+        const size_t index = std::visit(TermVisitor { .writer = *this }, term->var);
+        m_records.emplace(term, index);
+        return index;
+    }
+
+    static AstRecord bin_tag(const NodeBinExprAdd*)
+    {
+        return AstRecord::add;
+    }
+
+    static AstRecord bin_tag(const NodeBinExprMulti*)
+    {
+        return AstRecord::multi;
+    }
+
+    static AstRecord bin_tag(const NodeBinExprSub*)
+    {
+        return AstRecord::sub;
+    }
+
+    static AstRecord bin_tag(const NodeBinExprDiv*)
+    {
+        return AstRecord::div;
+    }
+
+    static AstRecord bin_tag(const NodeBinExprMod*)
+    {
+        return AstRecord::mod;
+    }
+
+    static AstRecord bin_tag(const NodeBinExprEq*)
+    {
+        return AstRecord::eq;
+    }
+
+    static AstRecord bin_tag(const NodeBinExprNe*)
+    {
+        return AstRecord::ne;
+    }
+
+    size_t write_expr(const NodeExpr* expr) // NOLINT(*-no-recursion)
+    {
+        if (const auto it = m_records.find(expr); it != m_records.end()) {
+            return it->second;
+        }
+        size_t index;
+        if (std::holds_alternative<NodeTerm*>(expr->var)) {
+            const size_t term = write_term(std::get<NodeTerm*>(expr->var));
+            index = begin_record(AstRecord::term_expr, expr->shared);
+            put_ref(index, term);
+        }
+        else {
+            index = std::visit(
+                [&](const auto* bin) {
+                    const size_t lhs = write_expr(bin->lhs);
+                    const size_t rhs = write_expr(bin->rhs);
+                    const size_t bin_index = begin_record(bin_tag(bin), expr->shared);
+                    put_ref(bin_index, lhs);
+                    put_ref(bin_index, rhs);
+                    return bin_index;
+                },
+                std::get<NodeBinExpr*>(expr->var)->var);
+        }
+        m_records.emplace(expr, index);
+        return index;
+    }
+
+    size_t write_scope(const NodeScope* scope) // NOLINT(*-no-recursion)
+    {
+        std::vector<size_t> stmts;
+        for (const NodeStmt* stmt : scope->stmts) {
+            stmts.push_back(write_stmt(stmt));
+        }
+        const size_t index = begin_record(AstRecord::scope);
+        put_varint(stmts.size());
+        for (const size_t stmt : stmts) {
+            put_ref(index, stmt);
+        }
+        return index;
+    }
+
+    size_t write_pred(const NodeIfPred* pred) // NOLINT(*-no-recursion)
+    {
+        if (std::holds_alternative<NodeIfPredElse*>(pred->var)) {
+            const size_t scope = write_scope(std::get<NodeIfPredElse*>(pred->var)->scope);
+            const size_t index = begin_record(AstRecord::else_);
+            put_ref(index, scope);
+            return index;
+        }
+        const NodeIfPredElif* elif = std::get<NodeIfPredElif*>(pred->var);
+        const size_t expr = write_expr(elif->expr);
+        const size_t scope = write_scope(elif->scope);
+        const std::optional<size_t> next
+            = elif->pred.has_value() ? write_pred(elif->pred.value()) : std::optional<size_t> {};
+        const size_t index = begin_record(AstRecord::elif);
+        put_ref(index, expr);
+        put_ref(index, scope);
+        put_ref(index, next);
+        return index;
+    }
+
+    size_t write_stmt(const NodeStmt* stmt) // NOLINT(*-no-recursion)
+    {
+        struct StmtVisitor {
+            AstWriter& writer;
+
+            size_t operator()(const NodeStmtExit* stmt_exit) const
+            {
+                const size_t expr = writer.write_expr(stmt_exit->expr);
+                const size_t index = writer.begin_record(AstRecord::exit);
+                writer.put_ref(index, expr);
+                return index;
+            }
+
+            size_t operator()(const NodeStmtLet* stmt_let) const
+            {
+                const size_t expr = writer.write_expr(stmt_let->expr);
+                const size_t index = writer.begin_record(AstRecord::let);
+                writer.put_token(stmt_let->ident);
+                writer.put_ref(index, expr);
+                return index;
+            }
+
+            size_t operator()(const NodeStmtLetArray* stmt_let_array) const
+            {
+                const size_t index = writer.begin_record(AstRecord::let_array);
+                writer.put_token(stmt_let_array->ident);
+                writer.put_token(stmt_let_array->size);
+                writer.put_varint(stmt_let_array->is_static ? 1 : 0);
+                return index;
+            }
+
+            size_t operator()(const NodeScope* scope) const
+            {
+                const size_t scope_index = writer.write_scope(scope);
+                const size_t index = writer.begin_record(AstRecord::scope_stmt);
+                writer.put_ref(index, scope_index);
+                return index;
+            }
+
+            size_t operator()(const NodeStmtIf* stmt_if) const
+            {
+                const size_t expr = writer.write_expr(stmt_if->expr);
+                const size_t scope = writer.write_scope(stmt_if->scope);
+                const std::optional<size_t> pred
+                    = stmt_if->pred.has_value() ? writer.write_pred(stmt_if->pred.value()) : std::optional<size_t> {};
+                const size_t index = writer.begin_record(AstRecord::if_);
+                writer.put_ref(index, expr);
+                writer.put_ref(index, scope);
+                writer.put_ref(index, pred);
+                return index;
+            }
+
+            size_t operator()(const NodeStmtAssign* stmt_assign) const
+            {
+                const size_t expr = writer.write_expr(stmt_assign->expr);
+                const size_t index = writer.begin_record(AstRecord::assign);
+                writer.put_token(stmt_assign->ident);
+                writer.put_ref(index, expr);
+                return index;
+            }
+
+            size_t operator()(const NodeStmtAssignIndex* stmt_assign_index) const
+            {
+                const size_t elem = writer.write_expr(stmt_assign_index->index);
+                const size_t expr = writer.write_expr(stmt_assign_index->expr);
+                const size_t index = writer.begin_record(AstRecord::assign_index);
+                writer.put_token(stmt_assign_index->ident);
+                writer.put_ref(index, elem);
+                writer.put_ref(index, expr);
+                return index;
+            }
+        };
+        return std::visit(StmtVisitor { .writer = *this }, stmt->var);
+    }
+
+    size_t begin_record(const AstRecord tag, const bool shared = false)
+    {
+        m_body.push_back(static_cast<char>(static_cast<uint8_t>(tag) | (shared ? ast_shared_flag : 0)));
+        return m_count++;
+    }
+
+    void put_varint(uint64_t value)
+    {
+        while (value >= 0x80) {
+            m_body.push_back(static_cast<char>((value & 0x7f) | 0x80));
+            value >>= 7;
+        }
+        m_body.push_back(static_cast<char>(value));
+    }
+
+    void put_token(const Token& token)
+    {
+        put_varint(static_cast<uint64_t>(token.line));
+        put_varint(token.value.value().size());
+        m_body += token.value.value();
+    }
+
+    // A reference from record `index` to the earlier record `target`; 0 stands for none.
+    void put_ref(const size_t index, const std::optional<size_t> target)
+    {
+        put_varint(target.has_value() ? index - target.value() : 0);
+    }
+
+    std::string m_body;
+    size_t m_count = 0;
+    std::unordered_map<const void*, size_t> m_records;
+};
+
+// A program loaded from a file written by `AstWriter`. The nodes live as long as the `AstFile`.
+class AstFile {
+public:
+    explicit AstFile(const std::string& path)
+        : m_allocator(arena_size(path))
+    {
+        const int fd = open(path.c_str(), O_RDONLY);
+        struct stat info {};
+        if (fd < 0 || fstat(fd, &info) != 0) {
+            std::cerr << "[AST] Failed to open " << path << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        const auto size = static_cast<size_t>(info.st_size);
+        void* data = size == 0 ? MAP_FAILED : mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED) {
+            corrupt();
+        }
+        m_data = static_cast<const uint8_t*>(data);
+        m_size = size;
+        read();
+        munmap(data, size);
+        m_data = nullptr;
+    }
+
+    AstFile(const AstFile&) = delete;
+    AstFile& operator=(const AstFile&) = delete;
+
+    [[nodiscard]] const NodeProg& prog() const
+    {
+        return m_prog;
+    }
+
+    // Whether the file at `path` starts like a serialized program rather than source.
+    static bool is_ast(const std::string& path)
+    {
+        std::ifstream input(path, std::ios::binary);
+        std::string magic(ast_magic.size(), '\0');
+        input.read(magic.data(), static_cast<std::streamsize>(magic.size()));
+        return input && magic == ast_magic;
+    }
+
+private:
+    static constexpr size_t header_size = ast_magic.size() + 4 + 8;
+    // More than the nodes of any one record take up in the arena.
+    static constexpr size_t arena_bytes_per_record = 256;
+
+    enum class Kind {
+        term,
+        expr,
+        stmt,
+        scope,
+        pred,
+        prog,
+    };
+
+    static size_t arena_size(const std::string& path)
+    {
+        std::ifstream input(path, std::ios::binary);
+        std::string header(header_size, '\0');
+        input.read(header.data(), static_cast<std::streamsize>(header.size()));
+        if (!input || !header.starts_with(ast_magic)) {
+            corrupt();
+        }
+        uint32_t version = 0;
+        for (size_t i = 0; i < 4; i++) {
+            version |= static_cast<uint32_t>(static_cast<uint8_t>(header[ast_magic.size() + i])) << (i * 8);
+        }
+        if (version != ast_version) {
+            std::cerr << "[AST] Unsupported version " << version << " (expected " << ast_version << ")" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        uint64_t count = 0;
+        for (size_t i = 0; i < 8; i++) {
+            count |= static_cast<uint64_t>(static_cast<uint8_t>(header[ast_magic.size() + 4 + i])) << (i * 8);
+        }
+        // Every record takes at least two bytes, which bounds the count of an intact file.
+        input.seekg(0, std::ios::end);
+        if (count == 0 || count > static_cast<uint64_t>(input.tellg()) / 2) {
+            corrupt();
+        }
+        return count * arena_bytes_per_record;
+    }
+
+    [[noreturn]] static void corrupt()
+    {
+        std::cerr << "[AST] Corrupt or truncated file" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    void read()
+    {
+        m_pos = header_size;
+        size_t count = 0;
+        for (size_t i = 0; i < 8; i++) {
+            count |= static_cast<size_t>(m_data[ast_magic.size() + 4 + i]) << (i * 8);
+        }
+        m_nodes.reserve(count);
+        for (size_t index = 0; index < count; index++) {
+            const uint8_t byte = get_byte();
+            const bool shared = (byte & ast_shared_flag) != 0;
+            switch (static_cast<AstRecord>(byte & ~ast_shared_flag)) {
+            case AstRecord::int_lit:
+                add_term(m_allocator.emplace<NodeTermIntLit>(get_token(TokenType::int_lit)));
+                break;
+            case AstRecord::ident:
+                add_term(m_allocator.emplace<NodeTermIdent>(get_token(TokenType::ident)));
+                break;
+            case AstRecord::index: {
+                Token ident = get_token(TokenType::ident);
+                add_term(m_allocator.emplace<NodeTermIndex>(std::move(ident), get_ref<NodeExpr>(Kind::expr)));
+                break;
+            }
+            case AstRecord::paren:
+                add_term(m_allocator.emplace<NodeTermParen>(get_ref<NodeExpr>(Kind::expr)));
+                break;
+            case AstRecord::neg:
+                add_term(m_allocator.emplace<NodeTermNeg>(get_ref<NodeTerm>(Kind::term)));
+                break;
+            case AstRecord::term_expr:
+                add(Kind::expr, m_allocator.emplace<NodeExpr>(get_ref<NodeTerm>(Kind::term), shared));
+                break;
+            case AstRecord::add:
+                add_bin_expr<NodeBinExprAdd>(shared);
+                break;
+            case AstRecord::multi:
+                add_bin_expr<NodeBinExprMulti>(shared);
+                break;
+            case AstRecord::sub:
+                add_bin_expr<NodeBinExprSub>(shared);
+                break;
+            case AstRecord::div:
+                add_bin_expr<NodeBinExprDiv>(shared);
+                break;
+            case AstRecord::mod:
+                add_bin_expr<NodeBinExprMod>(shared);
+                break;
+            case AstRecord::eq:
+                add_bin_expr<NodeBinExprEq>(shared);
+                break;
+            case AstRecord::ne:
+                add_bin_expr<NodeBinExprNe>(shared);
+                break;
+            case AstRecord::exit:
+                add_stmt(m_allocator.emplace<NodeStmtExit>(get_ref<NodeExpr>(Kind::expr)));
+                break;
+            case AstRecord::let: {
+                Token ident = get_token(TokenType::ident);
+                add_stmt(m_allocator.emplace<NodeStmtLet>(std::move(ident), get_ref<NodeExpr>(Kind::expr)));
+                break;
+            }
+            case AstRecord::let_array: {
+                Token ident = get_token(TokenType::ident);
+                Token size = get_token(TokenType::int_lit);
+                const bool is_static = get_varint() != 0;
+                add_stmt(m_allocator.emplace<NodeStmtLetArray>(std::move(ident), std::move(size), is_static));
+                break;
+            }
+            case AstRecord::scope_stmt:
+                add_stmt(get_ref<NodeScope>(Kind::scope));
+                break;
+            case AstRecord::if_: {
+                auto stmt_if = m_allocator.emplace<NodeStmtIf>();
+                stmt_if->expr = get_ref<NodeExpr>(Kind::expr);
+                stmt_if->scope = get_ref<NodeScope>(Kind::scope);
+                stmt_if->pred = get_optional_ref<NodeIfPred>(Kind::pred);
+                add_stmt(stmt_if);
+                break;
+            }
+            case AstRecord::assign: {
+                Token ident = get_token(TokenType::ident);
+                add_stmt(m_allocator.emplace<NodeStmtAssign>(std::move(ident), get_ref<NodeExpr>(Kind::expr)));
+                break;
+            }
+            case AstRecord::assign_index: {
+                auto assign_index = m_allocator.emplace<NodeStmtAssignIndex>();
+                assign_index->ident = get_token(TokenType::ident);
+                assign_index->index = get_ref<NodeExpr>(Kind::expr);
+                assign_index->expr = get_ref<NodeExpr>(Kind::expr);
+                add_stmt(assign_index);
+                break;
+            }
+            case AstRecord::scope: {
+                auto scope = m_allocator.emplace<NodeScope>();
+                scope->stmts = get_stmts();
+                add(Kind::scope, scope);
+                break;
+            }
+            case AstRecord::elif: {
+                auto elif = m_allocator.emplace<NodeIfPredElif>();
+                elif->expr = get_ref<NodeExpr>(Kind::expr);
+                elif->scope = get_ref<NodeScope>(Kind::scope);
+                elif->pred = get_optional_ref<NodeIfPred>(Kind::pred);
+                add(Kind::pred, m_allocator.emplace<NodeIfPred>(elif));
+                break;
+            }
+            case AstRecord::else_:
+                add(Kind::pred,
+                    m_allocator.emplace<NodeIfPred>(
+                        m_allocator.emplace<NodeIfPredElse>(get_ref<NodeScope>(Kind::scope))));
+                break;
+            case AstRecord::prog:
+                if (index != count - 1) {
+                    corrupt();
+                }
+                m_prog.stmts = get_stmts();
+                add(Kind::prog, &m_prog);
+                break;
+            default:
+                corrupt();
+            }
+        }
+        if (m_pos != m_size || m_nodes.empty() || m_nodes.back().first != Kind::prog) {
+            corrupt();
+        }
+    }
+
+    template <typename BinExpr>
+    void add_bin_expr(const bool shared)
+    {
+        NodeExpr* lhs = get_ref<NodeExpr>(Kind::expr);
+        NodeExpr* rhs = get_ref<NodeExpr>(Kind::expr);
+        auto bin_expr = m_allocator.emplace<NodeBinExpr>(m_allocator.emplace<BinExpr>(lhs, rhs));
+        add(Kind::expr, m_allocator.emplace<NodeExpr>(bin_expr, shared));
+    }
+
+    void add_term(auto* term)
+    {
+        add(Kind::term, m_allocator.emplace<NodeTerm>(term));
+    }
+
+    void add_stmt(auto* stmt)
+    {
+        add(Kind::stmt, m_allocator.emplace<NodeStmt>(stmt));
+    }
+
+    void add(const Kind kind, void* node)
+    {
+        m_nodes.emplace_back(kind, node);
+    }
+
+    std::vector<NodeStmt*> get_stmts()
+    {
+        const uint64_t count = get_varint();
+        if (count > m_nodes.size()) {
+            corrupt();
+        }
+        std::vector<NodeStmt*> stmts;
+        stmts.reserve(count);
+        for (uint64_t i = 0; i < count; i++) {
+            stmts.push_back(get_ref<NodeStmt>(Kind::stmt));
+        }
+        return stmts;
+    }
+
+    template <typename Node>
+    std::optional<Node*> get_optional_ref(const Kind kind)
+    {
+        const uint64_t distance = get_varint();
+        if (distance == 0) {
+            return {};
+        }
+        return ref<Node>(distance, kind);
+    }
+
+    template <typename Node>
+    Node* get_ref(const Kind kind)
+    {
+        return ref<Node>(get_varint(), kind);
+    }
+
+    // The node `distance` records before the one being read, which must be of the given kind.
+    template <typename Node>
+    Node* ref(const uint64_t distance, const Kind kind)
+    {
+        if (distance == 0 || distance > m_nodes.size() || m_nodes[m_nodes.size() - distance].first != kind) {
+            corrupt();
+        }
+        return static_cast<Node*>(m_nodes[m_nodes.size() - distance].second);
+    }
+
+    Token get_token(const TokenType type)
+    {
+        const auto line = get_varint();
+        const auto length = get_varint();
+        if (line > INT32_MAX || length > m_size - m_pos) {
+            corrupt();
+        }
+        std::string value(reinterpret_cast<const char*>(m_data + m_pos), length);
+        m_pos += length;
+        return { .type = type, .line = static_cast<int>(line), .value = std::move(value) };
+    }
+
+    uint64_t get_varint()
+    {
+        uint64_t value = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            const uint8_t byte = get_byte();
+            value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+            if ((byte & 0x80) == 0) {
+                return value;
+            }
+        }
+        corrupt();
+    }
+
+    uint8_t get_byte()
+    {
+        if (m_pos >= m_size) {
+            corrupt();
+        }
+        return m_data[m_pos++];
+    }
+
+    ArenaAllocator m_allocator;
+    NodeProg m_prog;
+    const uint8_t* m_data = nullptr;
+    size_t m_size = 0;
+    size_t m_pos = 0;
+    std::vector<std::pair<Kind, void*>> m_nodes {};
+};
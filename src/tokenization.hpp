@@ -1,8 +1,16 @@
 #pragma once
 
+#include <algorithm>
+#include <cassert>
+#include <iostream>
+#include <optional>
 #include <string>
+#include <string_view>
 #include <vector>
 
+#include "error.hpp"
+#include "parallel.hpp"
+
 enum class TokenType {
     exit,
     int_lit,
@@ -16,8 +24,14 @@ enum class TokenType {
     star,
     minus,
     fslash,
+    percent,
+    double_eq,
+    bang_eq,
     open_curly,
     close_curly,
+    open_bracket,
+    close_bracket,
+    static_,
     if_,
     elif,
     else_,
@@ -50,10 +64,22 @@ inline std::string to_string(const TokenType type)
         return "`-`";
     case TokenType::fslash:
         return "`/`";
+    case TokenType::percent:
+        return "`%`";
+    case TokenType::double_eq:
+        return "`==`";
+    case TokenType::bang_eq:
+        return "`!=`";
     case TokenType::open_curly:
         return "`{`";
     case TokenType::close_curly:
         return "`}`";
+    case TokenType::open_bracket:
+        return "`[`";
+    case TokenType::close_bracket:
+        return "`]`";
+    case TokenType::static_:
+        return "`static`";
     case TokenType::if_:
         return "`if`";
     case TokenType::elif:
@@ -67,12 +93,16 @@ inline std::string to_string(const TokenType type)
 inline std::optional<int> bin_prec(const TokenType type)
 {
     switch (type) {
+    case TokenType::double_eq:
+    case TokenType::bang_eq:
+        return 0;
     case TokenType::minus:
     case TokenType::plus:
-        return 0;
+        return 1;
     case TokenType::fslash:
     case TokenType::star:
-        return 1;
+    case TokenType::percent:
+        return 2;
     default:
         return {};
     }
@@ -88,14 +118,69 @@ class Tokenizer {
 public:
     explicit Tokenizer(std::string src)
         : m_src(std::move(src))
+        , m_view(m_src)
+    {
+    }
+
+    // Reads the source from `input` in fixed-size chunks as tokens are requested, so that only the
+    // unscanned part of the current chunk is held in memory.
+    explicit Tokenizer(std::istream& input)
+        : m_input(&input)
     {
     }
 
     std::vector<Token> tokenize()
     {
         std::vector<Token> tokens;
+        while (std::optional<Token> token = next()) {
+            tokens.push_back(std::move(token.value()));
+        }
+        return tokens;
+    }
+
+    // Same tokens as tokenize(), lexed on up to `threads` threads. The source is split after
+    // newlines outside comments, so no token or comment straddles two chunks. A chunk counts its
+    // own lines, and the counts of the chunks before it are added afterwards.
+    std::vector<Token> tokenize_parallel(const size_t threads)
+    {
+        const std::string_view src = std::string_view(m_view).substr(m_index);
+        const size_t chunk_count = std::min(threads * 4, src.size() / min_parallel_chunk);
+        if (threads <= 1 || chunk_count <= 1) {
+            return tokenize();
+        }
+        const std::vector<size_t> starts = split_points(src, chunk_count);
+        std::vector<std::vector<Token>> chunk_tokens(starts.size());
+        std::vector<int> chunk_lines(starts.size());
+        parallel_for(starts.size(), threads, [&](const size_t i) {
+            const size_t end = i + 1 < starts.size() ? starts[i + 1] : src.size();
+            Tokenizer chunk { std::string() };
+            chunk.m_view = src.substr(starts[i], end - starts[i]);
+            chunk_tokens[i] = chunk.tokenize();
+            chunk_lines[i] = chunk.m_line - 1;
+        });
+        size_t total = 0;
+        std::vector<int> first_lines(starts.size());
+        for (size_t i = 0; i < starts.size(); i++) {
+            first_lines[i] = (i == 0 ? m_line : first_lines[i - 1] + chunk_lines[i - 1]);
+            total += chunk_tokens[i].size();
+        }
+        std::vector<Token> tokens;
+        tokens.reserve(total);
+        for (size_t i = 0; i < starts.size(); i++) {
+            for (Token& token : chunk_tokens[i]) {
+                token.line += first_lines[i] - 1;
+                tokens.push_back(std::move(token));
+            }
+        }
+        m_index = m_view.size();
+        m_line = first_lines.back() + chunk_lines.back();
+        return tokens;
+    }
+
+    // Scans the next token, pulling more input from the stream if there is one.
+    std::optional<Token> next()
+    {
         std::string buf;
-        int line_count = 1;
         while (peek().has_value()) {
             if (std::isalpha(peek().value())) {
                 buf.push_back(consume());
@@ -103,28 +188,25 @@ public:
                     buf.push_back(consume());
                 }
                 if (buf == "exit") {
-                    tokens.push_back({ TokenType::exit, line_count });
-                    buf.clear();
+                    return Token { TokenType::exit, m_line };
                 }
                 else if (buf == "let") {
-                    tokens.push_back({ TokenType::let, line_count });
-                    buf.clear();
+                    return Token { TokenType::let, m_line };
+                }
+                else if (buf == "static") {
+                    return Token { TokenType::static_, m_line };
                 }
                 else if (buf == "if") {
-                    tokens.push_back({ TokenType::if_, line_count });
-                    buf.clear();
+                    return Token { TokenType::if_, m_line };
                 }
                 else if (buf == "elif") {
-                    tokens.push_back({ TokenType::elif, line_count });
-                    buf.clear();
+                    return Token { TokenType::elif, m_line };
                 }
                 else if (buf == "else") {
-                    tokens.push_back({ TokenType::else_, line_count });
-                    buf.clear();
+                    return Token { TokenType::else_, m_line };
                 }
                 else {
-                    tokens.push_back({ TokenType::ident, line_count, buf });
-                    buf.clear();
+                    return Token { TokenType::ident, m_line, buf };
                 }
             }
             else if (std::isdigit(peek().value())) {
@@ -132,8 +214,7 @@ public:
                 while (peek().has_value() && std::isdigit(peek().value())) {
                     buf.push_back(consume());
                 }
-                tokens.push_back({ TokenType::int_lit, line_count, buf });
-                buf.clear();
+                return Token { TokenType::int_lit, m_line, buf };
             }
             else if (peek().value() == '/' && peek(1).has_value() && peek(1).value() == '/') {
                 consume();
@@ -160,74 +241,156 @@ public:
             }
             else if (peek().value() == '(') {
                 consume();
-                tokens.push_back({ TokenType::open_paren, line_count });
+                return Token { TokenType::open_paren, m_line };
             }
             else if (peek().value() == ')') {
                 consume();
-                tokens.push_back({ TokenType::close_paren, line_count });
+                return Token { TokenType::close_paren, m_line };
             }
             else if (peek().value() == ';') {
                 consume();
-                tokens.push_back({ TokenType::semi, line_count });
+                return Token { TokenType::semi, m_line };
+            }
+            else if (peek().value() == '=' && peek(1).has_value() && peek(1).value() == '=') {
+                consume();
+                consume();
+                return Token { TokenType::double_eq, m_line };
+            }
+            else if (peek().value() == '!' && peek(1).has_value() && peek(1).value() == '=') {
+                consume();
+                consume();
+                return Token { TokenType::bang_eq, m_line };
             }
             else if (peek().value() == '=') {
                 consume();
-                tokens.push_back({ TokenType::eq, line_count });
+                return Token { TokenType::eq, m_line };
             }
             else if (peek().value() == '+') {
                 consume();
-                tokens.push_back({ TokenType::plus, line_count });
+                return Token { TokenType::plus, m_line };
             }
             else if (peek().value() == '*') {
                 consume();
-                tokens.push_back({ TokenType::star, line_count });
+                return Token { TokenType::star, m_line };
             }
             else if (peek().value() == '-') {
                 consume();
-                tokens.push_back({ TokenType::minus, line_count });
+                return Token { TokenType::minus, m_line };
             }
             else if (peek().value() == '/') {
                 consume();
-                tokens.push_back({ TokenType::fslash, line_count });
+                return Token { TokenType::fslash, m_line };
+            }
+            else if (peek().value() == '%') {
+                consume();
+                return Token { TokenType::percent, m_line };
             }
             else if (peek().value() == '{') {
                 consume();
-                tokens.push_back({ TokenType::open_curly, line_count });
+                return Token { TokenType::open_curly, m_line };
             }
             else if (peek().value() == '}') {
                 consume();
-                tokens.push_back({ TokenType::close_curly, line_count });
+                return Token { TokenType::close_curly, m_line };
+            }
+            else if (peek().value() == '[') {
+                consume();
+                return Token { TokenType::open_bracket, m_line };
+            }
+            else if (peek().value() == ']') {
+                consume();
+                return Token { TokenType::close_bracket, m_line };
             }
             else if (peek().value() == '\n') {
                 consume();
-                line_count++;
+                m_line++;
             }
             else if (std::isspace(peek().value())) {
                 consume();
             }
             else {
-                std::cerr << "Invalid token" << std::endl;
-                exit(EXIT_FAILURE);
+                throw CompileError("Invalid token");
             }
         }
-        m_index = 0;
-        return tokens;
+        return {};
     }
 
 private:
-    [[nodiscard]] std::optional<char> peek(const size_t offset = 0) const
+    // Starts of up to `count` chunks of roughly equal size. Every start but the first directly
+    // follows a newline that is not inside a comment, found by skipping from slash to slash.
+    static std::vector<size_t> split_points(const std::string_view src, const size_t count)
+    {
+        std::vector<size_t> starts { 0 };
+        size_t pos = 0;
+        while (starts.size() < count && pos < src.size()) {
+            const size_t target = src.size() * starts.size() / count;
+            const size_t slash = src.find('/', pos);
+            if (const size_t from = std::max(pos, target); slash == std::string_view::npos || from < slash) {
+                // No comment can start in [pos, slash), so any newline there is a safe split.
+                if (const size_t newline = src.find('\n', from);
+                    newline != std::string_view::npos && newline < slash && newline + 1 < src.size()) {
+                    starts.push_back(newline + 1);
+                    pos = newline + 1;
+                    continue;
+                }
+            }
+            if (slash == std::string_view::npos) {
+                break;
+            }
+            if (slash + 1 < src.size() && src[slash + 1] == '/') {
+                // The newline ending a line comment is itself a safe split.
+                pos = std::min(src.find('\n', slash), src.size());
+            }
+            else if (slash + 1 < src.size() && src[slash + 1] == '*') {
+                const size_t end = src.find("*/", slash + 2);
+                pos = end == std::string_view::npos ? src.size() : end + 2;
+            }
+            else {
+                pos = slash + 1;
+            }
+        }
+        return starts;
+    }
+
+    [[nodiscard]] std::optional<char> peek(const size_t offset = 0)
     {
-        if (m_index + offset >= m_src.length()) {
+        if (m_index + offset >= m_view.length() && !refill(offset)) {
             return {};
         }
-        return m_src.at(m_index + offset);
+        return m_view[m_index + offset];
     }
 
     char consume()
     {
-        return m_src.at(m_index++);
+        return m_view[m_index++];
     }
 
-    const std::string m_src;
+    // Drops the consumed input and reads the next chunk. Returns whether `offset` is now in range.
+    bool refill(const size_t offset)
+    {
+        if (m_input == nullptr) {
+            return false;
+        }
+        m_src.erase(0, m_index);
+        m_index = 0;
+        while (offset >= m_src.length() && *m_input) {
+            const size_t old_length = m_src.length();
+            m_src.resize(old_length + chunk_size);
+            m_input->read(m_src.data() + old_length, chunk_size);
+            m_src.resize(old_length + static_cast<size_t>(m_input->gcount()));
+        }
+        m_view = m_src;
+        return offset < m_src.length();
+    }
+
+    static constexpr size_t chunk_size = 64 * 1024;
+    // Smaller sources are not worth the threads.
+    static constexpr size_t min_parallel_chunk = 256 * 1024;
+
+    std::string m_src {};
+    // The part of the source being scanned: all of `m_src`, or one chunk of a parallel tokenize.
+    std::string_view m_view {};
+    std::istream* m_input = nullptr;
     size_t m_index = 0;
+    int m_line = 1;
 };